@@ -0,0 +1,350 @@
+#pragma once
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    #include <unistd.h>
+#endif
+
+struct AsyncReaderStats {
+    std::string_view backend;
+    u64              reads         = 0;
+    u64              bytes         = 0;
+    u64              max_in_flight = 0;
+};
+
+// Reads exactly dst.size() bytes at `offset` unless the file ends first. Returns the bytes
+// read or -errno.
+[[nodiscard]] inline auto pread_full(int fd, u64 offset, std::span<std::byte> dst) -> i64 {
+#if defined(__linux__) || defined(__APPLE__)
+    i64 total = 0;
+    while (!dst.empty()) {
+        const auto n = ::pread(fd, dst.data(), dst.size(), static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) break;
+        dst     = dst.subspan(static_cast<size_t>(n));
+        offset += static_cast<u64>(n);
+        total  += n;
+    }
+    return total;
+#else
+    return -ENOSYS;
+#endif
+}
+
+// Positional reads completed off the caller's thread, many at a time. done(result) runs on
+// the reader's thread with the bytes read or -errno, so it must be short and must not
+// submit and wait on another read.
+class AsyncReader {
+public:
+    using Callback = std::move_only_function<void(i64)>;
+
+    virtual ~AsyncReader() = default;
+
+    virtual auto read(int fd, u64 offset, std::span<std::byte> dst, Callback done) -> void = 0;
+
+    [[nodiscard]] virtual auto stats() const -> AsyncReaderStats = 0;
+
+    [[nodiscard]] auto read_sync(int fd, u64 offset, std::span<std::byte> dst) -> i64 {
+        std::promise<i64> result;
+        auto f = result.get_future();
+        read(fd, offset, dst, [&result](i64 r) { result.set_value(r); });
+        return f.get();
+    }
+
+    // io_uring when the kernel allows it, otherwise a small pool of threads calling pread.
+    [[nodiscard]] static auto create(unsigned queue_depth) -> std::unique_ptr<AsyncReader>;
+};
+
+// Thread-pool fallback: up to `threads` preads in flight.
+class ThreadPoolReader final : public AsyncReader {
+public:
+    explicit ThreadPoolReader(unsigned threads = 4) {
+        workers_.reserve(threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_.emplace_back([this](std::stop_token stop) { work(stop); });
+        }
+    }
+
+    ~ThreadPoolReader() override {
+        for (auto& w : workers_) w.request_stop();
+        cv_.notify_all();
+        workers_.clear();
+    }
+
+    auto read(int fd, u64 offset, std::span<std::byte> dst, Callback done) -> void override {
+        {
+            std::lock_guard lock(mutex_);
+            queue_.push_back(Job { fd, offset, dst, std::move(done) });
+            ++stats_.reads;
+            stats_.bytes += dst.size();
+            stats_.max_in_flight = std::max<u64>(stats_.max_in_flight, queue_.size() + busy_);
+        }
+        cv_.notify_one();
+    }
+
+    [[nodiscard]] auto stats() const -> AsyncReaderStats override {
+        std::lock_guard lock(mutex_);
+        auto s = stats_;
+        s.backend = "threads";
+        return s;
+    }
+
+private:
+    struct Job {
+        int                  fd;
+        u64                  offset;
+        std::span<std::byte> dst;
+        Callback             done;
+    };
+
+    // Drains the queue before exiting so no callback is lost.
+    auto work(std::stop_token stop) -> void {
+        std::unique_lock lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, stop, [this] { return !queue_.empty(); });
+            if (queue_.empty()) return;
+
+            Job job = std::move(queue_.front());
+            queue_.pop_front();
+            ++busy_;
+            lock.unlock();
+
+            job.done(pread_full(job.fd, job.offset, job.dst));
+
+            lock.lock();
+            --busy_;
+        }
+    }
+
+    mutable std::mutex          mutex_;
+    std::condition_variable_any cv_;
+    std::deque<Job>             queue_;
+    size_t                      busy_ = 0;
+    AsyncReaderStats            stats_;
+    std::vector<std::jthread>   workers_;
+};
+
+#if defined(__linux__)
+
+// Raw io_uring (no liburing): submissions go straight into the shared SQ ring and one
+// thread reaps completions. In-flight reads are capped at the CQ size so it can't overflow.
+// The reaper only waits in the kernel while reads are in flight and sleeps on a condition
+// variable otherwise, so stopping it never depends on getting one more SQE through.
+class IoUringReader final : public AsyncReader {
+public:
+    [[nodiscard]] static auto create(unsigned entries) -> std::unique_ptr<IoUringReader> {
+        auto r = std::unique_ptr<IoUringReader>(new IoUringReader());
+        if (!r->setup(entries)) return nullptr;
+
+        r->reaper_ = std::thread([p = r.get()] { p->reap(); });
+        return r;
+    }
+
+    // Waits for reads still in flight, e.g. prefetches nobody is waiting on any more.
+    ~IoUringReader() override {
+        if (reaper_.joinable()) {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            work_.notify_one();
+            reaper_.join();
+        }
+
+        if (sqes_ != nullptr) ::munmap(sqes_, sqes_len_);
+        if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_len_);
+        if (sq_ptr_ != nullptr) ::munmap(sq_ptr_, sq_len_);
+        if (ring_fd_ >= 0) ::close(ring_fd_);
+    }
+
+    auto read(int fd, u64 offset, std::span<std::byte> dst, Callback done) -> void override {
+        auto req = std::make_unique<Callback>(std::move(done));
+
+        std::unique_lock lock(mutex_);
+        room_.wait(lock, [this] { return in_flight_ < cq_entries_; });
+
+        ++in_flight_;
+        ++stats_.reads;
+        stats_.bytes += dst.size();
+        stats_.max_in_flight = std::max<u64>(stats_.max_in_flight, in_flight_);
+
+        push_locked(IORING_OP_READ, fd, offset, dst, req.release());
+        lock.unlock();
+        work_.notify_one();
+    }
+
+    [[nodiscard]] auto stats() const -> AsyncReaderStats override {
+        std::lock_guard lock(mutex_);
+        auto s = stats_;
+        s.backend = "io_uring";
+        return s;
+    }
+
+private:
+    IoUringReader() = default;
+
+    [[nodiscard]] static auto enter(int fd, unsigned submit, unsigned wait, unsigned flags) -> long {
+        for (;;) {
+            const long r = ::syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+            if (r >= 0 || (errno != EINTR && errno != EAGAIN && errno != EBUSY)) return r;
+        }
+    }
+
+    auto setup(unsigned entries) -> bool {
+        io_uring_params p {};
+        ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if (ring_fd_ < 0) return false;
+
+        sq_len_ = p.sq_off.array + p.sq_entries * sizeof(u32);
+        cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+
+        auto map = [&](size_t len, u64 off) -> void* {
+            void* m = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, static_cast<off_t>(off));
+            return m == MAP_FAILED ? nullptr : m;
+        };
+
+        sq_ptr_ = map(sq_len_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == nullptr) return false;
+        cq_ptr_ = single ? sq_ptr_ : map(cq_len_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == nullptr) return false;
+
+        sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map(sqes_len_, IORING_OFF_SQES));
+        if (sqes_ == nullptr) return false;
+
+        auto* sq = static_cast<std::byte*>(sq_ptr_);
+        auto* cq = static_cast<std::byte*>(cq_ptr_);
+        sq_tail_  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask_  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cq_head_  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail_  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask_  = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes_     = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+        cq_entries_ = p.cq_entries;
+        return true;
+    }
+
+    // Queues one SQE and hands it to the kernel.
+    auto push_locked(u8 op, int fd, u64 offset, std::span<std::byte> dst, Callback* req) -> void {
+        const unsigned tail = *sq_tail_;
+        const unsigned idx  = tail & sq_mask_;
+
+        io_uring_sqe& sqe = sqes_[idx];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode    = op;
+        sqe.fd        = fd;
+        sqe.off       = offset;
+        sqe.addr      = reinterpret_cast<u64>(dst.data());
+        sqe.len       = static_cast<u32>(dst.size());
+        sqe.user_data = reinterpret_cast<u64>(req);
+
+        sq_array_[idx] = idx;
+        std::atomic_ref(*sq_tail_).store(tail + 1, std::memory_order_release);
+
+        if (enter(ring_fd_, 1, 0, 0) < 0) {
+            // The kernel refused the SQE; fail the read rather than leave its caller waiting.
+            std::atomic_ref(*sq_tail_).store(tail, std::memory_order_release);
+            --in_flight_;
+            const int e = errno;
+            (*req)(-e);
+            delete req;
+        }
+    }
+
+    // Reads counted in in_flight_ were all handed to the kernel (a failed submission is
+    // taken back under the same lock), so each one waited for here does complete.
+    auto reap() -> void {
+        std::vector<std::pair<Callback*, i64>> done;
+
+        for (;;) {
+            {
+                std::unique_lock lock(mutex_);
+                work_.wait(lock, [this] { return in_flight_ > 0 || stopping_; });
+                if (in_flight_ == 0) return;
+            }
+            if (enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0) return;
+
+            // Completions are reaped under the submission lock: the kernel orders a CQE after
+            // its SQE, but race detectors can't see through the ring.
+            std::unique_lock lock(mutex_);
+
+            unsigned head = *cq_head_;
+            const unsigned tail = std::atomic_ref(*cq_tail_).load(std::memory_order_acquire);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+                done.emplace_back(reinterpret_cast<Callback*>(cqe.user_data), cqe.res);
+            }
+            std::atomic_ref(*cq_head_).store(head, std::memory_order_release);
+
+            in_flight_ -= done.size();
+            lock.unlock();
+            room_.notify_all();
+
+            for (auto [req, res] : done) {
+                (*req)(res);
+                delete req;
+            }
+            done.clear();
+        }
+    }
+
+    int           ring_fd_  = -1;
+    void*         sq_ptr_   = nullptr;
+    void*         cq_ptr_   = nullptr;
+    size_t        sq_len_   = 0;
+    size_t        cq_len_   = 0;
+    io_uring_sqe* sqes_     = nullptr;
+    size_t        sqes_len_ = 0;
+
+    unsigned*     sq_tail_  = nullptr;
+    unsigned*     sq_array_ = nullptr;
+    unsigned      sq_mask_  = 0;
+    unsigned*     cq_head_  = nullptr;
+    unsigned*     cq_tail_  = nullptr;
+    io_uring_cqe* cqes_     = nullptr;
+    unsigned      cq_mask_  = 0;
+    unsigned      cq_entries_ = 0;
+
+    mutable std::mutex      mutex_;   // serialises submission; guards in_flight_, stopping_ and stats_
+    std::condition_variable room_;
+    std::condition_variable work_;    // reads were submitted, or the reader is stopping
+    size_t                  in_flight_ = 0;
+    bool                    stopping_  = false;
+    AsyncReaderStats        stats_;
+    std::thread             reaper_;
+};
+
+#endif
+
+inline auto AsyncReader::create(unsigned queue_depth) -> std::unique_ptr<AsyncReader> {
+#if defined(__linux__)
+    if (auto ring = IoUringReader::create(queue_depth)) return ring;
+#endif
+    return std::make_unique<ThreadPoolReader>(std::clamp(queue_depth / 8, 2u, 8u));
+}
@@ -0,0 +1,487 @@
+#pragma once
+
+#include "absl/container/flat_hash_map.h"
+
+#include "huge_page_allocator.hh"
+#include "option.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+struct BufferPoolOptions {
+    size_t frame_bytes   = 256 << 10;   // chunks larger than a frame bypass the pool
+    f64    scan_fraction = 0.25;        // queries touching more than this share of the frames count as scans
+    u32    io_depth      = 64;          // reads in flight at once
+    bool   direct_io     = true;        // O_DIRECT into the frames, bypassing the page cache
+};
+
+struct BufferPoolStats {
+    u64 frames         = 0;
+    u64 frame_bytes    = 0;
+    u64 hits           = 0;
+    u64 misses         = 0;
+    u64 evictions      = 0;
+    u64 bypasses       = 0;   // too large for a frame, or every frame pinned
+    u64 hot            = 0;
+    u64 cold           = 0;   // resident cold pages
+    u64 non_resident   = 0;   // evicted pages still being tracked in their test period
+    u64 cold_target    = 0;   // CLOCK-Pro's adaptive m_c
+};
+
+// Identifies one chunk of one file.
+struct PageKey {
+    u64 file   = 0;
+    u64 offset = 0;
+
+    friend bool operator==(const PageKey&, const PageKey&) = default;
+
+    template <typename H>
+    friend H AbslHashValue(H h, const PageKey& k) {
+        return H::combine(std::move(h), k.file, k.offset);
+    }
+};
+
+// Fixed set of equally sized frames carved from a HugePageAlloc, managed with CLOCK-Pro
+// (Jiang, Chen, Zhang; USENIX ATC '05). Pages start cold and only become hot when they are
+// re-referenced during their test period, so a one-off scan cycles through the cold
+// pages and leaves the hot working set alone. Pages admitted by a scan skip the test
+// period entirely, so they are the first to go.
+//
+// Pinned pages are never evicted. Misses are filled outside the lock; concurrent
+// requests for a page that is still loading wait for it.
+class BufferPool {
+public:
+    constexpr static u32 npos = std::numeric_limits<u32>::max();
+
+    template <std::size_t NumPages, std::size_t PageSize = Huge2MB>
+    [[nodiscard]] static auto create(BufferPoolOptions opts = {}) -> std::unique_ptr<BufferPool> {
+        auto alloc = std::make_shared<HugePageAlloc<NumPages, PageSize>>();
+
+        std::vector<std::byte*> frames;
+        while (auto* p = alloc->allocate(opts.frame_bytes, 4096)) {
+            frames.push_back(static_cast<std::byte*>(p));
+        }
+
+        auto stats_fn = [a = alloc.get()] { return a->stats("buffer_pool"); };
+        return std::unique_ptr<BufferPool>(new BufferPool(opts, std::move(frames), std::move(alloc), stats_fn));
+    }
+
+    BufferPool(const BufferPool&)            = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Called once a page that was still being filled is ready.
+    using Ready = std::move_only_function<void()>;
+
+    enum class PinState : u8 {
+        Hit,    // pinned and readable
+        Fill,   // pinned on a new frame: write it through frame(), then call complete()
+        Busy,   // another caller is still filling it; nothing is pinned
+    };
+
+    struct Pinned {
+        u32      slot;
+        PinState state;
+    };
+
+    // Pins the page for `key`, taking a frame for it on a miss. `footprint` is how many pages
+    // the calling query expects to touch; large ones are admitted as scans. Returns None if
+    // the page has to bypass the pool. A page someone else is still filling is waited for,
+    // unless `busy` is given: then *busy (if non-empty) is queued to run once the page is
+    // ready and the call returns Busy straight away.
+    [[nodiscard]] auto acquire(PageKey key, size_t size, size_t footprint, Ready* busy = nullptr) -> Option<Pinned> {
+        if (size > opts_.frame_bytes) {
+            std::lock_guard lock(mutex_);
+            ++stats_.bypasses;
+            return None;
+        }
+
+        const bool scan = static_cast<f64>(footprint) > opts_.scan_fraction * static_cast<f64>(frames_.size());
+
+        std::unique_lock lock(mutex_);
+        for (;;) {
+            auto it = index_.find(key);
+            if (it == index_.end() || entries_[it->second].frame == npos) break;
+
+            Entry& e = entries_[it->second];
+            if (e.loading) {
+                if (busy != nullptr) {
+                    if (*busy) waiters_[it->second].push_back(std::move(*busy));
+                    return Some(Pinned { it->second, PinState::Busy });
+                }
+                loaded_.wait(lock);
+                continue;
+            }
+
+            e.ref = true;
+            ++e.pins;
+            ++stats_.hits;
+            return Some(Pinned { it->second, PinState::Hit });
+        }
+
+        ++stats_.misses;
+
+        const u32 frame = take_frame();
+        if (frame == npos) {
+            ++stats_.bypasses;
+            return None;
+        }
+
+        // Taking a frame can move the hands past (and drop) this key's history, so look again.
+        u32 id;
+        if (auto it = index_.find(key); it != index_.end()) {
+            id = it->second;
+            Entry& e = entries_[id];
+
+            // Re-referenced while non-resident in its test period: the cold set is too small.
+            cold_target_ = std::min(cold_target_ + 1, std::max<size_t>(1, frames_.size() - 1));
+            --non_resident_;
+            e.test = false;
+            e.hot  = true;
+            ++hot_;
+            move_to_head(id);
+        } else {
+            id = new_entry(key);
+            Entry& e = entries_[id];
+            e.test = !scan;
+            ++cold_;
+            insert_at_head(id);
+        }
+
+        {
+            Entry& e = entries_[id];
+            e.frame   = frame;
+            e.size    = static_cast<u32>(size);
+            e.ref     = false;
+            e.pins    = 1;
+            e.loading = true;
+        }
+
+        while (hot_ > hot_target()) {
+            if (!run_hand_hot()) break;
+        }
+
+        return Some(Pinned { id, PinState::Fill });
+    }
+
+    // Publishes a frame filled after acquire(). On failure the page and its pin are dropped.
+    auto complete(u32 id, bool ok) -> void {
+        std::vector<Ready> ready;
+        {
+            std::lock_guard lock(mutex_);
+            Entry& e = entries_[id];
+            e.loading = false;
+            if (!ok) {
+                free_.push_back(e.frame);
+                (e.hot ? hot_ : cold_) -= 1;
+                remove(id);
+            }
+            if (auto it = waiters_.find(id); it != waiters_.end()) {
+                ready = std::move(it->second);
+                waiters_.erase(it);
+            }
+        }
+        loaded_.notify_all();
+        for (auto& r : ready) r();
+    }
+
+    // acquire() and, on a miss, fill(frame) -> bool right away.
+    template <typename Fill>
+    [[nodiscard]] auto pin(PageKey key, size_t size, size_t footprint, Fill&& fill) -> Option<u32> {
+        auto p = acquire(key, size, footprint);
+        if (p.is_none()) return None;
+
+        const auto [id, state] = p.unwrap();
+        if (state == PinState::Fill) {
+            const bool ok = fill(frame(id));
+            complete(id, ok);
+            if (!ok) return None;
+        }
+        return Some(id);
+    }
+
+    // The whole frame behind a pinned page, for filling it.
+    [[nodiscard]] auto frame(u32 id) const -> std::span<std::byte> {
+        std::lock_guard lock(mutex_);
+        return { frames_[entries_[id].frame], opts_.frame_bytes };
+    }
+
+    auto unpin(u32 id) noexcept -> void {
+        std::lock_guard lock(mutex_);
+        --entries_[id].pins;
+    }
+
+    [[nodiscard]] auto bytes(u32 id) const -> std::span<const std::byte> {
+        std::lock_guard lock(mutex_);
+        const Entry& e = entries_[id];
+        return { frames_[e.frame], e.size };
+    }
+
+    // Drops every page of a file that is going away. None of them can be pinned.
+    auto forget(u64 file) -> void {
+        std::lock_guard lock(mutex_);
+        for (u32 id = 0; id < entries_.size(); ++id) {
+            Entry& e = entries_[id];
+            if (!e.live || e.key.file != file) continue;
+
+            if (e.frame != npos) {
+                free_.push_back(e.frame);
+                (e.hot ? hot_ : cold_) -= 1;
+            } else {
+                --non_resident_;
+            }
+            remove(id);
+        }
+    }
+
+    [[nodiscard]] auto stats() const -> BufferPoolStats {
+        std::lock_guard lock(mutex_);
+        auto s = stats_;
+        s.frames       = frames_.size();
+        s.frame_bytes  = opts_.frame_bytes;
+        s.hot          = hot_;
+        s.cold         = cold_;
+        s.non_resident = non_resident_;
+        s.cold_target  = cold_target_;
+        return s;
+    }
+
+    [[nodiscard]] auto allocator_stats() const -> AllocatorStats { return alloc_stats_(); }
+
+    [[nodiscard]] auto frame_bytes() const -> size_t { return opts_.frame_bytes; }
+    [[nodiscard]] auto direct_io()   const -> bool   { return opts_.direct_io; }
+    [[nodiscard]] auto io_depth()    const -> u32    { return opts_.io_depth; }
+
+    // For ChunkPin: releases a pin taken through pin().
+    static auto release(void* pool, u32 id) noexcept -> void {
+        static_cast<BufferPool*>(pool)->unpin(id);
+    }
+
+private:
+    struct Entry {
+        PageKey key;
+        u32     prev    = npos;
+        u32     next    = npos;
+        u32     frame   = npos;   // npos: non-resident, only its test period is tracked
+        u32     size    = 0;
+        u32     pins    = 0;
+        bool    live    = false;
+        bool    hot     = false;
+        bool    ref     = false;
+        bool    test    = false;
+        bool    loading = false;
+    };
+
+    template <typename StatsFn>
+    BufferPool(BufferPoolOptions opts, std::vector<std::byte*> frames, std::shared_ptr<void> alloc, StatsFn stats_fn)
+        : opts_(opts)
+        , frames_(std::move(frames))
+        , alloc_(std::move(alloc))
+        , alloc_stats_(std::move(stats_fn))
+        , cold_target_(std::max<size_t>(1, frames_.size() / 100))
+    {
+        free_.reserve(frames_.size());
+        for (u32 i = static_cast<u32>(frames_.size()); i-- > 0;) free_.push_back(i);
+    }
+
+    [[nodiscard]] auto hot_target() const -> size_t {
+        return frames_.size() > cold_target_ ? frames_.size() - cold_target_ : 0;
+    }
+
+    [[nodiscard]] auto new_entry(PageKey key) -> u32 {
+        u32 id;
+        if (!free_entries_.empty()) {
+            id = free_entries_.back();
+            free_entries_.pop_back();
+        } else {
+            id = static_cast<u32>(entries_.size());
+            entries_.emplace_back();
+        }
+        entries_[id] = Entry { .key = key, .live = true };
+        index_.emplace(key, id);
+        return id;
+    }
+
+    // The list head sits just behind the hot hand, so new pages are the last it reaches.
+    auto insert_at_head(u32 id) -> void {
+        Entry& e = entries_[id];
+        if (hand_hot_ == npos) {
+            e.prev = e.next = id;
+            hand_hot_ = hand_cold_ = hand_test_ = id;
+            return;
+        }
+
+        const u32 next = hand_hot_;
+        const u32 prev = entries_[next].prev;
+        e.prev = prev;
+        e.next = next;
+        entries_[prev].next = id;
+        entries_[next].prev = id;
+    }
+
+    auto unlink(u32 id) -> void {
+        Entry& e = entries_[id];
+        if (e.next == id) {
+            hand_hot_ = hand_cold_ = hand_test_ = npos;
+        } else {
+            for (u32* hand : { &hand_hot_, &hand_cold_, &hand_test_ }) {
+                if (*hand == id) *hand = e.next;
+            }
+            entries_[e.prev].next = e.next;
+            entries_[e.next].prev = e.prev;
+        }
+        e.prev = e.next = npos;
+    }
+
+    auto move_to_head(u32 id) -> void {
+        unlink(id);
+        insert_at_head(id);
+    }
+
+    auto remove(u32 id) -> void {
+        unlink(id);
+        index_.erase(entries_[id].key);
+        entries_[id].live = false;
+        free_entries_.push_back(id);
+    }
+
+    [[nodiscard]] auto take_frame() -> u32 {
+        if (free_.empty()) {
+            // Two laps clear every reference bit; if nothing is free by then, all is pinned.
+            for (size_t steps = 0, limit = 2 * (entries_.size() + 1); free_.empty() && steps < limit; ++steps) {
+                run_hand_cold();
+            }
+            if (free_.empty()) return npos;
+        }
+
+        const u32 f = free_.back();
+        free_.pop_back();
+        return f;
+    }
+
+    // One step of HAND_cold: reclaims an unreferenced resident cold page, or gives a
+    // referenced one a test period (promoting it if it was already in one).
+    auto run_hand_cold() -> void {
+        if (hand_cold_ == npos) return;
+
+        const u32 id = hand_cold_;
+        Entry& e = entries_[id];
+        hand_cold_ = e.next;
+
+        if (e.hot || e.frame == npos || e.pins > 0 || e.loading) return;
+
+        if (e.ref) {
+            e.ref = false;
+            if (e.test) {
+                e.test = false;
+                e.hot  = true;
+                --cold_;
+                ++hot_;
+                move_to_head(id);
+                while (hot_ > hot_target()) {
+                    if (!run_hand_hot()) break;
+                }
+            } else {
+                e.test = true;
+                move_to_head(id);
+            }
+            return;
+        }
+
+        free_.push_back(e.frame);
+        e.frame = npos;
+        --cold_;
+        ++stats_.evictions;
+
+        if (e.test) {
+            ++non_resident_;
+            while (non_resident_ > frames_.size()) {
+                if (!run_hand_test()) break;
+            }
+        } else {
+            remove(id);
+        }
+    }
+
+    // One sweep of HAND_hot until it demotes an unreferenced hot page to cold. Cold pages
+    // it passes lose their test period; non-resident ones are forgotten.
+    auto run_hand_hot() -> bool {
+        for (size_t steps = 0, limit = 2 * entries_.size(); hand_hot_ != npos && steps < limit; ++steps) {
+            const u32 id = hand_hot_;
+            Entry& e = entries_[id];
+            hand_hot_ = e.next;
+
+            if (e.hot) {
+                if (e.ref || e.pins > 0) {
+                    e.ref = false;
+                    continue;
+                }
+                e.hot  = false;
+                e.test = false;
+                --hot_;
+                ++cold_;
+                return true;
+            }
+
+            if (e.frame == npos) {
+                --non_resident_;
+                remove(id);
+            } else {
+                e.test = false;
+            }
+        }
+        return false;
+    }
+
+    // One sweep of HAND_test until it ends a test period. An unused test period means the
+    // cold set was big enough, so its target shrinks.
+    auto run_hand_test() -> bool {
+        for (size_t steps = 0, limit = 2 * entries_.size(); hand_test_ != npos && steps < limit; ++steps) {
+            const u32 id = hand_test_;
+            Entry& e = entries_[id];
+            hand_test_ = e.next;
+
+            if (e.hot || !e.test) continue;
+
+            e.test = false;
+            cold_target_ = std::max<size_t>(1, cold_target_ - 1);
+            if (e.frame == npos) {
+                --non_resident_;
+                remove(id);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    BufferPoolOptions                opts_;
+    std::vector<std::byte*>          frames_;
+    std::shared_ptr<void>            alloc_;
+    std::function<AllocatorStats()>  alloc_stats_;
+
+    mutable std::mutex               mutex_;
+    std::condition_variable          loaded_;
+
+    std::vector<Entry>               entries_;
+    std::vector<u32>                 free_entries_;
+    absl::flat_hash_map<PageKey, u32> index_;
+    absl::flat_hash_map<u32, std::vector<Ready>> waiters_;   // by page, while it is being filled
+    std::vector<u32>                 free_;
+
+    u32    hand_hot_     = npos;
+    u32    hand_cold_    = npos;
+    u32    hand_test_    = npos;
+    size_t hot_          = 0;
+    size_t cold_         = 0;
+    size_t non_resident_ = 0;
+    size_t cold_target_;
+
+    BufferPoolStats stats_;
+};
@@ -0,0 +1,356 @@
+// tsdb_codec_check: round-trips every column codec over edge-case columns, then checks
+// that aggregates, range filters and row reads answered from encoded chunks and from
+// precomputed aggregates match a plain scan of the rows that were inserted. Prints each
+// mismatch and exits 1 if there were any.
+//
+//   tsdb_codec_check
+
+#include "tsdb.hh"
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <limits>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+u64 failures = 0;
+
+auto fail(const std::string& what) -> void {
+    ++failures;
+    std::println(stderr, "{}", what);
+}
+
+struct Kind {
+    Schema::TypeKind kind;
+    size_t           size;
+    std::string_view name;
+};
+
+constexpr std::array kinds {
+    Kind { Schema::TypeKind::U8,           1, "u8"   },
+    Kind { Schema::TypeKind::U16,          2, "u16"  },
+    Kind { Schema::TypeKind::U32,          4, "u32"  },
+    Kind { Schema::TypeKind::U64,          8, "u64"  },
+    Kind { Schema::TypeKind::I8,           1, "i8"   },
+    Kind { Schema::TypeKind::I16,          2, "i16"  },
+    Kind { Schema::TypeKind::I32,          4, "i32"  },
+    Kind { Schema::TypeKind::I64,          8, "i64"  },
+    Kind { Schema::TypeKind::BOOL,         1, "bool" },
+    Kind { Schema::TypeKind::TIMESTAMP_NS, 8, "ts"   },
+    Kind { Schema::TypeKind::F32,          4, "f32"  },
+    Kind { Schema::TypeKind::F64,          8, "f64"  },
+};
+
+constexpr std::array encodings {
+    Encoding::Raw, Encoding::Delta, Encoding::Xor, Encoding::BitPack, Encoding::Dict, Encoding::Rle,
+};
+
+struct Column {
+    std::string_view       name;
+    std::vector<std::byte> raw;
+};
+
+auto push(std::vector<std::byte>& raw, size_t size, u64 bits) -> void {
+    const size_t at = raw.size();
+    raw.resize(at + size);
+    std::memcpy(raw.data() + at, &bits, size);   // low bytes; little-endian only, like the codecs
+}
+
+auto push_float(std::vector<std::byte>& raw, size_t size, f64 v) -> void {
+    if (size == sizeof(f32)) push(raw, size, std::bit_cast<u32>(static_cast<f32>(v)));
+    else                     push(raw, size, std::bit_cast<u64>(v));
+}
+
+// Columns of one element size that codecs tend to get wrong: nothing, one value, one long
+// run, both ends of the 64-bit range (sign bits, all ones), wrap-around steps and, for
+// floats, NaN payloads, signed zeros and infinities.
+auto edge_columns(const Kind& k, std::mt19937_64& rng) -> std::vector<Column> {
+    const size_t sz   = k.size;
+    const u64    ones = sz == 8 ? ~u64{0} : (u64{1} << (sz * 8)) - 1;
+    const u64    sign = u64{1} << (sz * 8 - 1);
+
+    std::vector<Column> out;
+    out.push_back({ "empty", {} });
+
+    out.push_back({ "one value", {} });
+    push(out.back().raw, sz, sign | 5);
+
+    out.push_back({ "single run", {} });
+    for (size_t i = 0; i < 5000; ++i) push(out.back().raw, sz, ones - 1);
+
+    out.push_back({ "extremes", {} });
+    const u64 extremes[] = { 0, ones, sign, sign - 1 };
+    for (size_t i = 0; i < 3000; ++i) push(out.back().raw, sz, extremes[rng() % std::size(extremes)]);
+
+    out.push_back({ "wrapping ramp", {} });
+    for (size_t i = 0; i < 3000; ++i) push(out.back().raw, sz, (ones - 1000 + i * 7) & ones);
+
+    out.push_back({ "runs", {} });
+    for (u64 v = rng(); out.back().raw.size() < 4000 * sz;) {
+        if (rng() % 50 == 0) v = rng() % 9;
+        push(out.back().raw, sz, v);
+    }
+
+    out.push_back({ "random", {} });
+    for (size_t i = 0; i < 3000; ++i) push(out.back().raw, sz, rng());
+
+    if (is_floating(k.kind)) {
+        const f64 specials[] = {
+            std::numeric_limits<f64>::quiet_NaN(), -std::numeric_limits<f64>::quiet_NaN(),
+            0.0, -0.0, std::numeric_limits<f64>::infinity(), -std::numeric_limits<f64>::infinity(),
+            std::numeric_limits<f64>::denorm_min(), std::numeric_limits<f64>::max(), 1.5, -1.5,
+        };
+        out.push_back({ "nan and zeros", {} });
+        for (size_t i = 0; i < 3000; ++i) push_float(out.back().raw, sz, specials[rng() % std::size(specials)]);
+
+        out.push_back({ "nan payloads", {} });
+        for (size_t i = 0; i < 1000; ++i) {
+            const u64 payload = rng() | 1;
+            push(out.back().raw, sz, sz == 8 ? (u64{0x7ff} << 52) | (payload >> 12) : (u64{0xff} << 23) | (payload >> 41));
+        }
+    }
+    return out;
+}
+
+auto check_round_trip(const Kind& k, Encoding e, const Column& col) -> void {
+    const size_t n = col.raw.size() / k.size;
+
+    std::vector<std::byte> encoded;
+    encode(e, k.kind, k.size, col.raw, encoded);
+
+    std::vector<std::byte> decoded(col.raw.size());
+    decode(e, k.size, encoded, n, decoded.data());
+    if (decoded != col.raw) {
+        fail(std::format("{} {} on {}: decode differs", encoding_name(e), k.name, col.name));
+        return;
+    }
+
+    std::array<std::byte, 8> one {};
+    for (size_t i = 0; i < n; ++i) {
+        if (!decode_row(e, k.size, encoded, i, one.data())) return;   // only whole-chunk decodes
+        if (std::memcmp(one.data(), col.raw.data() + i * k.size, k.size) != 0) {
+            fail(std::format("{} {} on {}: row {} differs", encoding_name(e), k.name, col.name, i));
+            return;
+        }
+    }
+}
+
+auto check_codecs(std::mt19937_64& rng) -> void {
+    for (const Kind& k : kinds) {
+        for (const Column& col : edge_columns(k, rng)) {
+            for (Encoding e : encodings) {
+                if (supports(e, k.kind)) check_round_trip(k, e, col);
+            }
+
+            for (EncodingPolicy policy : { EncodingPolicy::Ratio, EncodingPolicy::Speed }) {
+                std::vector<std::byte> encoded;
+                const Encoding e = encode_best(k.kind, k.size, col.raw, encoded, policy);
+                std::vector<std::byte> decoded(col.raw.size());
+                decode(e, k.size, encoded, col.raw.size() / k.size, decoded.data());
+                if (decoded != col.raw) fail(std::format("encode_best ({}) {} on {}: decode differs", encoding_name(e), k.name, col.name));
+            }
+        }
+    }
+}
+
+// One column per codec the query paths work on without decoding, shaped so the codec
+// chooser picks it; `wide` sits past 2^53, where bit-packed filters fall back to a scan.
+struct Sample {
+    i64 timestamp_ns;
+    f64 level;     // long runs of set points, one NaN near the end: rle
+    i32 mode;      // a handful of values in short runs: dict
+    u32 reading;   // uniform over a small range: bitpack
+    i64 wide;      // bit-packed, but too large for f64 to compare exactly
+    f32 noise;     // left raw or xor
+};
+
+auto value(const Sample& s, std::string_view field) -> f64 {
+    if (field == "level")   return s.level;
+    if (field == "mode")    return s.mode;
+    if (field == "reading") return s.reading;
+    if (field == "wide")    return static_cast<f64>(s.wide);
+    return s.noise;
+}
+
+auto same(Option<f64> got, Option<f64> want) -> bool {
+    if (got.is_some() != want.is_some()) return false;
+    if (got.is_none()) return true;
+
+    const f64 g = got.unwrap(), w = want.unwrap();
+    if (std::isnan(w)) return std::isnan(g);
+    if (g == w) return true;   // also infinities, whose difference is NaN
+    return std::abs(g - w) <= 1e-9 * std::max(1.0, std::abs(w));
+}
+
+auto check_queries(TSDB& db, TypeHandle h, const std::vector<Sample>& rows, std::string_view tier) -> void {
+    constexpr std::array fields { "level", "mode", "reading", "wide", "noise" };
+    constexpr std::array aggs   { Agg::Count, Agg::Sum, Agg::Min, Agg::Max };
+
+    const i64 end = rows.back().timestamp_ns + 1;
+    // The NaN in `level` only falls in the last span, so the others check its sums too; the
+    // second one covers whole compacted segments, the third cuts through them.
+    const std::pair<i64, i64> spans[] = {
+        { 0, end }, { 0, i64{1 << 18} * 1000 }, { end / 3 + 17, end / 3 * 2 - 5 }, { end - 1000, end },
+    };
+    const std::pair<f64, f64> ranges[] = {
+        { 10.0, 12.5 }, { -2000.0, -1000.0 }, { 0.0, 0.0 }, { 500.0, 20'000.0 },
+        { -1e308, 1e308 }, { 0x1p60, 0x1p60 + 4096.0 }, { std::nan(""), 5.0 },
+    };
+
+    for (auto [t0, t1] : spans) {
+        for (std::string_view field : fields) {
+            for (Agg agg : aggs) {
+                AggState want;
+                for (const Sample& s : rows) {
+                    if (s.timestamp_ns >= t0 && s.timestamp_ns < t1) want.add(value(s, field));
+                }
+                const auto got = db.aggregate(h, field, t0, t1, agg);
+                if (!same(got, want.finish(agg))) {
+                    fail(std::format("{}: aggregate {} #{} over [{}, {}): {} vs {}", tier, field, std::to_underlying(agg), t0, t1,
+                         got.unwrap_or(-1.0), want.finish(agg).unwrap_or(-1.0)));
+                }
+            }
+
+            for (auto [lo, hi] : ranges) {
+                size_t want = 0;
+                for (const Sample& s : rows) {
+                    const f64 v = value(s, field);
+                    if (s.timestamp_ns >= t0 && s.timestamp_ns < t1 && v >= lo && v <= hi) ++want;
+                }
+                const auto got = db.query_where<Sample>(h, field, lo, hi, t0, t1);
+                if (got.size() != want) fail(std::format("{}: {} in [{}, {}]: {} rows vs {}", tier, field, lo, hi, got.size(), want));
+            }
+        }
+    }
+
+    for (u64 r = 0; r < rows.size(); r += 97) {
+        const auto got = db.query_row<Sample>(h, r);
+        const Sample& w = rows[r];
+        if (got.is_none()) {
+            fail(std::format("{}: row {} missing", tier, r));
+            continue;
+        }
+        const Sample g = got.unwrap();
+        if (g.timestamp_ns != w.timestamp_ns || std::bit_cast<u64>(g.level) != std::bit_cast<u64>(w.level) ||
+            g.mode != w.mode || g.reading != w.reading || g.wide != w.wide || std::bit_cast<u32>(g.noise) != std::bit_cast<u32>(w.noise))
+        {
+            fail(std::format("{}: row {} differs", tier, r));
+        }
+    }
+}
+
+auto check_encoded_queries(std::mt19937_64& rng) -> void {
+    TSDB db;
+    const auto h = db.register_struct("Sample", {
+        { "level", TSDB::F64 }, { "mode", TSDB::I32 }, { "reading", TSDB::U32 }, { "wide", TSDB::I64 }, { "noise", TSDB::F32 },
+    });
+
+    constexpr size_t n = 300'000;
+    std::vector<Sample> rows;
+    rows.reserve(n);
+    f64 level = 20.0;
+    for (size_t i = 0; i < n; ++i) {
+        if (rng() % 4000 == 0) level = static_cast<f64>(rng() % 50) * 0.5;
+        rows.push_back({
+            .timestamp_ns = static_cast<i64>(i) * 1000,
+            .level        = i == n - 1000 ? std::nan("") : level,
+            .mode         = static_cast<i32>(rng() % 5) * 1000 - 2000,
+            .reading      = static_cast<u32>(rng() % 20'000),
+            .wide         = (i64{1} << 60) + static_cast<i64>(rng() % 100'000),
+            .noise        = static_cast<f32>(rng() % 100'000) / 7.0f,
+        });
+    }
+    if (db.insert_batch(std::span<const Sample>(rows), h).is_err()) {
+        fail("insert refused");
+        return;
+    }
+    db.compact({ .min_rows = n, .target_rows = 1 << 16 });
+
+    // Without the codec under test the checks below would pass vacuously.
+    const std::pair<std::string_view, Encoding> expected[] = {
+        { "level", Encoding::Rle }, { "mode", Encoding::Dict }, { "reading", Encoding::BitPack }, { "wide", Encoding::BitPack },
+    };
+    const TSDBStats stats = db.stats();
+    for (const auto& c : stats.tables.front().columns) {
+        for (auto [name, e] : expected) {
+            if (c.name == name && c.encoding != e) fail(std::format("{} stored as {}, not {}", name, encoding_name(c.encoding), encoding_name(e)));
+        }
+    }
+
+    check_queries(db, h, rows, "encoded");
+
+    const auto dir = std::filesystem::temp_directory_path() / std::format("tsdb_codec_check_{}", rng());
+    db.enforce_tiers({ .dir = dir, .hot_bytes = 0, .memory_bytes = 1 });
+    check_queries(db, h, rows, "cold");
+}
+
+// Values that break plain prefix sums: a huge one that absorbs the small ones after it, and
+// infinities and a NaN that would poison every range after them.
+struct Spike {
+    i64 timestamp_ns;
+    u64 big;
+    f64 spiky;
+};
+
+auto check_aggregate_index() -> void {
+    TSDB db;
+    const auto h = db.register_struct("Spike", { { "big", TSDB::U64 }, { "spiky", TSDB::F64 } });
+    db.precompute_aggregates(h, "big");
+    db.precompute_aggregates(h, "spiky");
+
+    constexpr size_t n = 4096;
+    std::vector<Spike> rows;
+    for (size_t i = 0; i < n; ++i) {
+        f64 spiky = 1.0;
+        if (i == 0)    spiky = std::numeric_limits<f64>::infinity();
+        if (i == 1000) spiky = -std::numeric_limits<f64>::infinity();
+        if (i == 3000) spiky = std::nan("");
+        if (i == 2000) spiky = 1e300;
+        rows.push_back({ .timestamp_ns = static_cast<i64>(i), .big = i == 0 || i == 2500 ? u64{1} << 62 : 3, .spiky = spiky });
+    }
+    if (db.insert_batch(std::span<const Spike>(rows), h).is_err()) {
+        fail("insert refused");
+        return;
+    }
+    db.flush(h);
+
+    const std::pair<i64, i64> spans[] = { { 1, 256 }, { 1, 1000 }, { 1, 1001 }, { 500, 2600 }, { 2001, 2999 }, { 3001, 4096 }, { 0, 4096 } };
+    for (auto [t0, t1] : spans) {
+        for (std::string_view field : { "big", "spiky" }) {
+            for (Agg agg : { Agg::Sum, Agg::Min, Agg::Max }) {
+                AggState want;
+                for (i64 t = t0; t < t1; ++t) {
+                    want.add(field == "big" ? static_cast<f64>(rows[static_cast<size_t>(t)].big) : rows[static_cast<size_t>(t)].spiky);
+                }
+                const auto got = db.aggregate(h, field, t0, t1, agg);
+                if (!same(got, want.finish(agg))) {
+                    fail(std::format("aggregate index: {} #{} over [{}, {}): {} vs {}", field, std::to_underlying(agg), t0, t1,
+                                     got.unwrap_or(-1.0), want.finish(agg).unwrap_or(-1.0)));
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+auto main() -> i32 {
+    std::mt19937_64 rng(0x5eed);
+
+    check_codecs(rng);
+    check_encoded_queries(rng);
+    check_aggregate_index();
+
+    std::println("codec check: {} failure{}", failures, failures == 1 ? "" : "s");
+    return failures == 0 ? 0 : 1;
+}
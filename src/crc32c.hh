@@ -0,0 +1,84 @@
+#pragma once
+
+#include "utils.hh"
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <span>
+
+#if defined(__x86_64__)
+    #include <nmmintrin.h>
+#endif
+
+namespace crc32c_detail {
+
+constexpr u32 poly = 0x82F63B78;   // Castagnoli, reflected
+
+// Slicing-by-8 tables: tables[k][b] is the CRC of byte b followed by k zero bytes.
+constexpr auto make_tables() -> std::array<std::array<u32, 256>, 8> {
+    std::array<std::array<u32, 256>, 8> t {};
+    for (u32 b = 0; b < 256; ++b) {
+        u32 crc = b;
+        for (int i = 0; i < 8; ++i) crc = (crc >> 1) ^ (poly & (0u - (crc & 1)));
+        t[0][b] = crc;
+    }
+    for (size_t k = 1; k < 8; ++k) {
+        for (u32 b = 0; b < 256; ++b) t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+    }
+    return t;
+}
+
+inline constexpr auto tables = make_tables();
+
+inline auto software(u32 crc, const std::byte* p, size_t n) noexcept -> u32 {
+    for (; n >= 8; n -= 8, p += 8) {
+        u64 v;
+        std::memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = tables[7][v & 0xff]         ^ tables[6][(v >> 8) & 0xff]
+            ^ tables[5][(v >> 16) & 0xff] ^ tables[4][(v >> 24) & 0xff]
+            ^ tables[3][(v >> 32) & 0xff] ^ tables[2][(v >> 40) & 0xff]
+            ^ tables[1][(v >> 48) & 0xff] ^ tables[0][v >> 56];
+    }
+    for (; n > 0; --n, ++p) {
+        crc = tables[0][(crc ^ static_cast<u8>(*p)) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The SSE4.2 crc32 instruction, eight bytes at a time.
+__attribute__((target("sse4.2")))
+inline auto hardware(u32 crc, const std::byte* p, size_t n) noexcept -> u32 {
+    u64 c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        u64 v;
+        std::memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = static_cast<u32>(c);
+    for (; n > 0; --n, ++p) {
+        crc = _mm_crc32_u8(crc, static_cast<u8>(*p));
+    }
+    return crc;
+}
+
+inline const bool has_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+
+} // namespace crc32c_detail
+
+// CRC32C of `bytes`; pass a previous result as `crc` to extend it over more bytes. Uses the
+// SSE4.2 instruction where the CPU has it, a table-driven loop elsewhere.
+[[nodiscard]] inline auto crc32c(std::span<const std::byte> bytes, u32 crc = 0) noexcept -> u32 {
+    crc = ~crc;
+#if defined(__x86_64__)
+    crc = crc32c_detail::has_hardware
+        ? crc32c_detail::hardware(crc, bytes.data(), bytes.size())
+        : crc32c_detail::software(crc, bytes.data(), bytes.size());
+#else
+    crc = crc32c_detail::software(crc, bytes.data(), bytes.size());
+#endif
+    return ~crc;
+}
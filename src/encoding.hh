@@ -0,0 +1,720 @@
+#pragma once
+
+#include "schema.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class Encoding : u8 {
+    Raw,
+    Delta,   // zigzag varint of successive differences; integers and timestamps
+    Xor,     // XOR with the previous value, zero bytes trimmed; floats
+    BitPack, // frame of reference: offsets from the minimum in the fewest bits; integers and timestamps
+    Dict,    // each distinct value once, rows as bit-packed codes; any numeric type
+    Rle,     // runs of equal values as (end row, value); any numeric type
+};
+
+// What encode_best() optimizes for.
+enum class EncodingPolicy : u8 {
+    Ratio,   // the smallest estimated size
+    Speed,   // slower codecs have to save proportionally more to be picked over faster ones
+};
+
+[[nodiscard]] constexpr auto encoding_name(Encoding e) noexcept -> std::string_view {
+    switch (e) {
+        case Encoding::Raw:     return "raw";
+        case Encoding::Delta:   return "delta";
+        case Encoding::Xor:     return "xor";
+        case Encoding::BitPack: return "bitpack";
+        case Encoding::Dict:    return "dict";
+        case Encoding::Rle:     return "rle";
+    }
+    return "?";
+}
+
+[[nodiscard]] constexpr auto is_integral(Schema::TypeKind kind) noexcept -> bool {
+    using K = Schema::TypeKind;
+    switch (kind) {
+        case K::U8: case K::U16: case K::U32: case K::U64:
+        case K::I8: case K::I16: case K::I32: case K::I64:
+        case K::BOOL: case K::TIMESTAMP_NS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+[[nodiscard]] constexpr auto is_signed(Schema::TypeKind kind) noexcept -> bool {
+    using K = Schema::TypeKind;
+    return kind == K::I8 || kind == K::I16 || kind == K::I32 || kind == K::I64 || kind == K::TIMESTAMP_NS;
+}
+
+[[nodiscard]] constexpr auto is_floating(Schema::TypeKind kind) noexcept -> bool {
+    return kind == Schema::TypeKind::F32 || kind == Schema::TypeKind::F64;
+}
+
+namespace codec {
+
+// Integer of any width widened to 64 bits (sign- or zero-extended by kind). Little-endian only.
+[[nodiscard]] inline auto load_int(const std::byte* p, size_t size, bool sign) noexcept -> u64 {
+    u64 v = 0;
+    std::memcpy(&v, p, size);
+    if (sign && size < 8) {
+        const unsigned shift = 64 - static_cast<unsigned>(size) * 8;
+        v = static_cast<u64>(static_cast<i64>(v << shift) >> shift);
+    }
+    return v;
+}
+
+inline auto store_int(std::byte* p, size_t size, u64 v) noexcept -> void {
+    std::memcpy(p, &v, size);
+}
+
+[[nodiscard]] constexpr auto zigzag(u64 v) noexcept -> u64 {
+    return (v << 1) ^ static_cast<u64>(static_cast<i64>(v) >> 63);
+}
+
+[[nodiscard]] constexpr auto unzigzag(u64 v) noexcept -> u64 {
+    return (v >> 1) ^ (~(v & 1) + 1);
+}
+
+inline auto put_varint(std::vector<std::byte>& out, u64 v) -> void {
+    while (v >= 0x80) {
+        out.push_back(static_cast<std::byte>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<std::byte>(v));
+}
+
+[[nodiscard]] inline auto get_varint(const std::byte*& p) noexcept -> u64 {
+    u64 v = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        const auto b = static_cast<u64>(*p++);
+        v |= (b & 0x7f) << shift;
+        if (b < 0x80) return v;
+    }
+}
+
+inline auto encode_delta(std::span<const std::byte> raw, size_t size, bool sign, std::vector<std::byte>& out) -> void {
+    u64 prev = 0;
+    for (size_t off = 0; off < raw.size(); off += size) {
+        const u64 v = load_int(raw.data() + off, size, sign);
+        put_varint(out, zigzag(v - prev));
+        prev = v;
+    }
+}
+
+inline auto decode_delta(const std::byte* in, size_t rows, size_t size, std::byte* out) noexcept -> void {
+    u64 prev = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        prev += unzigzag(get_varint(in));
+        store_int(out + i * size, size, prev);
+    }
+}
+
+// One control byte per value: 0xff when equal to the previous value, otherwise
+// (leading zero bytes << 4 | trailing zero bytes) followed by the bytes in between.
+inline auto encode_xor(std::span<const std::byte> raw, size_t size, std::vector<std::byte>& out) -> void {
+    u64 prev = 0;
+    for (size_t off = 0; off < raw.size(); off += size) {
+        u64 v = 0;
+        std::memcpy(&v, raw.data() + off, size);
+
+        const u64 x = v ^ prev;
+        prev = v;
+
+        if (x == 0) {
+            out.push_back(std::byte{0xff});
+            continue;
+        }
+
+        const auto lead  = static_cast<unsigned>(std::countl_zero(x) / 8) - static_cast<unsigned>(8 - size);
+        const auto trail = static_cast<unsigned>(std::countr_zero(x) / 8);
+        out.push_back(static_cast<std::byte>(lead << 4 | trail));
+
+        const u64 mid = x >> (trail * 8);
+        for (unsigned i = 0; i < size - lead - trail; ++i) {
+            out.push_back(static_cast<std::byte>(mid >> (i * 8)));
+        }
+    }
+}
+
+inline auto decode_xor(const std::byte* in, size_t rows, size_t size, std::byte* out) noexcept -> void {
+    u64 prev = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        const auto ctrl = static_cast<unsigned>(*in++);
+        if (ctrl != 0xff) {
+            const unsigned lead  = ctrl >> 4;
+            const unsigned trail = ctrl & 0xf;
+
+            u64 mid = 0;
+            for (unsigned b = 0; b < size - lead - trail; ++b) {
+                mid |= static_cast<u64>(*in++) << (b * 8);
+            }
+            prev ^= mid << (trail * 8);
+        }
+        std::memcpy(out + i * size, &prev, size);
+    }
+}
+
+// Frame-of-reference chunks start with the column's minimum and maximum (widened as by
+// load_int()) and the width of the packed offsets, so filters and aggregates can work on
+// the offsets without decoding them. Offsets are packed LSB first; padding after them lets
+// unpack() always read whole words. Dictionary chunks pack their codes the same way.
+struct ForHeader {
+    u64      min  = 0;
+    u64      max  = 0;
+    unsigned bits = 0;
+};
+
+constexpr size_t for_header_size = 2 * sizeof(u64) + 1;
+constexpr size_t pack_padding    = sizeof(u64) + 1;
+
+[[nodiscard]] constexpr auto packed_size(size_t n, unsigned bits) noexcept -> size_t {
+    return (n * bits + 7) / 8 + pack_padding;
+}
+
+[[nodiscard]] inline auto for_header(const std::byte* in) noexcept -> ForHeader {
+    ForHeader h;
+    std::memcpy(&h.min, in, sizeof(u64));
+    std::memcpy(&h.max, in + sizeof(u64), sizeof(u64));
+    h.bits = static_cast<unsigned>(in[2 * sizeof(u64)]);
+    return h;
+}
+
+[[nodiscard]] constexpr auto low_mask(unsigned bits) noexcept -> u64 {
+    return bits >= 64 ? ~u64{0} : (u64{1} << bits) - 1;
+}
+
+// Offset i of `packed`.
+[[nodiscard]] inline auto unpack(const std::byte* packed, size_t i, unsigned bits) noexcept -> u64 {
+    const size_t   bit   = i * bits;
+    const unsigned shift = static_cast<unsigned>(bit % 8);
+
+    u64 w;
+    std::memcpy(&w, packed + bit / 8, sizeof(w));
+    w >>= shift;
+    if (shift + bits > 64) w |= static_cast<u64>(packed[bit / 8 + 8]) << (64 - shift);
+    return w & low_mask(bits);
+}
+
+// Sets value i of a zeroed packed array; v must fit in `bits`.
+inline auto pack(std::byte* packed, size_t i, unsigned bits, u64 v) noexcept -> void {
+    const size_t   bit   = i * bits;
+    const unsigned shift = static_cast<unsigned>(bit % 8);
+
+    u64 w;
+    std::memcpy(&w, packed + bit / 8, sizeof(w));
+    w |= v << shift;
+    std::memcpy(packed + bit / 8, &w, sizeof(w));
+    if (shift + bits > 64) packed[bit / 8 + 8] |= static_cast<std::byte>(v >> (64 - shift));
+}
+
+// Row offsets whose packed value lies in [lo, hi], in row order. Values are compared 64 at
+// a time into a match mask, a branch-free loop the compiler vectorizes; only set bits cost
+// a branch.
+inline auto match_packed(const std::byte* packed, unsigned bits, size_t rows, u64 lo, u64 hi, std::vector<u32>& out)
+    -> void
+{
+    const u64 width = hi - lo;
+    for (size_t base = 0; base < rows; base += 64) {
+        const size_t n = std::min<size_t>(64, rows - base);
+
+        u64 mask = 0;
+        for (size_t j = 0; j < n; ++j) {
+            const u64 v = bits > 0 ? unpack(packed, base + j, bits) : 0;
+            mask |= static_cast<u64>(v - lo <= width) << j;
+        }
+        for (; mask != 0; mask &= mask - 1) {
+            out.push_back(static_cast<u32>(base + static_cast<size_t>(std::countr_zero(mask))));
+        }
+    }
+}
+
+inline auto encode_for(std::span<const std::byte> raw, size_t size, bool sign, std::vector<std::byte>& out) -> void {
+    const size_t n = raw.size() / size;
+
+    // Offsets are taken in the signed or unsigned order the values compare in.
+    auto less = [sign](u64 a, u64 b) { return sign ? static_cast<i64>(a) < static_cast<i64>(b) : a < b; };
+    u64 lo = n > 0 ? load_int(raw.data(), size, sign) : 0, hi = lo;
+    for (size_t off = size; off < raw.size(); off += size) {
+        const u64 v = load_int(raw.data() + off, size, sign);
+        if (less(v, lo)) lo = v;
+        if (less(hi, v)) hi = v;
+    }
+    const auto bits = static_cast<unsigned>(std::bit_width(hi - lo));
+
+    const size_t base = out.size();
+    out.resize(base + for_header_size + packed_size(n, bits));
+    std::byte* p = out.data() + base;
+    std::memcpy(p, &lo, sizeof(lo));
+    std::memcpy(p + sizeof(lo), &hi, sizeof(hi));
+    p[2 * sizeof(u64)] = static_cast<std::byte>(bits);
+    if (bits == 0) return;
+
+    std::byte* packed = p + for_header_size;
+    for (size_t i = 0; i < n; ++i) {
+        pack(packed, i, bits, load_int(raw.data() + i * size, size, sign) - lo);
+    }
+}
+
+inline auto decode_for(const std::byte* in, size_t rows, size_t size, std::byte* out) noexcept -> void {
+    const ForHeader  h      = for_header(in);
+    const std::byte* packed = in + for_header_size;
+    for (size_t i = 0; i < rows; ++i) {
+        store_int(out + i * size, size, h.min + (h.bits > 0 ? unpack(packed, i, h.bits) : 0));
+    }
+}
+
+// Row offsets whose packed offset lies in [lo, hi], in row order.
+inline auto for_matches(const std::byte* in, size_t rows, u64 lo, u64 hi, std::vector<u32>& out) -> void {
+    match_packed(in + for_header_size, for_header(in).bits, rows, lo, hi, out);
+}
+
+// Sum of the packed offsets; a chunk's sum is rows * min plus this.
+[[nodiscard]] inline auto for_offset_sum(const std::byte* in, size_t rows) noexcept -> f64 {
+    const ForHeader  h      = for_header(in);
+    const std::byte* packed = in + for_header_size;
+    if (h.bits == 0) return 0.0;
+
+    // 64 offsets of up to 58 bits can't overflow a u64.
+    f64 sum = 0.0;
+    for (size_t base = 0; base < rows; base += 64) {
+        const size_t n = std::min<size_t>(64, rows - base);
+        if (h.bits > 58) {
+            for (size_t j = 0; j < n; ++j) sum += static_cast<f64>(unpack(packed, base + j, h.bits));
+            continue;
+        }
+        u64 part = 0;
+        for (size_t j = 0; j < n; ++j) part += unpack(packed, base + j, h.bits);
+        sum += static_cast<f64>(part);
+    }
+    return sum;
+}
+
+// Rows of ascending signed 8-byte values (timestamps) before t_begin and before t_end,
+// read off the delta stream: the scan stops at the first value >= t_end and nothing is
+// written out.
+[[nodiscard]] inline auto delta_bounds(const std::byte* in, size_t rows, i64 t_begin, i64 t_end) noexcept
+    -> std::pair<size_t, size_t>
+{
+    u64    prev  = 0;
+    size_t first = rows;
+    for (size_t i = 0; i < rows; ++i) {
+        prev += unzigzag(get_varint(in));
+        const auto v = static_cast<i64>(prev);
+        if (first == rows && v >= t_begin) first = i;
+        if (v >= t_end) return { std::min(first, i), i };
+    }
+    return { first, rows };
+}
+
+// delta_bounds() for a frame-of-reference chunk, by binary search over the packed offsets.
+[[nodiscard]] inline auto for_bounds(const std::byte* in, size_t rows, i64 t_begin, i64 t_end) noexcept
+    -> std::pair<size_t, size_t>
+{
+    const ForHeader  h      = for_header(in);
+    const std::byte* packed = in + for_header_size;
+
+    auto before = [&](i64 t) {
+        size_t lo = 0, hi = rows;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            const auto   v   = static_cast<i64>(h.min + (h.bits > 0 ? unpack(packed, mid, h.bits) : 0));
+            if (v < t) lo = mid + 1;
+            else       hi = mid;
+        }
+        return lo;
+    };
+    return { before(t_begin), before(t_end) };
+}
+
+// Dictionary chunks start with the number of distinct values (u32) and the width of the
+// codes, then the values in ascending numeric order (NaNs last), then each row's code
+// packed as above. Codes keep the values' order, so a value range is a code range.
+constexpr size_t dict_header_size = sizeof(u32) + 1;
+
+struct DictHeader {
+    u32              count  = 0;
+    unsigned         bits   = 0;
+    const std::byte* values = nullptr;
+    const std::byte* packed = nullptr;
+};
+
+[[nodiscard]] inline auto dict_header(const std::byte* in, size_t size) noexcept -> DictHeader {
+    DictHeader h;
+    std::memcpy(&h.count, in, sizeof(u32));
+    h.bits   = static_cast<unsigned>(in[sizeof(u32)]);
+    h.values = in + dict_header_size;
+    h.packed = h.values + size_t{h.count} * size;
+    return h;
+}
+
+inline auto encode_dict(std::span<const std::byte> raw, size_t size, Schema::TypeKind kind, std::vector<std::byte>& out)
+    -> void
+{
+    const size_t n = raw.size() / size;
+    auto bits_of = [&](size_t i) {
+        u64 v = 0;
+        std::memcpy(&v, raw.data() + i * size, size);
+        return v;
+    };
+
+    // Distinct bit patterns, so the dictionary is lossless (-0.0 and 0.0 stay apart), then
+    // put in numeric order.
+    std::vector<u64> distinct(n);
+    for (size_t i = 0; i < n; ++i) distinct[i] = bits_of(i);
+    std::ranges::sort(distinct);
+    distinct.erase(std::ranges::unique(distinct).begin(), distinct.end());
+
+    auto numeric = [&](u64 v) {
+        std::byte b[sizeof(u64)];
+        std::memcpy(b, &v, sizeof(v));
+        return load_f64(kind, b);
+    };
+    std::vector<u64> order = distinct;
+    std::ranges::sort(order, [&](u64 a, u64 b) {
+        const f64 x = numeric(a), y = numeric(b);
+        if (std::isnan(x) || std::isnan(y)) return !std::isnan(x) && std::isnan(y);
+        return x != y ? x < y : a < b;
+    });
+
+    // code_of[k] is the code of distinct[k].
+    std::vector<u32> code_of(distinct.size());
+    for (size_t c = 0; c < order.size(); ++c) {
+        code_of[static_cast<size_t>(std::ranges::lower_bound(distinct, order[c]) - distinct.begin())] = static_cast<u32>(c);
+    }
+
+    const auto count = static_cast<u32>(order.size());
+    const auto bits  = static_cast<unsigned>(std::bit_width(count > 0 ? count - 1 : 0u));
+
+    const size_t base = out.size();
+    out.resize(base + dict_header_size + order.size() * size + packed_size(n, bits));
+    std::byte* p = out.data() + base;
+    std::memcpy(p, &count, sizeof(count));
+    p[sizeof(u32)] = static_cast<std::byte>(bits);
+    for (size_t c = 0; c < order.size(); ++c) std::memcpy(p + dict_header_size + c * size, &order[c], size);
+    if (bits == 0) return;
+
+    std::byte* packed = p + dict_header_size + order.size() * size;
+    for (size_t i = 0; i < n; ++i) {
+        const size_t k = static_cast<size_t>(std::ranges::lower_bound(distinct, bits_of(i)) - distinct.begin());
+        pack(packed, i, bits, code_of[k]);
+    }
+}
+
+inline auto decode_dict(const std::byte* in, size_t rows, size_t size, std::byte* out) noexcept -> void {
+    const DictHeader h = dict_header(in, size);
+    for (size_t i = 0; i < rows; ++i) {
+        const size_t code = h.bits > 0 ? unpack(h.packed, i, h.bits) : 0;
+        std::memcpy(out + i * size, h.values + code * size, size);
+    }
+}
+
+// Codes [first, last) of the dictionary values v with lo <= v <= hi.
+[[nodiscard]] inline auto dict_codes(const DictHeader& h, Schema::TypeKind kind, size_t size, f64 lo, f64 hi) noexcept
+    -> std::pair<u64, u64>
+{
+    auto value = [&](u64 c) { return load_f64(kind, h.values + c * size); };
+    auto first_where = [&](u64 end, auto&& pred) {
+        u64 a = 0, b = end;
+        while (a < b) {
+            const u64 mid = a + (b - a) / 2;
+            if (pred(value(mid))) b = mid;
+            else                  a = mid + 1;
+        }
+        return a;
+    };
+
+    const u64 finite = first_where(h.count, [](f64 v) { return std::isnan(v); });
+    return {
+        first_where(finite, [lo](f64 v) { return v >= lo; }),
+        first_where(finite, [hi](f64 v) { return v > hi; }),
+    };
+}
+
+// How many rows hold each code.
+inline auto dict_counts(const DictHeader& h, size_t rows, std::vector<u64>& counts) -> void {
+    counts.assign(h.count, 0);
+    if (h.bits == 0) {
+        if (h.count > 0) counts[0] = rows;
+        return;
+    }
+    for (size_t i = 0; i < rows; ++i) ++counts[unpack(h.packed, i, h.bits)];
+}
+
+// Run-length chunks: the number of runs (u32), each run's end row (exclusive, u32,
+// ascending), then each run's value. Aggregates and filters work a run at a time, and a
+// single row is found by binary search on the ends.
+constexpr size_t rle_header_size = sizeof(u32);
+
+struct RleHeader {
+    u32              runs   = 0;
+    const std::byte* ends   = nullptr;
+    const std::byte* values = nullptr;
+
+    [[nodiscard]] auto end(size_t r) const noexcept -> u32 {
+        u32 e;
+        std::memcpy(&e, ends + r * sizeof(u32), sizeof(e));
+        return e;
+    }
+};
+
+[[nodiscard]] inline auto rle_header(const std::byte* in) noexcept -> RleHeader {
+    RleHeader h;
+    std::memcpy(&h.runs, in, sizeof(u32));
+    h.ends   = in + rle_header_size;
+    h.values = h.ends + size_t{h.runs} * sizeof(u32);
+    return h;
+}
+
+[[nodiscard]] inline auto count_runs(std::span<const std::byte> raw, size_t size) noexcept -> size_t {
+    size_t runs = raw.empty() ? 0 : 1;
+    for (size_t off = size; off < raw.size(); off += size) {
+        runs += std::memcmp(raw.data() + off, raw.data() + off - size, size) != 0 ? 1 : 0;
+    }
+    return runs;
+}
+
+inline auto encode_rle(std::span<const std::byte> raw, size_t size, std::vector<std::byte>& out) -> void {
+    const size_t n    = raw.size() / size;
+    const auto   runs = static_cast<u32>(count_runs(raw, size));
+
+    const size_t base = out.size();
+    out.resize(base + rle_header_size + size_t{runs} * (sizeof(u32) + size));
+    std::byte* p = out.data() + base;
+    std::memcpy(p, &runs, sizeof(runs));
+
+    std::byte* ends   = p + rle_header_size;
+    std::byte* values = ends + size_t{runs} * sizeof(u32);
+    size_t r = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const bool last = i + 1 == n || std::memcmp(raw.data() + i * size, raw.data() + (i + 1) * size, size) != 0;
+        if (!last) continue;
+
+        const auto end = static_cast<u32>(i + 1);
+        std::memcpy(ends + r * sizeof(u32), &end, sizeof(end));
+        std::memcpy(values + r * size, raw.data() + i * size, size);
+        ++r;
+    }
+}
+
+inline auto decode_rle(const std::byte* in, size_t size, std::byte* out) noexcept -> void {
+    const RleHeader h = rle_header(in);
+    size_t begin = 0;
+    for (size_t r = 0; r < h.runs; ++r) {
+        const size_t end = h.end(r);
+        for (size_t i = begin; i < end; ++i) std::memcpy(out + i * size, h.values + r * size, size);
+        begin = end;
+    }
+}
+
+// Run holding `row`.
+[[nodiscard]] inline auto rle_run_of(const RleHeader& h, size_t row) noexcept -> size_t {
+    size_t lo = 0, hi = h.runs;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (h.end(mid) <= row) lo = mid + 1;
+        else                   hi = mid;
+    }
+    return lo;
+}
+
+} // namespace codec
+
+[[nodiscard]] constexpr auto supports(Encoding e, Schema::TypeKind kind) noexcept -> bool {
+    switch (e) {
+        case Encoding::Raw:     return true;
+        case Encoding::Delta:   return is_integral(kind);
+        case Encoding::Xor:     return is_floating(kind);
+        case Encoding::BitPack: return is_integral(kind);
+        case Encoding::Dict:    return is_numeric(kind);
+        case Encoding::Rle:     return is_numeric(kind);
+    }
+    return false;
+}
+
+// Appends the encoding of `raw` (whole elements of elem_size bytes) to `out`.
+inline auto encode(Encoding e, Schema::TypeKind kind, size_t elem_size,
+                   std::span<const std::byte> raw, std::vector<std::byte>& out) -> void
+{
+    assert(supports(e, kind));
+
+    switch (e) {
+        case Encoding::Raw:
+            out.insert(out.end(), raw.begin(), raw.end());
+            break;
+        case Encoding::Delta:
+            codec::encode_delta(raw, elem_size, is_signed(kind), out);
+            break;
+        case Encoding::Xor:
+            codec::encode_xor(raw, elem_size, out);
+            break;
+        case Encoding::BitPack:
+            codec::encode_for(raw, elem_size, is_signed(kind), out);
+            break;
+        case Encoding::Dict:
+            codec::encode_dict(raw, elem_size, kind, out);
+            break;
+        case Encoding::Rle:
+            codec::encode_rle(raw, elem_size, out);
+            break;
+    }
+}
+
+// Decodes `rows` elements into `out`, which must hold rows * elem_size bytes.
+inline auto decode(Encoding e, size_t elem_size, std::span<const std::byte> in, size_t rows, std::byte* out) noexcept -> void {
+    switch (e) {
+        case Encoding::Raw:
+            if (rows > 0) std::memcpy(out, in.data(), rows * elem_size);   // empty spans may be null
+            break;
+        case Encoding::Delta:
+            codec::decode_delta(in.data(), rows, elem_size, out);
+            break;
+        case Encoding::Xor:
+            codec::decode_xor(in.data(), rows, elem_size, out);
+            break;
+        case Encoding::BitPack:
+            codec::decode_for(in.data(), rows, elem_size, out);
+            break;
+        case Encoding::Dict:
+            codec::decode_dict(in.data(), rows, elem_size, out);
+            break;
+        case Encoding::Rle:
+            codec::decode_rle(in.data(), elem_size, out);
+            break;
+    }
+}
+
+// Copies row i of an encoded chunk to `out` without decoding the rest. False for codecs
+// that can only be decoded from the start (delta, xor).
+inline auto decode_row(Encoding e, size_t elem_size, std::span<const std::byte> in, size_t i, std::byte* out) noexcept
+    -> bool
+{
+    switch (e) {
+        case Encoding::Raw:
+            std::memcpy(out, in.data() + i * elem_size, elem_size);
+            return true;
+        case Encoding::BitPack: {
+            const auto h = codec::for_header(in.data());
+            codec::store_int(out, elem_size, h.min + (h.bits > 0 ? codec::unpack(in.data() + codec::for_header_size, i, h.bits) : 0));
+            return true;
+        }
+        case Encoding::Dict: {
+            const auto h = codec::dict_header(in.data(), elem_size);
+            std::memcpy(out, h.values + (h.bits > 0 ? codec::unpack(h.packed, i, h.bits) : 0) * elem_size, elem_size);
+            return true;
+        }
+        case Encoding::Rle: {
+            const auto h = codec::rle_header(in.data());
+            std::memcpy(out, h.values + codec::rle_run_of(h, i) * elem_size, elem_size);
+            return true;
+        }
+        case Encoding::Delta:
+        case Encoding::Xor:
+            return false;
+    }
+    return false;
+}
+
+// Codecs whose chunks filters and whole-chunk aggregates work on without decoding them.
+[[nodiscard]] constexpr auto queryable_encoded(Encoding e) noexcept -> bool {
+    return e == Encoding::BitPack || e == Encoding::Dict || e == Encoding::Rle;
+}
+
+// Rough cost of decoding a value relative to a plain copy, for EncodingPolicy::Speed.
+[[nodiscard]] constexpr auto decode_cost(Encoding e) noexcept -> f64 {
+    switch (e) {
+        case Encoding::Raw:     return 0.0;
+        case Encoding::BitPack: return 1.0;
+        case Encoding::Dict:    return 1.0;
+        case Encoding::Rle:     return 0.5;   // a fill per run
+        case Encoding::Delta:   return 2.0;   // serial: each value needs the one before
+        case Encoding::Xor:     return 3.0;
+    }
+    return 0.0;
+}
+
+// Picks a codec for `raw` from a sample rather than encoding it every way: up to 16 runs of
+// 64 consecutive values spread across it (runs keep the neighbours delta and xor depend
+// on) are encoded with each codec that applies, and the sizes scaled up to the whole
+// column. A dictionary is costed from the sample's distinct values and left out when most
+// of them are distinct. Runs are counted over the whole column instead: that's one compare
+// per value, and runs longer than the sample's windows would look shorter than they are.
+// Under EncodingPolicy::Speed each estimate is weighed by 1 + decode_cost(), so e.g. delta
+// has to come out at a third of raw to be picked.
+[[nodiscard]] inline auto choose_encoding(Schema::TypeKind kind, size_t elem_size, std::span<const std::byte> raw,
+                                          EncodingPolicy policy) -> Encoding
+{
+    constexpr size_t run = 64, runs = 16;
+
+    const size_t n = raw.size() / elem_size;
+    if (n == 0) return Encoding::Raw;
+
+    std::vector<std::byte> sample;
+    if (n <= run * runs) {
+        sample.assign(raw.begin(), raw.end());
+    } else {
+        const size_t stride = n / runs;
+        for (size_t r = 0; r < runs; ++r) {
+            const auto first = raw.begin() + static_cast<std::ptrdiff_t>(r * stride * elem_size);
+            sample.insert(sample.end(), first, first + static_cast<std::ptrdiff_t>(run * elem_size));
+        }
+    }
+    const size_t sampled = sample.size() / elem_size;
+    const f64    scale   = static_cast<f64>(n) / static_cast<f64>(sampled);
+    const f64    weight  = policy == EncodingPolicy::Speed ? 1.0 : 0.0;
+
+    Encoding best       = Encoding::Raw;
+    f64      best_score = static_cast<f64>(raw.size());
+
+    std::vector<std::byte> tmp;
+    for (Encoding e : { Encoding::Delta, Encoding::Xor, Encoding::BitPack, Encoding::Dict, Encoding::Rle }) {
+        if (!supports(e, kind)) continue;
+
+        f64 estimate;
+        if (e == Encoding::Rle) {
+            estimate = static_cast<f64>(codec::rle_header_size + codec::count_runs(raw, elem_size) * (sizeof(u32) + elem_size));
+        } else {
+            tmp.clear();
+            encode(e, kind, elem_size, sample, tmp);
+
+            estimate = static_cast<f64>(tmp.size()) * scale;
+            if (e == Encoding::Dict) {
+                const auto h = codec::dict_header(tmp.data(), elem_size);
+                if (h.count * 2 > sampled) continue;
+                estimate = static_cast<f64>(codec::dict_header_size + h.count * elem_size + codec::packed_size(n, h.bits));
+            }
+        }
+
+        const f64 score = estimate * (1.0 + weight * decode_cost(e));
+        if (score < best_score) {
+            best       = e;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// Encodes `raw` with the codec choose_encoding() picks, falling back to raw if the sample
+// misled it into something larger.
+inline auto encode_best(Schema::TypeKind kind, size_t elem_size, std::span<const std::byte> raw,
+                        std::vector<std::byte>& out, EncodingPolicy policy = EncodingPolicy::Ratio) -> Encoding
+{
+    const size_t   base = out.size();
+    const Encoding e    = choose_encoding(kind, elem_size, raw, policy);
+    if (e != Encoding::Raw) {
+        encode(e, kind, elem_size, raw, out);
+        if (out.size() - base < raw.size()) return e;
+        out.resize(base);
+    }
+
+    out.insert(out.end(), raw.begin(), raw.end());
+    return Encoding::Raw;
+}
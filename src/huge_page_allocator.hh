@@ -1,7 +1,9 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <new>
+#include <string>
 
 #ifdef __linux__
     #include <sys/mman.h>
@@ -14,6 +16,13 @@
 constexpr static size_t Huge2MB = 2ULL << 20;
 constexpr static size_t Huge1GB = 1ULL << 30;
 
+struct AllocatorStats {
+    std::string name;
+    std::size_t used       = 0;
+    std::size_t available  = 0;
+    bool        huge_pages = false;
+};
+
 template <std::size_t NumPages = 1, std::size_t PageSize = Huge2MB>
 class HugePageAlloc {
 public:
@@ -74,6 +83,15 @@ public:
         return huge_pages;
     }
 
+    [[nodiscard]] auto stats(std::string name) const -> AllocatorStats {
+        return AllocatorStats {
+            .name       = std::move(name),
+            .used       = used(),
+            .available  = available(),
+            .huge_pages = huge_pages,
+        };
+    }
+
 private:
     [[nodiscard]] auto end() const noexcept -> std::byte* {
         return begin_ + cap_;
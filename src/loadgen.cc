@@ -0,0 +1,664 @@
+// tsdb_loadgen: drives an embedded TSDB with concurrent writers and readers.
+//
+// Every operation is generated up front from --seed, so two runs with the same
+// flags issue the same operations with the same row data. --record dumps the
+// generated operations, --replay runs a recorded file instead of generating.
+//
+//   tsdb_loadgen --writers=4 --readers=4 --series=64 --rate=200000 --late=0.05
+
+#include "tsdb.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <latch>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Vec3 {
+    i64 timestamp_ns;
+    f64 x;
+    f64 y;
+    f64 z;
+};
+
+enum class RangeDist : u8 {
+    Recent,   // ends at the newest written sample
+    Uniform,  // anywhere in the written history
+    Exp,      // age drawn from an exponential, mostly recent with a long tail
+};
+
+struct Options {
+    u64       seed          = 42;
+    u32       series        = 16;
+    u32       writers       = 2;
+    u32       readers       = 2;
+    u64       batches       = 20'000;       // per writer
+    u32       batch         = 64;           // rows per insert_batch
+    u64       queries       = 20'000;       // per reader
+    u64       rate          = 0;            // rows/s per writer, 0 = unthrottled
+    i64       interval_ns   = 1'000'000;    // spacing of samples within a series
+    f64       late_ratio    = 0.0;          // fraction of rows arriving out of order
+    i64       late_max_ns   = 1'000'000'000;
+    u32       mix_first     = 1;
+    u32       mix_range     = 4;
+    u32       mix_agg       = 4;
+    u32       mix_buckets   = 1;
+    i64       span_min_ns   = 1'000'000'000;
+    i64       span_max_ns   = 60'000'000'000;
+    i64       bucket_ns     = 1'000'000'000;
+    RangeDist dist          = RangeDist::Recent;
+    i64       retain_ns     = 0;            // per-series retention, 0 = keep everything
+    u64       retain_bytes  = 0;
+    u64       compact_ms    = 0;            // background compaction interval, 0 = off
+    u64       max_frozen    = 0;            // background flush: full blocks queued per table, 0 = seal inline
+    u64       ingest_bytes  = 0;            // per table: refuse batches beyond this much in memory, 0 = off
+    u64       ingest_frozen = 0;            // per table: refuse batches this many blocks behind the flusher, 0 = off
+    u64       tier_ms       = 0;            // background tiering interval, 0 = off
+    u64       hot_bytes     = 64 << 20;
+    u64       memory_bytes  = 0;
+    std::string tier_dir;
+    bool      buffer_pool   = false;        // read cold segments through a 128 MiB huge-page pool
+    u64       result_cache  = 0;            // bytes of cached aggregate results, 0 = off
+    i64       rollup_ns     = 0;            // per series: continuous aggregate of x in buckets this wide, 0 = off
+    u32       subscribers   = 0;            // the first this many series each get a subscriber thread draining new rows
+    EncodingPolicy encoding = EncodingPolicy::Ratio;
+    bool      stats         = false;
+    std::string record;
+    std::string replay;
+};
+
+enum class OpKind : u8 {
+    Insert,
+    First,
+    Range,
+    Agg,
+    Buckets,
+    Count_,
+};
+
+constexpr std::string_view op_names[] = { "insert_batch", "query_first", "query_range", "aggregate", "aggregate_buckets" };
+
+// Fixed-size, trivially copyable so a recorded workload is a plain dump.
+struct Op {
+    OpKind kind;
+    u32    series;
+    u32    rows;
+    i64    a;   // insert: first timestamp   | reads: age from the series head
+    i64    b;   // insert: unused            | reads: span of the range
+    i64    c;   // reads: aggregate / bucket selector
+};
+
+// Everything that shapes row data or query ranges; recorded alongside the ops.
+struct Params {
+    u64 seed        = 0;
+    i64 interval_ns = 0;
+    f64 late_ratio  = 0.0;
+    i64 late_max_ns = 0;
+    i64 bucket_ns   = 0;
+};
+
+struct Workload {
+    Params params;
+    std::vector<std::vector<Op>> writers;
+    std::vector<std::vector<Op>> readers;
+};
+
+// Row data is a pure function of (seed, series, sequence), which is what makes replays exact.
+[[nodiscard]] constexpr auto splitmix64(u64 x) noexcept -> u64 {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+[[nodiscard]] constexpr auto unit(u64 bits) noexcept -> f64 {
+    return static_cast<f64>(bits >> 11) * 0x1.0p-53;
+}
+
+[[nodiscard]] auto make_row(const Params& p, u32 series, i64 seq_ts) noexcept -> Vec3 {
+    const u64 h = splitmix64(p.seed ^ (u64{series} << 40) ^ static_cast<u64>(seq_ts));
+
+    i64 ts = seq_ts;
+    if (p.late_ratio > 0.0 && unit(h) < p.late_ratio) {
+        ts -= static_cast<i64>(unit(splitmix64(h)) * static_cast<f64>(p.late_max_ns));
+    }
+
+    const f64 phase = static_cast<f64>(seq_ts) * 1e-9;
+    return Vec3 {
+        .timestamp_ns = ts,
+        .x = std::sin(phase + series) * 100.0 + unit(splitmix64(h + 1)),
+        .y = std::cos(phase + series) * 100.0 + unit(splitmix64(h + 2)),
+        .z = static_cast<f64>(series) + unit(splitmix64(h + 3)),
+    };
+}
+
+[[nodiscard]] auto generate(const Options& opt) -> Workload {
+    Workload w {
+        .params = {
+            .seed        = opt.seed,
+            .interval_ns = opt.interval_ns,
+            .late_ratio  = opt.late_ratio,
+            .late_max_ns = opt.late_max_ns,
+            .bucket_ns   = opt.bucket_ns,
+        },
+    };
+
+    // Writer w owns the series s with s % writers == w, so each series has one producer.
+    w.writers.resize(opt.writers);
+    for (u32 t = 0; t < opt.writers; ++t) {
+        std::mt19937_64 rng(splitmix64(opt.seed + t));
+
+        std::vector<u32> owned;
+        for (u32 s = t; s < opt.series; s += opt.writers) owned.push_back(s);
+        if (owned.empty()) continue;
+
+        std::vector<i64> next_ts(owned.size(), 0);
+        std::uniform_int_distribution<size_t> pick(0, owned.size() - 1);
+
+        auto& ops = w.writers[t];
+        ops.reserve(opt.batches);
+        for (u64 i = 0; i < opt.batches; ++i) {
+            const size_t k = pick(rng);
+            ops.push_back(Op {
+                .kind   = OpKind::Insert,
+                .series = owned[k],
+                .rows   = opt.batch,
+                .a      = next_ts[k],
+                .b      = 0,
+                .c      = 0,
+            });
+            next_ts[k] += static_cast<i64>(opt.batch) * opt.interval_ns;
+        }
+    }
+
+    const u32 mix[] = { opt.mix_first, opt.mix_range, opt.mix_agg, opt.mix_buckets };
+
+    w.readers.resize(opt.readers);
+    for (u32 t = 0; t < opt.readers; ++t) {
+        std::mt19937_64 rng(splitmix64(~opt.seed + t));
+
+        std::discrete_distribution<u32>        kind(std::begin(mix), std::end(mix));
+        std::uniform_int_distribution<u32>     series(0, opt.series - 1);
+        std::uniform_int_distribution<i64>     span(opt.span_min_ns, std::max(opt.span_min_ns, opt.span_max_ns));
+        std::uniform_int_distribution<i64>     agg(0, 4);
+        std::uniform_real_distribution<f64>    uniform(0.0, 1.0);
+        std::exponential_distribution<f64>     expo(4.0);
+
+        auto& ops = w.readers[t];
+        ops.reserve(opt.queries);
+        for (u64 i = 0; i < opt.queries; ++i) {
+            const i64 s = span(rng);
+
+            // Ages are resolved against the live head at run time; store them as ppm of history.
+            i64 age_ppm = 0;
+            switch (opt.dist) {
+                case RangeDist::Recent:  age_ppm = 0; break;
+                case RangeDist::Uniform: age_ppm = static_cast<i64>(uniform(rng) * 1e6); break;
+                case RangeDist::Exp:     age_ppm = static_cast<i64>(std::min(expo(rng), 1.0) * 1e6); break;
+            }
+
+            ops.push_back(Op {
+                .kind   = static_cast<OpKind>(1 + kind(rng)),
+                .series = series(rng),
+                .rows   = 0,
+                .a      = age_ppm,
+                .b      = s,
+                .c      = agg(rng),
+            });
+        }
+    }
+
+    return w;
+}
+
+constexpr u64 trace_magic = 0x3130'4e45'4744'4c54ULL; // "TLDGEN01"
+
+auto save(const Workload& w, const std::string& path) -> bool {
+    std::ofstream out(path, std::ios::binary);
+
+    auto put = [&](const auto& v) { out.write(reinterpret_cast<const char*>(&v), sizeof(v)); };
+    auto put_ops = [&](const std::vector<Op>& ops) {
+        put(static_cast<u64>(ops.size()));
+        out.write(reinterpret_cast<const char*>(ops.data()), static_cast<std::streamsize>(ops.size() * sizeof(Op)));
+    };
+
+    put(trace_magic);
+    put(w.params);
+    put(static_cast<u32>(w.writers.size()));
+    put(static_cast<u32>(w.readers.size()));
+    for (const auto& ops : w.writers) put_ops(ops);
+    for (const auto& ops : w.readers) put_ops(ops);
+
+    return static_cast<bool>(out);
+}
+
+auto load(const std::string& path) -> Option<Workload> {
+    std::ifstream in(path, std::ios::binary);
+
+    auto get = [&](auto& v) { return static_cast<bool>(in.read(reinterpret_cast<char*>(&v), sizeof(v))); };
+    auto get_ops = [&](std::vector<Op>& ops) {
+        u64 n = 0;
+        if (!get(n)) return false;
+        ops.resize(n);
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(ops.data()), static_cast<std::streamsize>(n * sizeof(Op))));
+    };
+
+    u64 magic = 0;
+    u32 writers = 0, readers = 0;
+    Workload w;
+    if (!get(magic) || magic != trace_magic || !get(w.params) || !get(writers) || !get(readers)) {
+        return None;
+    }
+
+    w.writers.resize(writers);
+    w.readers.resize(readers);
+    for (auto& ops : w.writers) if (!get_ops(ops)) return None;
+    for (auto& ops : w.readers) if (!get_ops(ops)) return None;
+
+    return Some(std::move(w));
+}
+
+struct Samples {
+    std::vector<u64> ns[std::to_underlying(OpKind::Count_)];
+    u64 rows     = 0;
+    u64 rejected = 0;   // batches refused and retried
+};
+
+auto print_stats(const TSDBStats& st) -> void {
+    constexpr f64 MiB = 1024.0 * 1024.0;
+
+    std::println("{:<12} {:<14} {:>10} {:>7} {:>10} {:>10} {:>10} {:>10} {:>6}  {}",
+                 "table", "column", "rows", "blocks", "raw(MiB)", "enc(MiB)", "used(MiB)", "rsvd(MiB)", "ratio", "encoding");
+
+    for (const auto& t : st.tables) {
+        for (const auto& c : t.columns) {
+            std::println("{:<12} {:<14} {:>10} {:>7} {:>10.2f} {:>10.2f} {:>10.2f} {:>10.2f} {:>6.2f}  {}",
+                         t.name, c.name, c.rows, c.blocks,
+                         static_cast<f64>(c.raw_bytes) / MiB, static_cast<f64>(c.encoded_bytes) / MiB,
+                         static_cast<f64>(c.used_bytes) / MiB, static_cast<f64>(c.reserved_bytes) / MiB,
+                         c.encoded_bytes > 0 ? static_cast<f64>(c.raw_bytes) / static_cast<f64>(c.encoded_bytes) : 1.0,
+                         encoding_name(c.encoding));
+        }
+    }
+
+    std::println("total: rows {}  raw {:.2f} MiB  encoded {:.2f} MiB  used {:.2f} MiB  reserved {:.2f} MiB",
+                 st.rows, static_cast<f64>(st.raw_bytes) / MiB, static_cast<f64>(st.encoded_bytes) / MiB,
+                 static_cast<f64>(st.used_bytes) / MiB, static_cast<f64>(st.reserved_bytes) / MiB);
+
+    for (const auto& t : st.tables) {
+        if (t.warm_segments + t.cold_segments == 0) continue;
+        std::println("{}: segments hot {} warm {} cold {}  memory {:.2f} MiB  disk {:.2f} MiB",
+                     t.name, t.hot_segments, t.warm_segments, t.cold_segments,
+                     static_cast<f64>(t.memory_bytes) / MiB, static_cast<f64>(t.disk_bytes) / MiB);
+    }
+
+    if (st.buffer_pool.is_some()) {
+        const auto& bp = st.buffer_pool.unwrap();
+        std::println("buffer pool: frames {}  hits {}  misses {}  evictions {}  bypasses {}  hot {}  cold {}",
+                     bp.frames, bp.hits, bp.misses, bp.evictions, bp.bypasses, bp.hot, bp.cold);
+    }
+
+    if (st.io.is_some()) {
+        const auto& io = st.io.unwrap();
+        std::println("segment reads ({}): {}  {:.2f} MiB  max in flight {}",
+                     io.backend, io.reads, static_cast<f64>(io.bytes) / MiB, io.max_in_flight);
+    }
+
+    if (st.result_cache.is_some()) {
+        const auto& rc = st.result_cache.unwrap();
+        std::println("result cache: hits {}  partial {}  misses {}  evictions {}  entries {}  {:.2f} / {:.2f} MiB",
+                     rc.hits, rc.partial_hits, rc.misses, rc.evictions, rc.entries,
+                     static_cast<f64>(rc.bytes) / MiB, static_cast<f64>(rc.max_bytes) / MiB);
+    }
+
+    for (const auto& a : st.allocators) {
+        std::println("allocator {}: used {:.2f} MiB  available {:.2f} MiB  huge pages {}",
+                     a.name, static_cast<f64>(a.used) / MiB, static_cast<f64>(a.available) / MiB, a.huge_pages);
+    }
+}
+
+auto run(const Workload& w, const Options& opt) -> void {
+    const Params& p = w.params;
+
+    u32 series = 0;
+    for (const auto& ops : w.writers) for (const Op& op : ops) series = std::max(series, op.series + 1);
+    for (const auto& ops : w.readers) for (const Op& op : ops) series = std::max(series, op.series + 1);
+
+    TSDB db {series};
+
+    std::vector<TypeHandle> handles;
+    handles.reserve(series);
+    for (u32 s = 0; s < series; ++s) {
+        handles.push_back(db.register_struct(std::format("vec3.{}", s), {
+            {"x", TSDB::F64},
+            {"y", TSDB::F64},
+            {"z", TSDB::F64},
+        }));
+
+        if (opt.retain_ns > 0 || opt.retain_bytes > 0) {
+            db.set_retention(handles.back(), { .max_age_ns = opt.retain_ns, .max_bytes = opt.retain_bytes });
+        }
+
+        if (opt.encoding != EncodingPolicy::Ratio) {
+            db.set_encoding_policy(handles.back(), opt.encoding);
+        }
+
+        if (opt.rollup_ns > 0) {
+            (void)db.create_rollup(handles.back(), "x", { .bucket_ns = opt.rollup_ns, .lateness_ns = p.late_max_ns });
+        }
+    }
+
+    if (opt.max_frozen > 0) {
+        db.start_flushing({ .max_frozen = opt.max_frozen });
+    }
+
+    if (opt.ingest_bytes > 0 || opt.ingest_frozen > 0) {
+        db.set_ingest_limits({ .memory_bytes = opt.ingest_bytes, .max_frozen = opt.ingest_frozen });
+    }
+
+    if (opt.compact_ms > 0) {
+        db.start_compaction({ .interval = std::chrono::milliseconds(opt.compact_ms) });
+    }
+
+    if (opt.buffer_pool) {
+        db.enable_buffer_pool<64>();
+    }
+
+    if (opt.result_cache > 0) {
+        db.enable_result_cache(opt.result_cache);
+    }
+
+    if (opt.tier_ms > 0) {
+        db.start_tiering({
+            .dir          = opt.tier_dir,
+            .hot_bytes    = opt.hot_bytes,
+            .memory_bytes = opt.memory_bytes,
+            .interval     = std::chrono::milliseconds(opt.tier_ms),
+        });
+    }
+
+    // Newest in-order timestamp per series; readers resolve their ranges against it.
+    std::vector<std::atomic<i64>> heads(series);
+
+    const size_t threads = w.writers.size() + w.readers.size();
+    std::vector<Samples> samples(threads);
+    std::latch start(static_cast<std::ptrdiff_t>(threads) + 1);
+
+    auto writer = [&](const std::vector<Op>& ops, Samples& out) {
+        std::vector<Vec3> rows;
+        for (auto& v : out.ns) v.reserve(ops.size());
+
+        start.arrive_and_wait();
+        const auto t0 = Clock::now();
+        u64 sent = 0;
+
+        for (const Op& op : ops) {
+            rows.clear();
+            for (u32 i = 0; i < op.rows; ++i) {
+                rows.push_back(make_row(p, op.series, op.a + static_cast<i64>(i) * p.interval_ns));
+            }
+
+            // Open loop: latency is measured from the scheduled start, so stalls are not hidden.
+            auto begin = Clock::now();
+            if (opt.rate > 0) {
+                const auto due = t0 + std::chrono::nanoseconds(sent * 1'000'000'000ULL / opt.rate);
+                if (due > begin) std::this_thread::sleep_until(due);
+                begin = due;
+            }
+
+            // Refused batches back off for the hinted time and count toward the batch's latency.
+            for (;;) {
+                auto r = db.insert_batch(std::span<const Vec3>(rows), handles[op.series]);
+                if (r.is_ok()) break;
+                ++out.rejected;
+                std::this_thread::sleep_for(r.unwrap_err().retry_after);
+            }
+
+            out.ns[std::to_underlying(OpKind::Insert)].push_back(
+                static_cast<u64>((Clock::now() - begin).count()));
+
+            sent += op.rows;
+            heads[op.series].store(op.a + static_cast<i64>(op.rows) * p.interval_ns, std::memory_order_relaxed);
+        }
+        out.rows = sent;
+    };
+
+    auto reader = [&](const std::vector<Op>& ops, Samples& out) {
+        for (auto& v : out.ns) v.reserve(ops.size());
+        f64 sink = 0;
+
+        start.arrive_and_wait();
+
+        for (const Op& op : ops) {
+            const i64 head  = heads[op.series].load(std::memory_order_relaxed);
+            const i64 end   = head - static_cast<i64>(static_cast<f64>(head) * static_cast<f64>(op.a) * 1e-6);
+            const i64 begin = end - op.b;
+            const auto agg  = static_cast<Agg>(op.c);
+            const auto h    = handles[op.series];
+
+            const auto t = Clock::now();
+            switch (op.kind) {
+                case OpKind::First:
+                    sink += db.query_first<Vec3>(h).x;
+                    break;
+                case OpKind::Range:
+                    sink += static_cast<f64>(db.query_range<Vec3>(h, begin, end).size());
+                    break;
+                case OpKind::Agg:
+                    sink += db.aggregate(h, "x", begin, end, agg).unwrap_or(0.0);
+                    break;
+                case OpKind::Buckets:
+                    sink += static_cast<f64>(db.aggregate_buckets(h, "x", begin, end, p.bucket_ns, agg).size());
+                    break;
+                default:
+                    break;
+            }
+            out.ns[std::to_underlying(op.kind)].push_back(static_cast<u64>((Clock::now() - t).count()));
+        }
+
+        static_cast<void>(sink);
+    };
+
+    std::vector<std::jthread> pool;
+    pool.reserve(threads);
+    for (size_t i = 0; i < w.writers.size(); ++i) {
+        pool.emplace_back(writer, std::cref(w.writers[i]), std::ref(samples[i]));
+    }
+    for (size_t i = 0; i < w.readers.size(); ++i) {
+        pool.emplace_back(reader, std::cref(w.readers[i]), std::ref(samples[w.writers.size() + i]));
+    }
+
+    std::vector<std::shared_ptr<Subscription>> subs;
+    std::vector<std::jthread>                  consumers;
+    for (u32 s = 0; s < std::min(opt.subscribers, series); ++s) {
+        subs.push_back(db.subscribe<Vec3>(handles[s]));
+        consumers.emplace_back([sub = subs.back()] {
+            std::vector<Vec3> buf(1024);
+            while (sub->wait()) (void)sub->read(std::span(buf));
+        });
+    }
+
+    const auto t0 = Clock::now();
+    start.arrive_and_wait();
+    pool.clear();
+    const f64 wall_s = std::chrono::duration<f64>(Clock::now() - t0).count();
+
+    for (const auto& sub : subs) db.unsubscribe(sub);
+    consumers.clear();
+
+    u64 rows = 0, rejected = 0;
+    for (const auto& s : samples) {
+        rows     += s.rows;
+        rejected += s.rejected;
+    }
+
+    std::println("wall {:.3f}s  rows {}  rows/s {:.0f}", wall_s, rows, static_cast<f64>(rows) / wall_s);
+    if (rejected > 0) std::println("batches refused by ingest limits: {}", rejected);
+    if (!subs.empty()) {
+        u64 delivered = 0, dropped = 0;
+        for (const auto& sub : subs) {
+            delivered += sub->stats().delivered;
+            dropped   += sub->stats().dropped;
+        }
+        std::println("subscribers {}: rows delivered {}  dropped {}", subs.size(), delivered, dropped);
+    }
+    std::println("{:<18} {:>10} {:>12} {:>10} {:>10} {:>10} {:>10}",
+                 "op", "count", "ops/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+
+    for (size_t k = 0; k < std::to_underlying(OpKind::Count_); ++k) {
+        std::vector<u64> all;
+        for (const auto& s : samples) all.insert(all.end(), s.ns[k].begin(), s.ns[k].end());
+        if (all.empty()) continue;
+
+        std::ranges::sort(all);
+        auto pct = [&](f64 p) {
+            const auto i = std::min(all.size() - 1, static_cast<size_t>(p * static_cast<f64>(all.size())));
+            return static_cast<f64>(all[i]) / 1e3;
+        };
+
+        std::println("{:<18} {:>10} {:>12.0f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}",
+                     op_names[k], all.size(), static_cast<f64>(all.size()) / wall_s,
+                     pct(0.50), pct(0.99), pct(0.999), static_cast<f64>(all.back()) / 1e3);
+    }
+
+    if (opt.stats) {
+        std::println("");
+        print_stats(db.stats());
+    }
+}
+
+auto usage() -> void {
+    std::println(stderr,
+        "usage: tsdb_loadgen [--flag=value ...]\n"
+        "  --seed --series --writers --readers --batches --batch --queries --rate\n"
+        "  --interval-ns --late --late-max-ns --mix=first,range,agg,buckets\n"
+        "  --span-min-ns --span-max-ns --bucket-ns --dist=recent|uniform|exp\n"
+        "  --retain-ns --retain-bytes --compact-ms --max-frozen --ingest-bytes --ingest-frozen\n"
+        "  --tier-ms --hot-bytes --memory-bytes --tier-dir=DIR --buffer-pool --result-cache=BYTES\n"
+        "  --rollup-ns --subscribers --encoding=ratio|speed --stats --record=FILE --replay=FILE");
+}
+
+template <typename T>
+auto parse_num(std::string_view s, T& out) -> bool {
+    auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc{} && p == s.data() + s.size();
+}
+
+auto parse(int argc, char** argv) -> Option<Options> {
+    Options opt;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (!arg.starts_with("--")) return None;
+
+        const auto eq = arg.find('=');
+        const auto key = arg.substr(2, eq == std::string_view::npos ? arg.npos : eq - 2);
+        const auto val = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+
+        bool ok = true;
+        if      (key == "seed")        ok = parse_num(val, opt.seed);
+        else if (key == "series")      ok = parse_num(val, opt.series) && opt.series > 0;
+        else if (key == "writers")     ok = parse_num(val, opt.writers);
+        else if (key == "readers")     ok = parse_num(val, opt.readers);
+        else if (key == "batches")     ok = parse_num(val, opt.batches);
+        else if (key == "batch")       ok = parse_num(val, opt.batch) && opt.batch > 0;
+        else if (key == "queries")     ok = parse_num(val, opt.queries);
+        else if (key == "rate")        ok = parse_num(val, opt.rate);
+        else if (key == "interval-ns") ok = parse_num(val, opt.interval_ns) && opt.interval_ns > 0;
+        else if (key == "late")        ok = parse_num(val, opt.late_ratio);
+        else if (key == "late-max-ns") ok = parse_num(val, opt.late_max_ns);
+        else if (key == "span-min-ns") ok = parse_num(val, opt.span_min_ns);
+        else if (key == "span-max-ns") ok = parse_num(val, opt.span_max_ns);
+        else if (key == "bucket-ns")   ok = parse_num(val, opt.bucket_ns) && opt.bucket_ns > 0;
+        else if (key == "retain-ns")   ok = parse_num(val, opt.retain_ns);
+        else if (key == "retain-bytes") ok = parse_num(val, opt.retain_bytes);
+        else if (key == "compact-ms")  ok = parse_num(val, opt.compact_ms);
+        else if (key == "max-frozen")  ok = parse_num(val, opt.max_frozen);
+        else if (key == "ingest-bytes")  ok = parse_num(val, opt.ingest_bytes);
+        else if (key == "ingest-frozen") ok = parse_num(val, opt.ingest_frozen);
+        else if (key == "tier-ms")     ok = parse_num(val, opt.tier_ms);
+        else if (key == "hot-bytes")   ok = parse_num(val, opt.hot_bytes);
+        else if (key == "memory-bytes") ok = parse_num(val, opt.memory_bytes);
+        else if (key == "tier-dir")    opt.tier_dir = val;
+        else if (key == "buffer-pool") opt.buffer_pool = val.empty() || val == "1" || val == "true";
+        else if (key == "result-cache") ok = parse_num(val, opt.result_cache);
+        else if (key == "rollup-ns")   ok = parse_num(val, opt.rollup_ns) && opt.rollup_ns >= 0;
+        else if (key == "subscribers") ok = parse_num(val, opt.subscribers);
+        else if (key == "stats")       opt.stats = val.empty() || val == "1" || val == "true";
+        else if (key == "record")      opt.record = val;
+        else if (key == "replay")      opt.replay = val;
+        else if (key == "dist") {
+            if      (val == "recent")  opt.dist = RangeDist::Recent;
+            else if (val == "uniform") opt.dist = RangeDist::Uniform;
+            else if (val == "exp")     opt.dist = RangeDist::Exp;
+            else ok = false;
+        }
+        else if (key == "encoding") {
+            if      (val == "ratio") opt.encoding = EncodingPolicy::Ratio;
+            else if (val == "speed") opt.encoding = EncodingPolicy::Speed;
+            else ok = false;
+        }
+        else if (key == "mix") {
+            u32* slots[] = { &opt.mix_first, &opt.mix_range, &opt.mix_agg, &opt.mix_buckets };
+            size_t n = 0;
+            for (auto part : std::views::split(val, ',')) {
+                if (n == std::size(slots)) { ok = false; break; }
+                ok = ok && parse_num(std::string_view(part.begin(), part.end()), *slots[n++]);
+            }
+            ok = ok && n == std::size(slots)
+                    && opt.mix_first + opt.mix_range + opt.mix_agg + opt.mix_buckets > 0;
+        }
+        else ok = false;
+
+        if (!ok) {
+            std::println(stderr, "bad flag: {}", arg);
+            return None;
+        }
+    }
+
+    return Some(std::move(opt));
+}
+
+} // namespace
+
+auto main(int argc, char** argv) -> i32 {
+    auto parsed = parse(argc, argv);
+    if (parsed.is_none()) {
+        usage();
+        return 1;
+    }
+    const Options opt = std::move(parsed).unwrap();
+
+    Workload w;
+    if (!opt.replay.empty()) {
+        auto loaded = load(opt.replay);
+        if (loaded.is_none()) {
+            std::println(stderr, "cannot read workload from {}", opt.replay);
+            return 1;
+        }
+        w = std::move(loaded).unwrap();
+    } else {
+        w = generate(opt);
+    }
+
+    if (!opt.record.empty() && !save(w, opt.record)) {
+        std::println(stderr, "cannot write workload to {}", opt.record);
+        return 1;
+    }
+
+    run(w, opt);
+    return 0;
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "option.hh"
+#include "schema.hh"
+#include "table.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Rows of one segment or block within the replay range, decoded into row-major structs and
+// sorted by timestamp.
+struct ReplayRun {
+    std::vector<std::byte> rows;
+    std::vector<i64>       timestamps;
+    size_t                 pos = 0;
+    u64                    seq = 0;   // order among the table's runs; breaks timestamp ties
+
+    [[nodiscard]] auto timestamp() const -> i64 { return timestamps[pos]; }
+};
+
+// One table's rows in [t_begin, t_end) in timestamp order. Segments and blocks are decoded
+// one at a time as the replay reaches their first timestamp, the next one on a background
+// thread while the current one is consumed. Late rows make sources overlap, so runs that
+// are decoded at once are merged through a small heap.
+class ReplayCursor {
+public:
+    ReplayCursor(const Table* table, size_t row_size, i64 t_begin, i64 t_end)
+        : table_(table), row_size_(row_size), t_begin_(t_begin), t_end_(t_end)
+    {
+        if (table_ == nullptr) return;
+
+        TableSnapshot snap = table_->snapshot(t_begin, t_end);
+        for (auto& seg : snap.segments) {
+            TableSnapshot one;
+            one.segments.push_back(seg);
+            pending_.push_back({ std::move(one), seg->t_min });
+        }
+        for (auto& b : snap.frozen) {
+            TableSnapshot one;
+            one.frozen.push_back(b);
+            pending_.push_back({ std::move(one), b->t_min });
+        }
+        std::ranges::stable_sort(pending_, {}, &Source::t_min);
+
+        // The open block's bounds move with inserts, so it's decoded now rather than ordered.
+        if (snap.active && snap.active_rows > 0) {
+            TableSnapshot one;
+            one.active      = std::move(snap.active);
+            one.active_rows = snap.active_rows;
+            push_run(decode(table_, row_size_, t_begin_, t_end_, std::move(one)));
+        }
+
+        prefetch();
+        settle();
+    }
+
+    [[nodiscard]] auto done()      const -> bool             { return heap_.empty(); }
+    [[nodiscard]] auto timestamp() const -> i64              { return heap_.front()->timestamp(); }
+    [[nodiscard]] auto row()       const -> const std::byte* { return heap_.front()->rows.data() + heap_.front()->pos * row_size_; }
+
+    auto advance() -> void {
+        std::ranges::pop_heap(heap_, later);
+        ReplayRun& run = *heap_.back();
+        if (++run.pos < run.timestamps.size()) std::ranges::push_heap(heap_, later);
+        else                                   heap_.pop_back();
+        settle();
+    }
+
+private:
+    struct Source {
+        TableSnapshot snap;
+        i64           t_min;
+    };
+
+    static auto later(const std::unique_ptr<ReplayRun>& a, const std::unique_ptr<ReplayRun>& b) -> bool {
+        const i64 ta = a->timestamp(), tb = b->timestamp();
+        return ta != tb ? ta > tb : a->seq > b->seq;
+    }
+
+    [[nodiscard]] static auto decode(const Table* table, size_t row_size, i64 t_begin, i64 t_end, TableSnapshot snap)
+        -> ReplayRun
+    {
+        ReplayRun run;
+        table->for_each_in_snapshot(snap, t_begin, t_end, all_fields, [&](const RowBatch& b, size_t i) {
+            run.timestamps.push_back(b.timestamp(i));
+            run.rows.resize(run.rows.size() + row_size);
+            b.read_row(i, run.rows.data() + run.rows.size() - row_size);
+        });
+        if (std::ranges::is_sorted(run.timestamps)) return run;
+
+        std::vector<u32> order(run.timestamps.size());
+        std::iota(order.begin(), order.end(), 0u);
+        std::ranges::stable_sort(order, {}, [&](u32 i) { return run.timestamps[i]; });
+
+        ReplayRun sorted;
+        sorted.rows.resize(run.rows.size());
+        sorted.timestamps.reserve(order.size());
+        for (size_t k = 0; k < order.size(); ++k) {
+            sorted.timestamps.push_back(run.timestamps[order[k]]);
+            std::memcpy(sorted.rows.data() + k * row_size, run.rows.data() + order[k] * row_size, row_size);
+        }
+        return sorted;
+    }
+
+    auto prefetch() -> void {
+        if (pending_.empty()) return;
+        ahead_ = std::async(std::launch::async, [table = table_, size = row_size_, t_begin = t_begin_, t_end = t_end_,
+                                                  snap = pending_.front().snap]() mutable {
+            return decode(table, size, t_begin, t_end, std::move(snap));
+        });
+    }
+
+    auto push_run(ReplayRun run) -> void {
+        if (run.timestamps.empty()) return;
+        run.seq = next_seq_++;
+        heap_.push_back(std::make_unique<ReplayRun>(std::move(run)));
+        std::ranges::push_heap(heap_, later);
+    }
+
+    // Decodes every source that could hold a row before the current head.
+    auto settle() -> void {
+        while (!pending_.empty() && (heap_.empty() || pending_.front().t_min <= timestamp())) {
+            ReplayRun run = ahead_.get();
+            pending_.pop_front();
+            prefetch();
+            push_run(std::move(run));
+        }
+    }
+
+    const Table* table_;
+    size_t       row_size_;
+    i64          t_begin_;
+    i64          t_end_;
+
+    std::deque<Source>                      pending_;   // by first timestamp; front() is being decoded into ahead_
+    std::future<ReplayRun>                  ahead_;
+    std::vector<std::unique_ptr<ReplayRun>> heap_;      // min-heap on each run's next row
+    u64                                     next_seq_ = 0;
+};
+
+// One replayed row: which of the replayed tables it came from and its bytes, valid until
+// the next call to next().
+struct ReplayRow {
+    size_t           source       = 0;
+    i64              timestamp_ns = 0;
+    const std::byte* row          = nullptr;
+};
+
+// K-way merge of several tables' cursors by timestamp through a loser tree: after each row
+// only the path from the winning cursor's leaf to the root is replayed, log2(k) comparisons
+// against the losers stored on it. Ties go to the table listed first.
+class Replay {
+public:
+    explicit Replay(std::vector<ReplayCursor> cursors)
+        : cursors_(std::move(cursors)), tree_(std::max<size_t>(cursors_.size(), 1))
+    {
+        if (cursors_.size() > 1) tree_[0] = build(1);
+    }
+
+    Replay(Replay&&) = default;
+
+    [[nodiscard]] auto next() -> Option<ReplayRow> {
+        if (cursors_.empty()) return None;
+
+        const size_t last = tree_[0];
+        if (started_ && !cursors_[last].done()) {
+            cursors_[last].advance();
+            replay(last);
+        }
+        started_ = true;
+
+        const size_t w = tree_[0];
+        if (cursors_[w].done()) return None;
+        return Some(ReplayRow { .source = w, .timestamp_ns = cursors_[w].timestamp(), .row = cursors_[w].row() });
+    }
+
+private:
+    [[nodiscard]] auto beats(size_t a, size_t b) const -> bool {
+        if (cursors_[a].done() || cursors_[b].done()) return !cursors_[a].done();
+        const i64 ta = cursors_[a].timestamp(), tb = cursors_[b].timestamp();
+        return ta != tb ? ta < tb : a < b;
+    }
+
+    // Nodes 1..k-1 are internal, k..2k-1 the leaves; returns the subtree's winner and leaves
+    // its loser at the node.
+    auto build(size_t node) -> size_t {
+        const size_t k = cursors_.size();
+        if (node >= k) return node - k;
+
+        const size_t l = build(2 * node), r = build(2 * node + 1);
+        const bool   left = beats(l, r);
+        tree_[node] = left ? r : l;
+        return left ? l : r;
+    }
+
+    auto replay(size_t leaf) -> void {
+        const size_t k = cursors_.size();
+        size_t winner = leaf;
+        for (size_t node = (leaf + k) / 2; node >= 1; node /= 2) {
+            if (beats(tree_[node], winner)) std::swap(tree_[node], winner);
+        }
+        tree_[0] = winner;
+    }
+
+    std::vector<ReplayCursor> cursors_;
+    std::vector<size_t>       tree_;   // tree_[0] is the overall winner
+    bool                      started_ = false;
+};
+
+// Replay that hands out each row as a copy tagged by its table: the variant's index is the
+// table's position in the list, so tables of the same struct stay distinguishable.
+template <typename... Ts>
+class TypedReplay {
+public:
+    explicit TypedReplay(Replay inner) : inner_(std::move(inner)) {}
+
+    [[nodiscard]] auto next() -> Option<std::variant<Ts...>> {
+        auto row = inner_.next();
+        if (row.is_none()) return None;
+        return Some(make[row.unwrap().source](row.unwrap().row));
+    }
+
+private:
+    using Make = std::variant<Ts...> (*)(const std::byte*);
+
+    template <size_t I>
+    static auto make_one(const std::byte* p) -> std::variant<Ts...> {
+        std::variant_alternative_t<I, std::variant<Ts...>> v;
+        std::memcpy(&v, p, sizeof(v));
+        return std::variant<Ts...>(std::in_place_index<I>, v);
+    }
+
+    static constexpr auto make = []<size_t... Is>(std::index_sequence<Is...>) {
+        return std::array<Make, sizeof...(Ts)> { &make_one<Is>... };
+    }(std::index_sequence_for<Ts...>{});
+
+    Replay inner_;
+};
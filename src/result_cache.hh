@@ -0,0 +1,125 @@
+#pragma once
+
+#include "absl/container/flat_hash_map.h"
+
+#include "table.hh"
+#include "utils.hh"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+struct ResultCacheStats {
+    u64    hits          = 0;   // no segment changed since the result was cached
+    u64    partial_hits  = 0;   // some segments changed; only those were recomputed
+    u64    misses        = 0;
+    u64    evictions     = 0;
+    size_t entries       = 0;
+    size_t bytes         = 0;
+    size_t max_bytes     = 0;
+};
+
+// Bucketed aggregates of one query, kept per sealed segment so that once segments are
+// sealed, merged or dropped only the ones that changed need scanning again. Rows not yet
+// sealed are never cached.
+struct CachedAggregate {
+    struct Part {
+        u64                   segment = 0;   // Segment::id; a rewritten segment gets a new id
+        size_t                first   = 0;   // bucket of buckets[0]
+        std::vector<AggState> buckets;       // the segment's rows in buckets [first, first + size)
+    };
+
+    u64                   version = 0;   // table version the parts were taken at
+    std::vector<Part>     parts;         // in segment order
+    std::vector<AggState> sealed;        // parts merged, per bucket
+
+    [[nodiscard]] auto bytes() const -> size_t {
+        size_t n = sizeof(*this) + sealed.capacity() * sizeof(AggState) + parts.capacity() * sizeof(Part);
+        for (const auto& p : parts) n += p.buckets.capacity() * sizeof(AggState);
+        return n;
+    }
+};
+
+struct ResultCacheKey {
+    u32 table     = 0;
+    u32 field     = 0;
+    i64 t_begin   = 0;
+    i64 t_end     = 0;
+    i64 bucket_ns = 0;
+
+    friend auto operator==(const ResultCacheKey&, const ResultCacheKey&) -> bool = default;
+
+    template <typename H>
+    friend auto AbslHashValue(H h, const ResultCacheKey& k) -> H {
+        return H::combine(std::move(h), k.table, k.field, k.t_begin, k.t_end, k.bucket_ns);
+    }
+};
+
+// LRU map from queries to their per-segment results, bounded by bytes. Entries are
+// immutable once stored; refreshing one stores a replacement.
+class ResultCache {
+public:
+    explicit ResultCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+    [[nodiscard]] auto find(const ResultCacheKey& key) -> std::shared_ptr<const CachedAggregate> {
+        std::lock_guard lock(mutex_);
+        auto it = index_.find(key);
+        if (it == index_.end()) return nullptr;
+
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    auto store(const ResultCacheKey& key, std::shared_ptr<const CachedAggregate> value) -> void {
+        const size_t size = value->bytes();
+
+        std::lock_guard lock(mutex_);
+        if (auto it = index_.find(key); it != index_.end()) {
+            bytes_ -= it->second->second->bytes();
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+        if (size > max_bytes_) return;
+
+        lru_.emplace_front(key, std::move(value));
+        index_.emplace(key, lru_.begin());
+        bytes_ += size;
+
+        while (bytes_ > max_bytes_) {
+            auto& [victim, result] = lru_.back();
+            bytes_ -= result->bytes();
+            index_.erase(victim);
+            lru_.pop_back();
+            ++stats_.evictions;
+        }
+    }
+
+    auto record(bool hit, bool partial) -> void {
+        std::lock_guard lock(mutex_);
+        if (hit)          ++stats_.hits;
+        else if (partial) ++stats_.partial_hits;
+        else              ++stats_.misses;
+    }
+
+    [[nodiscard]] auto stats() const -> ResultCacheStats {
+        std::lock_guard lock(mutex_);
+        ResultCacheStats out = stats_;
+        out.entries   = index_.size();
+        out.bytes     = bytes_;
+        out.max_bytes = max_bytes_;
+        return out;
+    }
+
+private:
+    using Entry = std::pair<ResultCacheKey, std::shared_ptr<const CachedAggregate>>;
+
+    size_t max_bytes_;
+    size_t bytes_ = 0;
+
+    mutable std::mutex mutex_;
+    std::list<Entry>   lru_;   // most recently used first
+    absl::flat_hash_map<ResultCacheKey, std::list<Entry>::iterator> index_;
+    ResultCacheStats   stats_;
+};
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "absl/container/flat_hash_map.h"
+
+#include "encoding.hh"
+#include "schema.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Compressed set of u32s after Chambi et al., "Better bitmap performance with Roaring
+// bitmaps" (2016): values are split on their high 16 bits into containers of the low 16,
+// each a sorted array while it holds at most 4096 of them and a 65536-bit bitmap past that,
+// so sparse and dense runs both stay small and intersections work a container at a time.
+// Run containers are left out; row sets of one segment rarely have long enough runs.
+class Roaring {
+public:
+    static constexpr u32 array_max = 4096;   // past this a bitmap is smaller than the array
+
+    // Appending in ascending order, as index builds do, only ever touches the last container.
+    auto add(u32 v) -> void {
+        const u16 key = static_cast<u16>(v >> 16), low = static_cast<u16>(v);
+        if (containers_.empty() || containers_.back().key < key) {
+            containers_.push_back({ .key = key });
+            containers_.back().add(low);
+            return;
+        }
+
+        auto it = std::ranges::lower_bound(containers_, key, {}, &Container::key);
+        if (it == containers_.end() || it->key != key) it = containers_.insert(it, { .key = key });
+        it->add(low);
+    }
+
+    [[nodiscard]] auto contains(u32 v) const -> bool {
+        const u16 key = static_cast<u16>(v >> 16);
+        const auto it = std::ranges::lower_bound(containers_, key, {}, &Container::key);
+        return it != containers_.end() && it->key == key && it->contains(static_cast<u16>(v));
+    }
+
+    [[nodiscard]] auto cardinality() const -> u64 {
+        u64 n = 0;
+        for (const auto& c : containers_) n += c.cardinality;
+        return n;
+    }
+
+    [[nodiscard]] auto empty() const -> bool { return containers_.empty(); }
+
+    // Calls fn(v) for every value, ascending.
+    template <typename F>
+    auto for_each(F&& fn) const -> void {
+        for (const auto& c : containers_) {
+            const u32 high = u32{c.key} << 16;
+            if (!c.is_bitmap()) {
+                for (u16 low : c.array) fn(high | low);
+                continue;
+            }
+            for (size_t w = 0; w < c.bits.size(); ++w) {
+                for (u64 word = c.bits[w]; word != 0; word &= word - 1) {
+                    fn(high | static_cast<u32>(w * 64 + static_cast<size_t>(std::countr_zero(word))));
+                }
+            }
+        }
+    }
+
+    auto to_vector(std::vector<u32>& out) const -> void {
+        out.clear();
+        out.reserve(cardinality());
+        for_each([&](u32 v) { out.push_back(v); });
+    }
+
+    [[nodiscard]] auto memory_bytes() const -> size_t {
+        size_t n = containers_.capacity() * sizeof(Container);
+        for (const auto& c : containers_) n += c.array.capacity() * sizeof(u16) + c.bits.capacity() * sizeof(u64);
+        return n;
+    }
+
+    friend auto operator&(const Roaring& a, const Roaring& b) -> Roaring {
+        return combine<false, false>(a, b, [](const Container& x, const Container& y) { return intersect(x, y); });
+    }
+
+    friend auto operator|(const Roaring& a, const Roaring& b) -> Roaring {
+        return combine<true, true>(a, b, [](const Container& x, const Container& y) { return unite(x, y); });
+    }
+
+    // Values of a that aren't in b (ANDNOT).
+    friend auto operator-(const Roaring& a, const Roaring& b) -> Roaring {
+        return combine<true, false>(a, b, [](const Container& x, const Container& y) { return subtract(x, y); });
+    }
+
+private:
+    static constexpr size_t bitmap_words = 65536 / 64;
+
+    struct Container {
+        u16              key         = 0;
+        u32              cardinality = 0;
+        std::vector<u16> array;   // sorted, while cardinality <= array_max
+        std::vector<u64> bits;    // bitmap_words words otherwise
+
+        [[nodiscard]] auto is_bitmap() const -> bool { return !bits.empty(); }
+
+        [[nodiscard]] auto contains(u16 v) const -> bool {
+            if (is_bitmap()) return (bits[v / 64] >> (v % 64)) & 1;
+            return std::ranges::binary_search(array, v);
+        }
+
+        auto add(u16 v) -> void {
+            if (is_bitmap()) {
+                const u64 bit = u64{1} << (v % 64);
+                cardinality += (bits[v / 64] & bit) ? 0 : 1;
+                bits[v / 64] |= bit;
+                return;
+            }
+
+            if (array.empty() || array.back() < v) {
+                array.push_back(v);
+            } else {
+                const auto it = std::ranges::lower_bound(array, v);
+                if (*it == v) return;
+                array.insert(it, v);
+            }
+            if (++cardinality > array_max) to_bitmap();
+        }
+
+        auto to_bitmap() -> void {
+            bits.assign(bitmap_words, 0);
+            for (u16 v : array) bits[v / 64] |= u64{1} << (v % 64);
+            array = {};
+        }
+
+        auto to_array() -> void {
+            array.clear();
+            array.reserve(cardinality);
+            for (size_t w = 0; w < bits.size(); ++w) {
+                for (u64 word = bits[w]; word != 0; word &= word - 1) {
+                    array.push_back(static_cast<u16>(w * 64 + static_cast<size_t>(std::countr_zero(word))));
+                }
+            }
+            bits = {};
+        }
+
+        // Picks the smaller form for the current cardinality.
+        auto settle() -> void {
+            if (is_bitmap() && cardinality <= array_max) to_array();
+            else if (!is_bitmap() && cardinality > array_max) to_bitmap();
+        }
+    };
+
+    [[nodiscard]] static auto popcount(std::span<const u64> words) -> u32 {
+        u32 n = 0;
+        for (u64 w : words) n += static_cast<u32>(std::popcount(w));
+        return n;
+    }
+
+    [[nodiscard]] static auto test(const Container& c, u16 v) -> bool {
+        return (c.bits[v / 64] >> (v % 64)) & 1;
+    }
+
+    [[nodiscard]] static auto intersect(const Container& a, const Container& b) -> Container {
+        Container out { .key = a.key };
+        if (a.is_bitmap() && b.is_bitmap()) {
+            out.bits.resize(bitmap_words);
+            for (size_t w = 0; w < bitmap_words; ++w) out.bits[w] = a.bits[w] & b.bits[w];
+            out.cardinality = popcount(out.bits);
+        } else if (a.is_bitmap() || b.is_bitmap()) {
+            const Container& arr = a.is_bitmap() ? b : a;
+            const Container& bm  = a.is_bitmap() ? a : b;
+            for (u16 v : arr.array) {
+                if (test(bm, v)) out.array.push_back(v);
+            }
+            out.cardinality = static_cast<u32>(out.array.size());
+        } else {
+            std::ranges::set_intersection(a.array, b.array, std::back_inserter(out.array));
+            out.cardinality = static_cast<u32>(out.array.size());
+        }
+        out.settle();
+        return out;
+    }
+
+    [[nodiscard]] static auto unite(const Container& a, const Container& b) -> Container {
+        Container out { .key = a.key };
+        if (!a.is_bitmap() && !b.is_bitmap()) {
+            out.array.reserve(a.array.size() + b.array.size());
+            std::ranges::set_union(a.array, b.array, std::back_inserter(out.array));
+            out.cardinality = static_cast<u32>(out.array.size());
+        } else {
+            const Container& bm    = a.is_bitmap() ? a : b;
+            const Container& other = a.is_bitmap() ? b : a;
+            out.bits = bm.bits;
+            if (other.is_bitmap()) {
+                for (size_t w = 0; w < bitmap_words; ++w) out.bits[w] |= other.bits[w];
+            } else {
+                for (u16 v : other.array) out.bits[v / 64] |= u64{1} << (v % 64);
+            }
+            out.cardinality = popcount(out.bits);
+        }
+        out.settle();
+        return out;
+    }
+
+    [[nodiscard]] static auto subtract(const Container& a, const Container& b) -> Container {
+        Container out { .key = a.key };
+        if (a.is_bitmap()) {
+            out.bits = a.bits;
+            if (b.is_bitmap()) {
+                for (size_t w = 0; w < bitmap_words; ++w) out.bits[w] &= ~b.bits[w];
+            } else {
+                for (u16 v : b.array) out.bits[v / 64] &= ~(u64{1} << (v % 64));
+            }
+            out.cardinality = popcount(out.bits);
+        } else if (b.is_bitmap()) {
+            for (u16 v : a.array) {
+                if (!test(b, v)) out.array.push_back(v);
+            }
+            out.cardinality = static_cast<u32>(out.array.size());
+        } else {
+            std::ranges::set_difference(a.array, b.array, std::back_inserter(out.array));
+            out.cardinality = static_cast<u32>(out.array.size());
+        }
+        out.settle();
+        return out;
+    }
+
+    // Walks both container lists by key, combining the ones they share. Containers only one
+    // side has are copied when the operation keeps them: KeepLeft for OR and ANDNOT,
+    // KeepRight for OR.
+    template <bool KeepLeft, bool KeepRight, typename Op>
+    static auto combine(const Roaring& a, const Roaring& b, Op&& op) -> Roaring {
+        Roaring out;
+        size_t i = 0, j = 0;
+        while (i < a.containers_.size() || j < b.containers_.size()) {
+            const bool has_a = i < a.containers_.size(), has_b = j < b.containers_.size();
+            if (has_a && (!has_b || a.containers_[i].key < b.containers_[j].key)) {
+                if constexpr (KeepLeft) out.containers_.push_back(a.containers_[i]);
+                ++i;
+            } else if (has_b && (!has_a || b.containers_[j].key < a.containers_[i].key)) {
+                if constexpr (KeepRight) out.containers_.push_back(b.containers_[j]);
+                ++j;
+            } else {
+                Container c = op(a.containers_[i], b.containers_[j]);
+                if (c.cardinality > 0) out.containers_.push_back(std::move(c));
+                ++i;
+                ++j;
+            }
+        }
+        return out;
+    }
+
+    std::vector<Container> containers_;   // by key
+};
+
+// Bitmap index over one integral column of a segment: for each distinct value, the row
+// offsets holding it. Only built for low-cardinality columns (flags, states, enum codes);
+// past max_values distinct values a ValueIndex serves better.
+struct BitmapIndex {
+    static constexpr size_t max_values = 1024;
+
+    std::vector<i64>     values;    // ascending
+    std::vector<Roaring> bitmaps;   // rows holding values[i]
+
+    // nullptr if the column has more than max_values distinct values.
+    [[nodiscard]] static auto build(Schema::TypeKind kind, size_t elem_size, std::span<const std::byte> raw)
+        -> std::shared_ptr<const BitmapIndex>
+    {
+        if (!is_integral(kind)) return nullptr;
+
+        const size_t n = raw.size() / elem_size;
+
+        // Rows are visited in order, so each bitmap is only ever appended to.
+        absl::flat_hash_map<i64, u32> slot;
+        std::vector<std::pair<i64, Roaring>> found;
+        for (size_t i = 0; i < n; ++i) {
+            const i64 v = load_i64(kind, raw.data() + i * elem_size);
+            auto [it, fresh] = slot.try_emplace(v, static_cast<u32>(found.size()));
+            if (fresh) {
+                if (found.size() == max_values) return nullptr;
+                found.emplace_back(v, Roaring{});
+            }
+            found[it->second].second.add(static_cast<u32>(i));
+        }
+        std::ranges::sort(found, {}, &std::pair<i64, Roaring>::first);
+
+        auto index = std::make_shared<BitmapIndex>();
+        index->values.reserve(found.size());
+        index->bitmaps.reserve(found.size());
+        for (auto& [v, rows] : found) {
+            index->values.push_back(v);
+            index->bitmaps.push_back(std::move(rows));
+        }
+        return index;
+    }
+
+    // Rows holding `value`; nullptr if none do.
+    [[nodiscard]] auto find(i64 value) const -> const Roaring* {
+        const auto it = std::ranges::lower_bound(values, value);
+        if (it == values.end() || *it != value) return nullptr;
+        return &bitmaps[static_cast<size_t>(it - values.begin())];
+    }
+
+    [[nodiscard]] auto memory_bytes() const -> size_t {
+        size_t n = values.capacity() * sizeof(i64) + bitmaps.capacity() * sizeof(Roaring);
+        for (const auto& b : bitmaps) n += b.memory_bytes();
+        return n;
+    }
+};
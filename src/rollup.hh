@@ -0,0 +1,160 @@
+#pragma once
+
+#include "absl/container/flat_hash_map.h"
+
+#include "schema.hh"
+#include "table.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Start of the width-wide bucket holding ts; buckets are aligned to timestamp 0.
+[[nodiscard]] constexpr auto bucket_floor(i64 ts, i64 width) noexcept -> i64 {
+    i64 r = ts % width;
+    if (r < 0) r += width;
+    return ts - r;
+}
+
+// One row of a continuous aggregate: count, sum, min and max of the source rows with
+// timestamp_ns <= timestamp < timestamp_ns + bucket_ns. Rows arriving for a bucket after it
+// was sealed are stored as another row for the same bucket; query_rollup() merges them, and
+// sum, count, min and max over the stored rows come out right either way.
+struct RollupRow {
+    i64 timestamp_ns = 0;   // bucket start
+    u64 count        = 0;
+    f64 sum          = 0.0;
+    f64 min          = std::numeric_limits<f64>::infinity();
+    f64 max          = -std::numeric_limits<f64>::infinity();
+
+    [[nodiscard]] auto state() const noexcept -> AggState {
+        return AggState { .count = count, .sum = sum, .min = min, .max = max };
+    }
+
+    [[nodiscard]] static auto of(i64 start, const AggState& s) noexcept -> RollupRow {
+        return RollupRow { .timestamp_ns = start, .count = s.count, .sum = s.sum, .min = s.min, .max = s.max };
+    }
+};
+
+struct RollupOptions {
+    i64 bucket_ns   = 60'000'000'000;
+    i64 lateness_ns = 0;   // a bucket is sealed once the newest timestamp is this far past its end
+};
+
+struct DownsampleTier {
+    i64 bucket_ns  = 0;
+    i64 max_age_ns = 0;   // the tier's retention; 0 = keep forever
+};
+
+struct DownsampleOptions {
+    std::vector<DownsampleTier> tiers;
+    i64 lateness_ns    = 0;   // see RollupOptions
+    i64 raw_max_age_ns = 0;   // replaces the raw table's retention, to expire it sooner than the tiers; 0 = leave it
+};
+
+// The downsampled tiers of one field, for the query planner.
+struct DownsampledField {
+    size_t field = 0;
+    i64    from  = 0;   // the tiers hold every row at or after this; older ones only raw
+    std::vector<std::pair<i64, TypeHandle>> tiers;   // (bucket_ns, rollup table), coarsest first
+};
+
+// Keeps the open buckets of one continuous aggregate. Rows are folded in as they're
+// inserted into the source table; buckets the newest timestamp has moved past are handed
+// back to be appended to the rollup's own table.
+class Rollup {
+public:
+    Rollup(TypeHandle source, TypeHandle target, size_t field, const Layout& layout, RollupOptions opts)
+        : source_(source), target_(target), field_(field),
+          ts_offset_(layout.offsets[0]), offset_(layout.offsets[field]), kind_(layout.kinds[field]), opts_(opts)
+    {}
+
+    [[nodiscard]] auto source() const -> TypeHandle { return source_; }
+    [[nodiscard]] auto target() const -> TypeHandle { return target_; }
+    [[nodiscard]] auto field()  const -> size_t     { return field_; }
+
+    // Folds `count` rows of `stride` bytes in and returns the buckets that closed, oldest first.
+    auto add(const std::byte* rows, size_t count, size_t stride) -> std::vector<RollupRow> {
+        std::vector<RollupRow> sealed;
+
+        std::lock_guard lock(mutex_);
+
+        // Rows mostly arrive in order, so runs of them share a bucket: fold each run locally
+        // and look its bucket up once.
+        AggState run;
+        i64      run_start = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const std::byte* row = rows + i * stride;
+
+            i64 ts;
+            std::memcpy(&ts, row + ts_offset_, sizeof(ts));
+
+            const i64 start = bucket_of(ts);
+            if (run.count > 0 && start != run_start) {
+                open_[run_start].merge(run);
+                run = {};
+            }
+            if (run.count == 0) {
+                run_start   = start;
+                next_close_ = std::min(next_close_, closes_at(start));
+            }
+            run.add(load_f64(kind_, row + offset_));
+            newest_ = std::max(newest_, ts);
+        }
+        if (run.count > 0) open_[run_start].merge(run);
+
+        if (newest_ < next_close_) return sealed;
+
+        next_close_ = std::numeric_limits<i64>::max();
+        for (auto it = open_.begin(); it != open_.end();) {
+            const i64 close = closes_at(it->first);
+            if (newest_ >= close) {
+                sealed.push_back(RollupRow::of(it->first, it->second));
+                open_.erase(it++);
+            } else {
+                next_close_ = std::min(next_close_, close);
+                ++it;
+            }
+        }
+
+        std::ranges::sort(sealed, {}, &RollupRow::timestamp_ns);
+        return sealed;
+    }
+
+    // Open buckets starting in [t_begin, t_end).
+    [[nodiscard]] auto open(i64 t_begin, i64 t_end) const -> std::vector<RollupRow> {
+        std::vector<RollupRow> out;
+
+        std::lock_guard lock(mutex_);
+        for (const auto& [start, state] : open_) {
+            if (start >= t_begin && start < t_end) out.push_back(RollupRow::of(start, state));
+        }
+        return out;
+    }
+
+private:
+    [[nodiscard]] auto bucket_of(i64 ts) const -> i64 { return bucket_floor(ts, opts_.bucket_ns); }
+
+    // Saturates rather than overflowing for buckets at the end of the timeline.
+    [[nodiscard]] auto closes_at(i64 start) const -> i64 {
+        const i64 wait = opts_.bucket_ns + opts_.lateness_ns;
+        return start > std::numeric_limits<i64>::max() - wait ? std::numeric_limits<i64>::max() : start + wait;
+    }
+
+    TypeHandle       source_;
+    TypeHandle       target_;
+    size_t           field_;
+    size_t           ts_offset_;
+    size_t           offset_;
+    Schema::TypeKind kind_;
+    RollupOptions    opts_;
+
+    mutable std::mutex                    mutex_;
+    absl::flat_hash_map<i64, AggState>    open_;
+    i64 newest_     = std::numeric_limits<i64>::min();
+    i64 next_close_ = std::numeric_limits<i64>::max();   // earliest close among open_
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <concepts>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr auto align_up(T value, T alignment) noexcept -> T {
+    assert(alignment != 0);
+    assert(std::has_single_bit(alignment));
+
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+class Schema;
+class TSDB;
+
+struct TypeHandle {
+    constexpr TypeHandle(u32 v) : v_(v) {}
+
+    constexpr friend bool operator==(TypeHandle, TypeHandle) = default;
+
+    template <typename H>
+    friend H AbslHashValue(H h, const TypeHandle& t) {
+        return H::combine(std::move(h), t.v_);
+    }
+
+private:
+    friend class Schema;
+    friend class TSDB;
+
+    u32 v_;
+};
+
+class Schema {
+public:
+    enum class TypeKind : u8 {
+        U8, U16, U32, U64,
+        I8, I16, I32, I64,
+        F32, F64,
+        BOOL,
+        TIMESTAMP_NS,
+        STRUCT,
+    };
+
+    struct Field {
+        std::string name;
+        TypeHandle  type;
+        u32         offset = 0;
+    };
+
+    struct TypeMeta {
+        std::string        name;
+        TypeKind           kind;
+        u32                size      = 0;
+        u32                alignment = 1;
+        std::vector<Field> fields;
+    };
+
+    Schema(size_t est_num_types) { init_schema(est_num_types); }
+
+    auto register_struct(std::string name,
+                         std::initializer_list<std::pair<std::string, const TypeHandle>> fields) -> TypeHandle
+    {
+        TypeMeta type {
+            .name = std::move(name),
+            .kind = TypeKind::STRUCT,
+        };
+
+        type.alignment = 8;
+        type.size      = 8;
+        type.fields.push_back({ "timestamp_ns", { static_cast<u32>(TypeKind::TIMESTAMP_NS) }, 0 });
+
+        for (auto&& [field_name, handle] : fields) {
+            const auto& ft = meta_of(handle);
+            type.alignment  = std::max(type.alignment, ft.alignment);
+            type.size       = align_up(type.size, ft.alignment);
+            type.fields.push_back({ field_name, handle, type.size });
+            type.size += ft.size;
+        }
+
+        type.size = align_up(type.size, type.alignment);
+
+        const TypeHandle result { static_cast<u32>(types_.size()) };
+        types_.push_back(std::move(type));
+        return result;
+    }
+
+    [[nodiscard]] auto meta_of(TypeHandle h) const -> const TypeMeta&  { return types_[h.v_]; }
+
+private:
+    void init_schema(size_t est_num_types) {
+        constexpr std::pair<std::string_view, TypeKind> prims[] = {
+            {"u8",  TypeKind::U8},  {"u16", TypeKind::U16}, {"u32", TypeKind::U32}, {"u64", TypeKind::U64},
+            {"i8",  TypeKind::I8},  {"i16", TypeKind::I16}, {"i32", TypeKind::I32}, {"i64", TypeKind::I64},
+            {"f32", TypeKind::F32}, {"f64", TypeKind::F64},
+            {"bool", TypeKind::BOOL},
+            {"timestamp_ns", TypeKind::TIMESTAMP_NS},
+        };
+
+        constexpr u32 sizes[] = {
+            1, 2, 4, 8,
+            1, 2, 4, 8,
+            4, 8,
+            1,
+            8,
+        };
+
+        for (u32 i = 0; i < std::size(prims); ++i) {
+            types_.push_back(TypeMeta {
+                .name      = std::string(prims[i].first),
+                .kind      = prims[i].second,
+                .size      = sizes[i],
+                .alignment = sizes[i],
+            });
+        }
+
+        types_.reserve(types_.size() + est_num_types);
+    }
+
+    std::vector<TypeMeta> types_;
+};
+
+[[nodiscard]] inline auto is_numeric(Schema::TypeKind kind) noexcept -> bool {
+    return kind != Schema::TypeKind::STRUCT;
+}
+
+// An integral value (see is_integral()) widened to i64; u64 values above i64's range wrap.
+[[nodiscard]] inline auto load_i64(Schema::TypeKind kind, const std::byte* p) noexcept -> i64 {
+    auto load = [p]<typename T>(T) {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return static_cast<i64>(v);
+    };
+
+    using K = Schema::TypeKind;
+    switch (kind) {
+        case K::U8:  return load(u8{});
+        case K::U16: return load(u16{});
+        case K::U32: return load(u32{});
+        case K::U64: return load(u64{});
+        case K::I8:  return load(i8{});
+        case K::I16: return load(i16{});
+        case K::I32: return load(i32{});
+        case K::I64: return load(i64{});
+        case K::BOOL: return load(u8{});
+        case K::TIMESTAMP_NS: return load(i64{});
+        case K::F32: case K::F64: case K::STRUCT: break;
+    }
+    return 0;
+}
+
+[[nodiscard]] inline auto load_f64(Schema::TypeKind kind, const std::byte* p) noexcept -> f64 {
+    auto load = [p]<typename T>(T) {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return static_cast<f64>(v);
+    };
+
+    using K = Schema::TypeKind;
+    switch (kind) {
+        case K::U8:  return load(u8{});
+        case K::U16: return load(u16{});
+        case K::U32: return load(u32{});
+        case K::U64: return load(u64{});
+        case K::I8:  return load(i8{});
+        case K::I16: return load(i16{});
+        case K::I32: return load(i32{});
+        case K::I64: return load(i64{});
+        case K::F32: return load(f32{});
+        case K::F64: return load(f64{});
+        case K::BOOL: return load(u8{});
+        case K::TIMESTAMP_NS: return load(i64{});
+        case K::STRUCT: break;
+    }
+    return std::numeric_limits<f64>::quiet_NaN();
+}
@@ -0,0 +1,486 @@
+#pragma once
+
+#include "async_reader.hh"
+#include "buffer_pool.hh"
+#include "crc32c.hh"
+#include "result.hh"
+#include "table.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// On-disk form of a sealed Segment:
+//
+//   SegmentFileHeader | SegmentFileColumn[field_count] | padding | chunk | padding | chunk ...
+//
+// Chunks start on page boundaries so a chunk never shares a page with its neighbour. The
+// header and directory are checksummed together and checked on open; each chunk carries
+// its own CRC32C, checked when its bytes are first read.
+constexpr u64    segment_file_magic   = 0x31474553'42445354ULL; // "TSDBSEG1"
+constexpr u32    segment_file_version = 2;
+constexpr size_t segment_file_align   = 4096;
+
+struct SegmentFileHeader {
+    u64 magic;
+    u32 version;
+    u32 field_count;
+    u64 id;
+    u64 row_begin;
+    u64 rows;
+    i64 t_min;
+    i64 t_max;
+    u32 directory_crc;   // CRC32C of the header, with this field zeroed, and the column directory
+    u32 pad;
+};
+
+struct SegmentFileColumn {
+    u8  encoding;
+    u8  pad[3];
+    u32 crc;
+    u64 offset;
+    u64 size;
+    f64 min;
+    f64 max;
+};
+
+// True if `bytes` are what the chunk's checksum says (or it has none).
+[[nodiscard]] inline auto chunk_intact(const ColumnChunk& chunk, std::span<const std::byte> bytes) -> bool {
+    return chunk.crc.is_none() || crc32c(bytes) == chunk.crc.unwrap();
+}
+
+[[noreturn]] inline auto throw_corrupt_chunk(const std::filesystem::path& path, const ColumnChunk& chunk) -> void {
+    throw std::system_error(std::make_error_code(std::errc::bad_message),
+                            std::format("{}: checksum mismatch in chunk at offset {}", path.string(), chunk.file_offset));
+}
+
+// A read-only mapping of a whole file. Optionally deletes the file once unmapped, which is
+// how spilled segments clean up after themselves when retention or compaction drops them.
+// As the source of a segment's chunks it checks each chunk's checksum on first use, so a
+// chunk nobody reads is never checked and one that's scanned repeatedly is checked once.
+class MappedFile final : public ChunkSource {
+public:
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() override {
+#if defined(__linux__) || defined(__APPLE__)
+        if (data_ != nullptr) ::munmap(data_, size_);
+#endif
+        if (remove_) {
+            std::error_code ec;
+            std::filesystem::remove(path_, ec);
+        }
+    }
+
+    [[nodiscard]] static auto open(std::filesystem::path path, bool remove_on_close)
+        -> Result<std::shared_ptr<MappedFile>, std::error_code>
+    {
+        auto file = std::shared_ptr<MappedFile>(new MappedFile(std::move(path), remove_on_close));
+
+#if defined(__linux__) || defined(__APPLE__)
+        const int fd = ::open(file->path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return Err(std::error_code(errno, std::system_category()));
+
+        struct stat st {};
+        if (::fstat(fd, &st) != 0) {
+            const int e = errno;
+            ::close(fd);
+            return Err(std::error_code(e, std::system_category()));
+        }
+
+        file->size_ = static_cast<size_t>(st.st_size);
+        void* p = ::mmap(nullptr, file->size_, PROT_READ, MAP_SHARED, fd, 0);
+        const int e = errno;
+        ::close(fd);
+
+        if (p == MAP_FAILED) return Err(std::error_code(e, std::system_category()));
+        file->data_ = p;
+#else
+        std::ifstream in(file->path_, std::ios::binary | std::ios::ate);
+        if (!in) return Err(std::make_error_code(std::errc::io_error));
+
+        file->size_ = static_cast<size_t>(in.tellg());
+        file->fallback_.resize(file->size_);
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(file->fallback_.data()), static_cast<std::streamsize>(file->size_));
+        file->data_ = file->fallback_.data();
+#endif
+        return Ok(std::move(file));
+    }
+
+    [[nodiscard]] auto bytes() const -> std::span<const std::byte> {
+        return { static_cast<const std::byte*>(data_), size_ };
+    }
+
+    [[nodiscard]] auto path() const -> const std::filesystem::path& { return path_; }
+
+    // Chunks load() will be asked for; must be called before the file is shared.
+    auto track(std::span<const ColumnChunk> chunks) -> void {
+        offsets_.clear();
+        for (const auto& c : chunks) offsets_.push_back(c.file_offset);
+        std::ranges::sort(offsets_);
+        verified_ = std::make_unique<std::atomic<bool>[]>(offsets_.size());
+    }
+
+    [[nodiscard]] auto load(const ColumnChunk& chunk, size_t /*footprint*/, ChunkPin& /*pin*/) const
+        -> std::span<const std::byte> override
+    {
+        const auto data = bytes().subspan(chunk.file_offset, chunk.file_size);
+
+        const auto i = static_cast<size_t>(std::ranges::lower_bound(offsets_, chunk.file_offset) - offsets_.begin());
+        if (i < offsets_.size() && !verified_[i].load(std::memory_order_acquire)) {
+            if (!chunk_intact(chunk, data)) throw_corrupt_chunk(path_, chunk);
+            verified_[i].store(true, std::memory_order_release);
+        }
+        return data;
+    }
+
+private:
+    MappedFile(std::filesystem::path path, bool remove) : path_(std::move(path)), remove_(remove) {}
+
+    std::filesystem::path path_;
+    bool                  remove_;
+    void*                 data_ = nullptr;
+    size_t                size_ = 0;
+
+    std::vector<u64>                     offsets_;    // tracked chunks, by file offset
+    std::unique_ptr<std::atomic<bool>[]> verified_;   // per tracked chunk
+#if !defined(__linux__) && !defined(__APPLE__)
+    std::vector<std::byte> fallback_;
+#endif
+};
+
+// Writes `seg` to `path`; returns the file size.
+[[nodiscard]] inline auto write_segment_file(const std::filesystem::path& path, const Segment& seg)
+    -> Result<u64, std::error_code>
+{
+    const size_t n = seg.columns.size();
+
+    SegmentFileHeader header {
+        .magic       = segment_file_magic,
+        .version     = segment_file_version,
+        .field_count = static_cast<u32>(n),
+        .id          = seg.id,
+        .row_begin   = seg.row_begin,
+        .rows        = seg.rows,
+        .t_min       = seg.t_min,
+        .t_max       = seg.t_max,
+        .directory_crc = 0,
+        .pad           = 0,
+    };
+
+    std::vector<SegmentFileColumn> cols(n);
+    u64 offset = align_up<u64>(sizeof(header) + n * sizeof(SegmentFileColumn), segment_file_align);
+    for (size_t f = 0; f < n; ++f) {
+        const auto& chunk = seg.columns[f];
+        cols[f] = SegmentFileColumn {
+            .encoding = std::to_underlying(chunk.encoding),
+            .pad      = {},
+            .crc      = chunk.crc.is_some() ? chunk.crc.unwrap() : crc32c(chunk.data),
+            .offset   = offset,
+            .size     = chunk.data.size(),
+            .min      = chunk.min,
+            .max      = chunk.max,
+        };
+        offset = align_up<u64>(offset + chunk.data.size(), segment_file_align);
+    }
+
+    header.directory_crc = crc32c(std::as_bytes(std::span(cols)), crc32c(std::as_bytes(std::span(&header, 1))));
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) return Err(std::make_error_code(std::errc::io_error));
+
+    auto pad_to = [&](u64 pos) {
+        static constexpr char zeros[segment_file_align] = {};
+        const auto cur = static_cast<u64>(out.tellp());
+        out.write(zeros, static_cast<std::streamsize>(pos - cur));
+    };
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(cols.data()), static_cast<std::streamsize>(n * sizeof(SegmentFileColumn)));
+    for (size_t f = 0; f < n; ++f) {
+        pad_to(cols[f].offset);
+        out.write(reinterpret_cast<const char*>(seg.columns[f].data.data()), static_cast<std::streamsize>(cols[f].size));
+    }
+    pad_to(offset);
+
+    out.close();
+    if (!out) return Err(std::make_error_code(std::errc::io_error));
+
+    return Ok(offset);
+}
+
+// A segment file read on demand through a BufferPool instead of being mapped: each chunk
+// is read into a pool frame the first time a scan needs it (or prefetches it) and pinned
+// while decoded. Frame reads go through an AsyncReader, with O_DIRECT where the file system
+// allows it; chunks start on page boundaries and frames are page aligned, so only the
+// length needs rounding up.
+class PooledFile final : public ChunkSource, public std::enable_shared_from_this<PooledFile> {
+public:
+    PooledFile(const PooledFile&)            = delete;
+    PooledFile& operator=(const PooledFile&) = delete;
+
+    ~PooledFile() override {
+        pool_->forget(id_);
+#if defined(__linux__) || defined(__APPLE__)
+        if (fd_ >= 0) ::close(fd_);
+        if (direct_fd_ >= 0) ::close(direct_fd_);
+#endif
+        if (remove_) {
+            std::error_code ec;
+            std::filesystem::remove(path_, ec);
+        }
+    }
+
+    [[nodiscard]] static auto open(std::filesystem::path path, bool remove_on_close, BufferPool& pool,
+                                   AsyncReader& reader, bool direct_io)
+        -> Result<std::shared_ptr<PooledFile>, std::error_code>
+    {
+        auto file = std::shared_ptr<PooledFile>(new PooledFile(std::move(path), remove_on_close, pool, reader));
+
+#if defined(__linux__) || defined(__APPLE__)
+        file->fd_ = ::open(file->path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file->fd_ < 0) return Err(std::error_code(errno, std::system_category()));
+
+        struct stat st {};
+        if (::fstat(file->fd_, &st) != 0) return Err(std::error_code(errno, std::system_category()));
+        file->size_ = static_cast<size_t>(st.st_size);
+
+    #if defined(O_DIRECT)
+        // Not every file system takes O_DIRECT (tmpfs doesn't); buffered reads still work.
+        if (direct_io) file->direct_fd_ = ::open(file->path_.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+    #endif
+        return Ok(std::move(file));
+#else
+        return Err(std::make_error_code(std::errc::not_supported));
+#endif
+    }
+
+    // Reads exactly dst.size() bytes at `offset`, bypassing the pool.
+    [[nodiscard]] auto read(u64 offset, std::span<std::byte> dst) const -> bool {
+        return pread_full(fd_, offset, dst) == static_cast<i64>(dst.size());
+    }
+
+    [[nodiscard]] auto load(const ColumnChunk& chunk, size_t footprint, ChunkPin& pin) const
+        -> std::span<const std::byte> override
+    {
+        auto frame = pool_->pin(PageKey { id_, chunk.file_offset }, chunk.file_size, footprint,
+                                [&](std::span<std::byte> dst) {
+                                    const auto [fd, len] = frame_read(chunk, dst.size());
+                                    return reader_->read_sync(fd, chunk.file_offset, dst.first(len))
+                                            >= static_cast<i64>(chunk.file_size)
+                                        && chunk_intact(chunk, dst.first(chunk.file_size));
+                                });
+        if (frame.is_some()) {
+            const u32 slot = frame.unwrap();
+            pin.pin(pool_, slot, &BufferPool::release);
+            return pool_->bytes(slot);
+        }
+        return copy(chunk, pin);
+    }
+
+    [[nodiscard]] auto try_load(const ColumnChunk& chunk, size_t footprint, ChunkPin& pin,
+                                std::move_only_function<void()> ready) const
+        -> Option<std::span<const std::byte>> override
+    {
+        auto p = pool_->acquire(PageKey { id_, chunk.file_offset }, chunk.file_size, footprint, &ready);
+        if (p.is_none()) return Some(copy(chunk, pin));
+
+        const auto [slot, state] = p.unwrap();
+        switch (state) {
+            case BufferPool::PinState::Hit:
+                pin.pin(pool_, slot, &BufferPool::release);
+                return Some(pool_->bytes(slot));
+            case BufferPool::PinState::Fill:
+                fill_async(chunk, slot, std::move(ready));
+                return None;
+            case BufferPool::PinState::Busy:
+                return None;
+        }
+        return None;
+    }
+
+    // Starts reading the chunk into a frame without waiting; load() picks it up, waiting for
+    // the read if it's still in flight.
+    auto prefetch(const ColumnChunk& chunk, size_t footprint) const -> void override {
+        BufferPool::Ready skip;
+        auto p = pool_->acquire(PageKey { id_, chunk.file_offset }, chunk.file_size, footprint, &skip);
+        if (p.is_none()) return;
+
+        const auto [slot, state] = p.unwrap();
+        if (state == BufferPool::PinState::Hit) pool_->unpin(slot);
+        if (state == BufferPool::PinState::Fill) fill_async(chunk, slot, {});
+    }
+
+    [[nodiscard]] auto size() const -> size_t { return size_; }
+    [[nodiscard]] auto path() const -> const std::filesystem::path& { return path_; }
+
+private:
+    PooledFile(std::filesystem::path path, bool remove, BufferPool& pool, AsyncReader& reader)
+        : path_(std::move(path)), remove_(remove), pool_(&pool), reader_(&reader), id_(next_id())
+    {}
+
+    [[nodiscard]] static auto next_id() -> u64 {
+        static std::atomic<u64> id {1};
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Reads into the frame behind `slot`, checks it, publishes it, then calls ready(). The
+    // file stays open until the read completes. A corrupt read fails the fill like a short
+    // one, and the caller ends up in load(), which throws.
+    auto fill_async(const ColumnChunk& chunk, u32 slot, std::move_only_function<void()> ready) const -> void {
+        const auto dst = pool_->frame(slot);
+        const auto [fd, len] = frame_read(chunk, dst.size());
+        reader_->read(fd, chunk.file_offset, dst.first(len),
+            [self = shared_from_this(), slot, chunk, dst, ready = std::move(ready)](i64 n) mutable {
+                const bool ok = n >= static_cast<i64>(chunk.file_size) && chunk_intact(chunk, dst.first(chunk.file_size));
+                self->pool_->complete(slot, ok);
+                if (ok) self->pool_->unpin(slot);
+                if (ready) ready();
+            });
+    }
+
+    // Private copy for chunks that can't go through the pool. Blocks on the read.
+    [[nodiscard]] auto copy(const ColumnChunk& chunk, ChunkPin& pin) const -> std::span<const std::byte> {
+        auto& buf = pin.copy();
+        buf.resize(chunk.file_size);
+        if (!read(chunk.file_offset, buf)) {
+            throw std::system_error(std::make_error_code(std::errc::io_error), path_.string());
+        }
+        if (!chunk_intact(chunk, buf)) throw_corrupt_chunk(path_, chunk);
+        return buf;
+    }
+
+    // Descriptor and length to read a chunk into a frame of frame_bytes: direct I/O when the
+    // page-rounded length fits, else a buffered read of the exact length.
+    [[nodiscard]] auto frame_read(const ColumnChunk& chunk, size_t frame_bytes) const -> std::pair<int, size_t> {
+        const size_t rounded = align_up<size_t>(chunk.file_size, segment_file_align);
+        if (direct_fd_ >= 0 && rounded <= frame_bytes) return { direct_fd_, rounded };
+        return { fd_, chunk.file_size };
+    }
+
+    std::filesystem::path path_;
+    bool                  remove_;
+    BufferPool*           pool_;
+    AsyncReader*          reader_;
+    u64                   id_;
+    int                   fd_        = -1;
+    int                   direct_fd_ = -1;
+    size_t                size_      = 0;
+};
+
+// Parses the header and column directory at the front of a segment file into a cold Segment
+// without chunk data.
+[[nodiscard]] inline auto parse_segment_header(std::span<const std::byte> bytes, size_t file_size, const Layout& layout)
+    -> Result<std::shared_ptr<Segment>, std::error_code>
+{
+    const auto bad = std::make_error_code(std::errc::invalid_argument);
+
+    SegmentFileHeader header;
+    if (bytes.size() < sizeof(header)) return Err(bad);
+    std::memcpy(&header, bytes.data(), sizeof(header));
+
+    if (header.magic != segment_file_magic || header.version != segment_file_version
+        || header.field_count != layout.field_count()
+        || bytes.size() < sizeof(header) + header.field_count * sizeof(SegmentFileColumn))
+    {
+        return Err(bad);
+    }
+
+    const u32 stored_crc = std::exchange(header.directory_crc, 0);
+    const auto directory = bytes.subspan(sizeof(header), header.field_count * sizeof(SegmentFileColumn));
+    if (crc32c(directory, crc32c(std::as_bytes(std::span(&header, 1)))) != stored_crc) {
+        return Err(std::make_error_code(std::errc::bad_message));
+    }
+
+    auto seg = std::make_shared<Segment>();
+    seg->id        = header.id;
+    seg->row_begin = header.row_begin;
+    seg->rows      = static_cast<u32>(header.rows);
+    seg->t_min     = header.t_min;
+    seg->t_max     = header.t_max;
+    seg->tier      = Tier::Cold;
+    seg->columns.resize(header.field_count);
+
+    for (size_t f = 0; f < header.field_count; ++f) {
+        SegmentFileColumn col;
+        std::memcpy(&col, bytes.data() + sizeof(header) + f * sizeof(col), sizeof(col));
+        if (col.offset + col.size > file_size) return Err(bad);
+
+        seg->columns[f] = ColumnChunk {
+            .encoding    = static_cast<Encoding>(col.encoding),
+            .data        = {},
+            .min         = col.min,
+            .max         = col.max,
+            .file_offset = col.offset,
+            .file_size   = col.size,
+            .crc         = col.crc,
+        };
+    }
+
+    seg->disk_bytes = file_size;
+    return Ok(std::move(seg));
+}
+
+// Opens a segment file as a cold Segment. Without a pool the file is mapped and chunks
+// point into the mapping (read through it, so they're checked on first use); with one
+// (and a reader to fill it), only the directory is read and chunks load on demand.
+[[nodiscard]] inline auto open_segment_file(const std::filesystem::path& path, const Layout& layout,
+                                            bool remove_on_close, BufferPool* pool = nullptr,
+                                            AsyncReader* reader = nullptr)
+    -> Result<std::shared_ptr<Segment>, std::error_code>
+{
+    if (pool != nullptr && reader != nullptr) {
+        auto opened = PooledFile::open(path, remove_on_close, *pool, *reader, pool->direct_io());
+        if (opened.is_err()) return Err(std::move(opened).unwrap_err());
+        auto file = std::move(opened).unwrap();
+
+        std::vector<std::byte> head(std::min<size_t>(file->size(),
+            sizeof(SegmentFileHeader) + layout.field_count() * sizeof(SegmentFileColumn)));
+        if (!file->read(0, head)) return Err(std::make_error_code(std::errc::io_error));
+
+        auto parsed = parse_segment_header(head, file->size(), layout);
+        if (parsed.is_err()) return parsed;
+
+        auto seg = std::move(parsed).unwrap();
+        seg->source  = file.get();
+        seg->storage = std::move(file);
+        return Ok(std::move(seg));
+    }
+
+    auto mapped = MappedFile::open(path, remove_on_close);
+    if (mapped.is_err()) return Err(std::move(mapped).unwrap_err());
+
+    auto file  = std::move(mapped).unwrap();
+    auto bytes = file->bytes();
+
+    auto parsed = parse_segment_header(bytes, bytes.size(), layout);
+    if (parsed.is_err()) return parsed;
+
+    auto seg = std::move(parsed).unwrap();
+    for (auto& chunk : seg->columns) {
+        chunk.data = bytes.subspan(chunk.file_offset, chunk.file_size);
+    }
+    file->track(seg->columns);
+    seg->source  = file.get();
+    seg->storage = std::move(file);
+    return Ok(std::move(seg));
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+enum class OverflowPolicy : u8 {
+    Drop,    // rows that don't fit are dropped and counted; inserts never wait on a consumer
+    Block,   // inserts wait for the consumer to make room
+};
+
+struct SubscribeOptions {
+    size_t         capacity = 1 << 16;   // rows buffered for the consumer; rounded up to a power of two
+    OverflowPolicy overflow = OverflowPolicy::Drop;
+};
+
+struct SubscriptionStats {
+    u64 delivered = 0;   // rows written to the ring
+    u64 dropped   = 0;   // rows that found the ring full under OverflowPolicy::Drop
+};
+
+// Newly inserted rows of one type, pushed by the insert path into a ring the subscriber
+// drains. The ring is single-producer single-consumer: writers inserting the same type
+// take turns on a small mutex to produce, while the consumer reads without locking and
+// sleeps on an atomic when there is nothing to read.
+class Subscription {
+public:
+    using Filter = std::function<bool(const std::byte* row)>;
+
+    Subscription(size_t row_size, Filter keep, SubscribeOptions opts)
+        : row_size_(row_size),
+          mask_(std::bit_ceil(std::max<size_t>(opts.capacity, 1)) - 1),
+          overflow_(opts.overflow),
+          keep_(std::move(keep)),
+          slots_((mask_ + 1) * row_size)
+    {}
+
+    Subscription(const Subscription&) = delete;
+    Subscription& operator=(const Subscription&) = delete;
+
+    // Producer side, called by TSDB after rows are inserted.
+    auto push(const std::byte* rows, size_t count, size_t stride) -> void {
+        assert(stride == row_size_);
+
+        std::lock_guard lock(push_mutex_);
+        if (closed_.load(std::memory_order_relaxed)) return;
+
+        const u64 capacity = mask_ + 1;
+        u64 tail    = tail_.load(std::memory_order_relaxed);
+        u64 pushed  = 0;
+        u64 dropped = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            const std::byte* row = rows + i * stride;
+            if (keep_ && !keep_(row)) continue;
+
+            while (tail - head_cache_ == capacity) {
+                head_cache_ = head_.load(std::memory_order_acquire);
+                if (tail - head_cache_ < capacity) break;
+
+                if (overflow_ == OverflowPolicy::Drop) {
+                    ++dropped;
+                    break;
+                }
+
+                // Hand over what's written so far, then sleep until the consumer reads or leaves.
+                publish(tail);
+                const u32 seen = space_.load(std::memory_order_acquire);
+                head_cache_ = head_.load(std::memory_order_acquire);
+                if (tail - head_cache_ < capacity) break;
+                if (closed_.load(std::memory_order_acquire)) {
+                    delivered_.fetch_add(pushed, std::memory_order_relaxed);
+                    return;
+                }
+                space_.wait(seen, std::memory_order_acquire);
+            }
+            if (tail - head_cache_ == capacity) continue;
+
+            std::memcpy(slots_.data() + (tail & mask_) * row_size_, row, row_size_);
+            ++tail;
+            ++pushed;
+        }
+
+        if (pushed > 0) {
+            publish(tail);
+            delivered_.fetch_add(pushed, std::memory_order_relaxed);
+        }
+        if (dropped > 0) {
+            dropped_.fetch_add(dropped, std::memory_order_relaxed);
+        }
+    }
+
+    // Moves up to out.size() rows into `out` without waiting; returns how many.
+    template <typename T>
+    auto read(std::span<T> out) -> size_t {
+        static_assert(std::is_trivially_copyable_v<T>);
+        assert(sizeof(T) == row_size_);
+
+        const u64 head = head_.load(std::memory_order_relaxed);
+        const u64 tail = tail_.load(std::memory_order_acquire);
+        const u64 n    = std::min<u64>(tail - head, out.size());
+        if (n == 0) return 0;
+
+        // At most two runs: up to the end of the ring, then from its start.
+        const u64 first = std::min<u64>(n, mask_ + 1 - (head & mask_));
+        auto* dst = reinterpret_cast<std::byte*>(out.data());
+        std::memcpy(dst, slots_.data() + (head & mask_) * row_size_, first * row_size_);
+        std::memcpy(dst + first * row_size_, slots_.data(), (n - first) * row_size_);
+
+        head_.store(head + n, std::memory_order_release);
+        if (overflow_ == OverflowPolicy::Block) {
+            space_.fetch_add(1, std::memory_order_release);
+            space_.notify_one();
+        }
+        return n;
+    }
+
+    // Blocks until rows are ready to read; false once the subscription is closed and drained.
+    auto wait() -> bool {
+        for (;;) {
+            const u32 seen = ready_.load(std::memory_order_acquire);
+            if (tail_.load(std::memory_order_acquire) != head_.load(std::memory_order_relaxed)) return true;
+            if (closed_.load(std::memory_order_acquire)) return false;
+            ready_.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    // Stops delivery and wakes a consumer waiting in wait() and producers waiting for room.
+    // Rows already in the ring can still be read.
+    auto close() -> void {
+        closed_.store(true, std::memory_order_release);
+        ready_.fetch_add(1, std::memory_order_release);
+        ready_.notify_all();
+        space_.fetch_add(1, std::memory_order_release);
+        space_.notify_all();
+    }
+
+    [[nodiscard]] auto closed() const -> bool { return closed_.load(std::memory_order_acquire); }
+
+    [[nodiscard]] auto row_size() const -> size_t { return row_size_; }
+    [[nodiscard]] auto capacity() const -> size_t { return mask_ + 1; }
+
+    [[nodiscard]] auto stats() const -> SubscriptionStats {
+        return SubscriptionStats {
+            .delivered = delivered_.load(std::memory_order_relaxed),
+            .dropped   = dropped_.load(std::memory_order_relaxed),
+        };
+    }
+
+private:
+    auto publish(u64 tail) -> void {
+        tail_.store(tail, std::memory_order_release);
+        ready_.fetch_add(1, std::memory_order_release);
+        ready_.notify_one();
+    }
+
+    const size_t         row_size_;
+    const u64            mask_;
+    const OverflowPolicy overflow_;
+    const Filter         keep_;   // empty: every row
+    std::vector<std::byte> slots_;
+
+    // Producer and consumer indices on separate cache lines; head_cache_ spares the
+    // producer a load of head_ per row while the ring has room.
+    alignas(64) std::atomic<u64> tail_ = 0;
+    u64                          head_cache_ = 0;   // guarded by push_mutex_
+    std::mutex                   push_mutex_;
+    alignas(64) std::atomic<u64> head_ = 0;
+
+    // Wake-up counters: waiting on an index alone could miss close().
+    alignas(64) std::atomic<u32> ready_ = 0;   // bumped when rows are published
+    std::atomic<u32>             space_ = 0;   // bumped when rows are read, under OverflowPolicy::Block
+
+    std::atomic<bool> closed_    = false;
+    std::atomic<u64>  delivered_ = 0;
+    std::atomic<u64>  dropped_   = 0;
+};
@@ -0,0 +1,2123 @@
+#pragma once
+
+#include "crc32c.hh"
+#include "encoding.hh"
+#include "option.hh"
+#include "result.hh"
+#include "roaring.hh"
+#include "schema.hh"
+#include "task.hh"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <ranges>
+#include <shared_mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Bitmask over a struct's fields (bit i = field i); tables are limited to 64 fields.
+using FieldMask = u64;
+
+constexpr FieldMask all_fields = ~FieldMask{0};
+
+[[nodiscard]] constexpr auto field_bit(size_t field) noexcept -> FieldMask {
+    return FieldMask{1} << field;
+}
+
+struct Layout {
+    std::vector<size_t>           sizes;
+    std::vector<size_t>           offsets;
+    std::vector<Schema::TypeKind> kinds;
+
+    [[nodiscard]] auto field_count() const -> size_t { return sizes.size(); }
+};
+
+struct Column {
+public:
+    Column() = default;
+    explicit Column(size_t elem_size) : elem_size_(elem_size) {}
+
+    auto push(const std::byte* data) -> void {
+        const size_t old_size = data_.size();
+        data_.resize(old_size + elem_size_);
+        std::memcpy(data_.data() + old_size, data, elem_size_);
+    }
+
+    [[nodiscard]] auto at(size_t row) const -> const std::byte* {
+        return data_.data() + row * elem_size_;
+    }
+
+    [[nodiscard]] auto row_count() const -> size_t {
+        return elem_size_ > 0 ? data_.size() / elem_size_ : 0;
+    }
+
+    [[nodiscard]] auto elem_size() const -> size_t { return elem_size_; }
+
+    [[nodiscard]] auto size_bytes()     const -> size_t { return data_.size(); }
+    [[nodiscard]] auto capacity_bytes() const -> size_t { return data_.capacity(); }
+
+    [[nodiscard]] auto bytes() const -> std::span<const std::byte> { return data_; }
+
+    auto reserve(size_t row_count) -> void {
+        data_.reserve(row_count * elem_size_);
+    }
+
+    // Drops the rows but keeps the allocation.
+    auto clear() -> void { data_.clear(); }
+
+private:
+    size_t elem_size_ = 0;
+    std::vector<std::byte> data_;
+};
+
+struct RetentionPolicy {
+    i64 max_age_ns = 0;   // drop data older than newest timestamp - max_age_ns; 0 = keep forever
+    u64 max_bytes  = 0;   // drop oldest segments while the table holds more, in memory or on disk; 0 = unbounded
+};
+
+// Global row ids never move: dropping a segment just advances the first retained id.
+struct RowRange {
+    u64 begin = 0;
+    u64 end   = 0;
+};
+
+struct FlushOptions {
+    size_t max_frozen = 4;      // per table: full blocks waiting for the flusher before inserts wait
+    bool   encode     = true;   // publish flushed blocks encoded (warm) instead of raw (hot)
+};
+
+// Soft limits on the write path, checked before each batch: a batch is refused whole while
+// the table is over either one, and may overshoot by at most its own size once admitted.
+struct IngestLimits {
+    u64    memory_bytes = 0;   // per table: in-memory bytes (segments, frozen and open blocks); 0 = unbounded
+    size_t max_frozen   = 0;   // per table: blocks waiting for the background flusher; 0 = unbounded
+    std::chrono::nanoseconds retry_after { std::chrono::milliseconds(10) };   // least retry hint handed out
+};
+
+enum class IngestPressure : u8 {
+    Memory,         // over memory_bytes until tiering or retention frees some
+    FlushBacklog,   // the flusher is max_frozen blocks behind
+};
+
+// Why a batch was refused, and when retrying is worthwhile.
+struct IngestError {
+    IngestPressure           reason;
+    std::chrono::nanoseconds retry_after;
+};
+
+// Wakes the background flusher when a table freezes a block.
+class FlushSignal {
+public:
+    auto notify() -> void {
+        {
+            std::lock_guard lock(mutex_);
+            pending_ = true;
+        }
+        cv_.notify_one();
+    }
+
+    // Waits for notify(); false once stop is requested.
+    auto wait(std::stop_token stop) -> bool {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, stop, [this] { return pending_; });
+        return std::exchange(pending_, false);
+    }
+
+private:
+    std::mutex                  mutex_;
+    std::condition_variable_any cv_;
+    bool                        pending_ = false;
+};
+
+struct CompactionOptions {
+    std::chrono::milliseconds interval { 1000 };
+    size_t min_rows    = 8192;       // segments with fewer rows are merge candidates
+    size_t target_rows = 8 * 8192;   // merged segments grow up to this many rows
+};
+
+// Rows being written, stored column-wise. Columns are reserved to the block's capacity
+// up front and never reallocate, so readers can scan rows published before their snapshot
+// while the writer keeps appending.
+struct Block {
+    u64 row_begin = 0;
+    i64 t_min     = std::numeric_limits<i64>::max();
+    i64 t_max     = std::numeric_limits<i64>::min();
+    std::vector<Column> columns;
+
+    [[nodiscard]] auto rows() const -> size_t { return columns[0].row_count(); }
+
+    [[nodiscard]] auto capacity_bytes() const -> size_t {
+        size_t n = 0;
+        for (const auto& col : columns) n += col.capacity_bytes();
+        return n;
+    }
+};
+
+// Recycles blocks once the last reference (the open block, a sealed segment, or a reader's
+// snapshot) goes away, so steady-state ingest under retention doesn't touch the allocator.
+class BlockPool : public std::enable_shared_from_this<BlockPool> {
+public:
+    BlockPool(std::vector<size_t> field_sizes, size_t block_rows)
+        : field_sizes_(std::move(field_sizes))
+        , block_rows_(block_rows)
+    {}
+
+    [[nodiscard]] auto acquire(u64 row_begin) -> std::shared_ptr<Block> {
+        std::unique_ptr<Block> b;
+        {
+            std::lock_guard lock(mutex_);
+            if (!free_.empty()) {
+                b = std::move(free_.back());
+                free_.pop_back();
+                spare_bytes_ -= b->capacity_bytes();
+            }
+        }
+
+        if (!b) {
+            b = std::make_unique<Block>();
+            b->columns.reserve(field_sizes_.size());
+            for (size_t sz : field_sizes_) {
+                b->columns.emplace_back(sz).reserve(block_rows_);
+            }
+        }
+
+        b->row_begin = row_begin;
+        return std::shared_ptr<Block>(b.release(), [pool = shared_from_this()](Block* p) { pool->release(p); });
+    }
+
+    [[nodiscard]] auto spare_bytes() const -> size_t {
+        std::lock_guard lock(mutex_);
+        return spare_bytes_;
+    }
+
+    [[nodiscard]] auto spare_blocks() const -> size_t {
+        std::lock_guard lock(mutex_);
+        return free_.size();
+    }
+
+    [[nodiscard]] auto block_rows() const -> size_t { return block_rows_; }
+
+private:
+    constexpr static size_t max_free = 4;
+
+    auto release(Block* p) -> void {
+        std::unique_ptr<Block> b(p);
+        for (auto& col : b->columns) col.clear();
+        b->t_min = std::numeric_limits<i64>::max();
+        b->t_max = std::numeric_limits<i64>::min();
+
+        std::lock_guard lock(mutex_);
+        if (free_.size() < max_free) {
+            spare_bytes_ += b->capacity_bytes();
+            free_.push_back(std::move(b));
+        }
+    }
+
+    std::vector<size_t> field_sizes_;
+    size_t              block_rows_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Block>> free_;
+    size_t spare_bytes_ = 0;
+};
+
+// Where a sealed segment's bytes live.
+enum class Tier : u8 {
+    Hot,    // raw columns in memory, shared with the block they were written into
+    Warm,   // encoded, in memory
+    Cold,   // encoded, in a segment file: mapped, or read through the buffer pool
+};
+
+[[nodiscard]] constexpr auto tier_name(Tier t) noexcept -> std::string_view {
+    switch (t) {
+        case Tier::Hot:  return "hot";
+        case Tier::Warm: return "warm";
+        case Tier::Cold: return "cold";
+    }
+    return "?";
+}
+
+// Secondary index over one numeric column of a segment: its values sorted, each with the
+// row it came from, so a value range is found by binary search instead of a column scan.
+struct ValueIndex {
+    std::vector<f64> values;   // ascending; NaNs are left out, they match no range
+    std::vector<u32> rows;     // row offset in the segment holding values[i]
+
+    [[nodiscard]] static auto build(Schema::TypeKind kind, size_t elem_size, std::span<const std::byte> raw)
+        -> std::shared_ptr<const ValueIndex>
+    {
+        const size_t n = raw.size() / elem_size;
+
+        std::vector<std::pair<f64, u32>> entries;
+        entries.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            const f64 v = load_f64(kind, raw.data() + i * elem_size);
+            if (!std::isnan(v)) entries.emplace_back(v, static_cast<u32>(i));
+        }
+        std::ranges::sort(entries);
+
+        auto index = std::make_shared<ValueIndex>();
+        index->values.reserve(entries.size());
+        index->rows.reserve(entries.size());
+        for (const auto& [v, row] : entries) {
+            index->values.push_back(v);
+            index->rows.push_back(row);
+        }
+        return index;
+    }
+
+    // Number of rows with lo <= value <= hi.
+    [[nodiscard]] auto count(f64 lo, f64 hi) const -> size_t {
+        const auto [first, last] = bounds(lo, hi);
+        return last > first ? last - first : 0;
+    }
+
+    // Row offsets with lo <= value <= hi, in row order.
+    auto matches(f64 lo, f64 hi, std::vector<u32>& out) const -> void {
+        out.clear();
+        const auto [first, last] = bounds(lo, hi);
+        if (last <= first) return;
+
+        out.assign(rows.begin() + static_cast<std::ptrdiff_t>(first), rows.begin() + static_cast<std::ptrdiff_t>(last));
+        std::ranges::sort(out);
+    }
+
+    [[nodiscard]] auto memory_bytes() const -> size_t {
+        return values.capacity() * sizeof(f64) + rows.capacity() * sizeof(u32);
+    }
+
+private:
+    [[nodiscard]] auto bounds(f64 lo, f64 hi) const -> std::pair<size_t, size_t> {
+        return {
+            static_cast<size_t>(std::ranges::lower_bound(values, lo) - values.begin()),
+            static_cast<size_t>(std::ranges::upper_bound(values, hi) - values.begin()),
+        };
+    }
+};
+
+enum class Agg : u8 {
+    Count,
+    Sum,
+    Min,
+    Max,
+    Mean,
+};
+
+// Running aggregate over f64 samples; mergeable so partial results can be combined.
+struct AggState {
+    u64 count = 0;
+    f64 sum   = 0.0;
+    f64 min   = std::numeric_limits<f64>::infinity();
+    f64 max   = -std::numeric_limits<f64>::infinity();
+
+    auto add(f64 v) noexcept -> void {
+        ++count;
+        sum += v;
+        min  = std::min(min, v);
+        max  = std::max(max, v);
+    }
+
+    auto merge(const AggState& o) noexcept -> void {
+        count += o.count;
+        sum   += o.sum;
+        min    = std::min(min, o.min);
+        max    = std::max(max, o.max);
+    }
+
+    [[nodiscard]] auto finish(Agg agg) const noexcept -> Option<f64> {
+        if (agg == Agg::Count) return Some(static_cast<f64>(count));
+        if (count == 0) return None;
+
+        switch (agg) {
+            case Agg::Sum:  return Some(sum);
+            case Agg::Min:  return Some(min);
+            case Agg::Max:  return Some(max);
+            case Agg::Mean: return Some(sum / static_cast<f64>(count));
+            default:        return None;
+        }
+    }
+};
+
+// Precomputed aggregates over one numeric column of a segment: prefix sums for count, sum
+// and mean over any row range, and sparse tables of per-block minima and maxima, so a range
+// costs O(1) plus at most two partial blocks at its ends. Row ranges come from the
+// timestamps, so ranges are only answered directly when these are in order.
+//
+// The prefix sums are compensated (Neumaier), so a large value early on doesn't swallow the
+// small ones after it and then cancel out of a difference. Infinities and NaNs would never
+// cancel, so they're left out of the sums and counted instead; a range holding any has to
+// be summed from the values.
+struct AggIndex {
+    constexpr static size_t block = 64;   // rows per sparse table leaf
+
+    AggState         total;      // the whole segment
+    bool             ordered = true;   // timestamps never decrease, so a time range is a row range
+    std::vector<f64> prefix;     // prefix[i] + error[i]: sum of the finite values in rows [0, i)
+    std::vector<f64> error;
+    std::vector<u32> nonfinite;  // nonfinite[i]: infinities and NaNs in rows [0, i)
+    std::vector<std::vector<f64>> mins, maxs;   // level k: extremes of 2^k blocks starting at each block
+
+    [[nodiscard]] static auto build(Schema::TypeKind kind, size_t elem_size, std::span<const std::byte> raw,
+                                    std::span<const std::byte> timestamps) -> std::shared_ptr<const AggIndex>
+    {
+        const size_t n  = raw.size() / elem_size;
+        const size_t nb = (n + block - 1) / block;
+
+        auto index = std::make_shared<AggIndex>();
+        index->prefix.resize(n + 1);
+        index->error.resize(n + 1);
+        index->nonfinite.resize(n + 1);
+        index->mins.emplace_back(nb, std::numeric_limits<f64>::infinity());
+        index->maxs.emplace_back(nb, -std::numeric_limits<f64>::infinity());
+
+        i64 last = std::numeric_limits<i64>::min();
+        for (size_t i = 0; i < n; ++i) {
+            const f64 v = load_f64(kind, raw.data() + i * elem_size);
+            index->total.add(v);
+
+            const f64 s = index->prefix[i], c = index->error[i];
+            const bool finite = std::isfinite(v);
+            const f64 t = finite ? s + v : s;
+            index->prefix[i + 1]    = t;
+            index->error[i + 1]     = !finite ? c : std::abs(s) >= std::abs(v) ? c + ((s - t) + v) : c + ((v - t) + s);
+            index->nonfinite[i + 1] = index->nonfinite[i] + (finite ? 0 : 1);
+            index->mins[0][i / block] = std::min(index->mins[0][i / block], v);
+            index->maxs[0][i / block] = std::max(index->maxs[0][i / block], v);
+
+            i64 ts;
+            std::memcpy(&ts, timestamps.data() + i * sizeof(ts), sizeof(ts));
+            index->ordered = index->ordered && ts >= last;
+            last = ts;
+        }
+
+        for (size_t k = 1; (size_t{1} << k) <= nb; ++k) {
+            const size_t half = size_t{1} << (k - 1);
+            auto& lo = index->mins.emplace_back(nb - 2 * half + 1);
+            auto& hi = index->maxs.emplace_back(nb - 2 * half + 1);
+            for (size_t b = 0; b < lo.size(); ++b) {
+                lo[b] = std::min(index->mins[k - 1][b], index->mins[k - 1][b + half]);
+                hi[b] = std::max(index->maxs[k - 1][b], index->maxs[k - 1][b + half]);
+            }
+        }
+        return index;
+    }
+
+    // Whether rows [first, last) are all finite, so range() can sum them without `values`.
+    [[nodiscard]] auto finite(size_t first, size_t last) const -> bool {
+        return last <= first || nonfinite[last] == nonfinite[first];
+    }
+
+    // Aggregate of rows [first, last). Rows in blocks only partly covered are read from
+    // `values` (the decoded column), which is only needed for min and max, and for the sum
+    // unless finite(first, last).
+    [[nodiscard]] auto range(size_t first, size_t last, Schema::TypeKind kind, size_t elem_size,
+                             const std::byte* values) const -> AggState
+    {
+        AggState out;
+        if (last <= first) return out;
+
+        out.count = last - first;
+        if (finite(first, last)) {
+            out.sum = (prefix[last] - prefix[first]) + (error[last] - error[first]);
+        } else {
+            assert(values != nullptr);
+            for (size_t i = first; i < last; ++i) out.sum += load_f64(kind, values + i * elem_size);
+        }
+        if (values == nullptr) return out;
+
+        auto edge = [&](size_t i, size_t j) {
+            for (; i < j; ++i) {
+                const f64 v = load_f64(kind, values + i * elem_size);
+                out.min = std::min(out.min, v);
+                out.max = std::max(out.max, v);
+            }
+        };
+
+        const size_t b0 = (first + block - 1) / block;   // first whole block
+        const size_t b1 = last / block;                  // one past the last whole block
+        if (b0 >= b1) {
+            edge(first, last);
+            return out;
+        }
+
+        edge(first, b0 * block);
+        edge(b1 * block, last);
+
+        const size_t k = std::bit_width(b1 - b0) - 1;
+        out.min = std::min({ out.min, mins[k][b0], mins[k][b1 - (size_t{1} << k)] });
+        out.max = std::max({ out.max, maxs[k][b0], maxs[k][b1 - (size_t{1} << k)] });
+        return out;
+    }
+
+    [[nodiscard]] auto memory_bytes() const -> size_t {
+        size_t n = (prefix.capacity() + error.capacity()) * sizeof(f64) + nonfinite.capacity() * sizeof(u32);
+        for (size_t k = 0; k < mins.size(); ++k) n += (mins[k].capacity() + maxs[k].capacity()) * sizeof(f64);
+        return n;
+    }
+};
+
+// Axis-aligned box, bounds inclusive.
+struct Box3 {
+    std::array<f64, 3> lo;
+    std::array<f64, 3> hi;
+};
+
+// Uniform grid over one segment's positions (three numeric fields): the segment's bounding
+// box cut into cells, with the rows in each cell listed together, so a box query only tests
+// rows in the cells it overlaps.
+struct SpatialIndex {
+    std::array<size_t, 3> axes {};        // the fields holding x, y, z
+    std::array<f64, 3>    lo {}, hi {};   // bounding box of the indexed rows
+    std::array<u32, 3>    dims {};        // cells along each axis
+    std::vector<u32>      cell_start;     // rows of cell c: rows[cell_start[c], cell_start[c + 1])
+    std::vector<u32>      rows;           // row offsets in the segment, in row order within a cell
+
+    constexpr static size_t rows_per_cell = 16;   // aimed for on average
+    constexpr static u32    max_dim       = 32;
+
+    // `raw[a]` holds the segment's column for axes[a].
+    [[nodiscard]] static auto build(const Layout& layout, const std::array<size_t, 3>& axes,
+                                    const std::array<std::span<const std::byte>, 3>& raw)
+        -> std::shared_ptr<const SpatialIndex>
+    {
+        const size_t n = raw[0].size() / layout.sizes[axes[0]];
+        auto at = [&](size_t a, size_t i) { return load_f64(layout.kinds[axes[a]], raw[a].data() + i * layout.sizes[axes[a]]); };
+
+        auto grid = std::make_shared<SpatialIndex>();
+        grid->axes = axes;
+        grid->lo.fill(std::numeric_limits<f64>::infinity());
+        grid->hi.fill(-std::numeric_limits<f64>::infinity());
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t a = 0; a < 3; ++a) {
+                grid->lo[a] = std::min(grid->lo[a], at(a, i));
+                grid->hi[a] = std::max(grid->hi[a], at(a, i));
+            }
+        }
+
+        const auto side = static_cast<u32>(std::cbrt(static_cast<f64>(n) / rows_per_cell));
+        for (size_t a = 0; a < 3; ++a) {
+            grid->dims[a] = grid->hi[a] > grid->lo[a] ? std::clamp<u32>(side, 1, max_dim) : 1;
+        }
+
+        // Counting sort of rows by cell; rows with a NaN coordinate are left out.
+        std::vector<u32> cell_of(n);
+        grid->cell_start.assign(grid->cells() + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            const auto c = grid->cell({ at(0, i), at(1, i), at(2, i) });
+            cell_of[i] = c.is_some() ? c.unwrap() : grid->cells();
+            ++grid->cell_start[cell_of[i]];
+        }
+        u32 sum = 0;
+        for (auto& c : grid->cell_start) sum += std::exchange(c, sum);
+
+        grid->rows.resize(grid->cell_start.back());
+        std::vector<u32> next(grid->cell_start.begin(), grid->cell_start.end() - 1);
+        for (size_t i = 0; i < n; ++i) {
+            if (cell_of[i] < grid->cells()) grid->rows[next[cell_of[i]]++] = static_cast<u32>(i);
+        }
+        return grid;
+    }
+
+    // Rows in the cells `box` overlaps, an upper bound on those inside it.
+    [[nodiscard]] auto count(const Box3& box) const -> size_t {
+        size_t total = 0;
+        for_each_cell(box, [&](u32 c) { total += cell_start[c + 1] - cell_start[c]; });
+        return total;
+    }
+
+    // Row offsets in the cells `box` overlaps, in row order.
+    auto candidates(const Box3& box, std::vector<u32>& out) const -> void {
+        out.clear();
+        for_each_cell(box, [&](u32 c) {
+            out.insert(out.end(), rows.begin() + cell_start[c], rows.begin() + cell_start[c + 1]);
+        });
+        std::ranges::sort(out);
+    }
+
+    [[nodiscard]] auto memory_bytes() const -> size_t {
+        return (cell_start.capacity() + rows.capacity()) * sizeof(u32);
+    }
+
+private:
+    [[nodiscard]] auto cells() const -> u32 { return dims[0] * dims[1] * dims[2]; }
+
+    // Cell index along axis a of v, which must lie within the bounding box.
+    [[nodiscard]] auto slot(size_t a, f64 v) const -> u32 {
+        if (dims[a] == 1) return 0;
+        const f64 t = (v - lo[a]) / (hi[a] - lo[a]) * dims[a];
+        return std::min(dims[a] - 1, static_cast<u32>(std::max(t, 0.0)));
+    }
+
+    [[nodiscard]] auto cell(const std::array<f64, 3>& p) const -> Option<u32> {
+        for (size_t a = 0; a < 3; ++a) {
+            if (!(p[a] >= lo[a] && p[a] <= hi[a])) return None;
+        }
+        return Some((slot(2, p[2]) * dims[1] + slot(1, p[1])) * dims[0] + slot(0, p[0]));
+    }
+
+    template <typename F>
+    auto for_each_cell(const Box3& box, F&& fn) const -> void {
+        std::array<u32, 3> first, last;
+        for (size_t a = 0; a < 3; ++a) {
+            if (box.hi[a] < lo[a] || box.lo[a] > hi[a]) return;
+            first[a] = slot(a, std::max(box.lo[a], lo[a]));
+            last[a]  = slot(a, std::min(box.hi[a], hi[a]));
+        }
+        for (u32 z = first[2]; z <= last[2]; ++z) {
+            for (u32 y = first[1]; y <= last[1]; ++y) {
+                for (u32 x = first[0]; x <= last[0]; ++x) fn((z * dims[1] + y) * dims[0] + x);
+            }
+        }
+    }
+};
+
+struct ColumnChunk {
+    Encoding                   encoding = Encoding::Raw;
+    std::span<const std::byte> data;          // empty while the chunk isn't resident
+    f64                        min = std::numeric_limits<f64>::quiet_NaN();   // zone map
+    f64                        max = std::numeric_limits<f64>::quiet_NaN();
+    u64                        file_offset = 0;   // where a cold chunk sits in its segment file
+    u64                        file_size   = 0;
+    Option<u32>                crc;               // CRC32C of the encoded bytes; raw hot chunks have none
+    std::shared_ptr<const ValueIndex>  index;     // on fields the table indexes, from when the segment was sealed
+    std::shared_ptr<const AggIndex>    agg;       // on fields the table precomputes aggregates for, likewise
+    std::shared_ptr<const BitmapIndex> bitmaps;   // on fields the table keeps bitmaps for, unless they have too many values
+
+    [[nodiscard]] auto stored_size() const -> size_t {
+        return data.empty() ? file_size : data.size();
+    }
+};
+
+// Keeps a non-resident chunk's bytes alive while a scan decodes them: either a pinned
+// buffer pool frame or a private copy.
+class ChunkPin {
+public:
+    using Release = void (*)(void* owner, u32 slot) noexcept;
+
+    ChunkPin() = default;
+    ChunkPin(const ChunkPin&)            = delete;
+    ChunkPin& operator=(const ChunkPin&) = delete;
+    ~ChunkPin() { reset(); }
+
+    auto pin(void* owner, u32 slot, Release release) -> void {
+        reset();
+        owner_   = owner;
+        slot_    = slot;
+        release_ = release;
+    }
+
+    auto reset() -> void {
+        if (release_ != nullptr) release_(owner_, slot_);
+        release_ = nullptr;
+    }
+
+    [[nodiscard]] auto copy() -> std::vector<std::byte>& { return copy_; }
+
+private:
+    void*                  owner_   = nullptr;
+    u32                    slot_    = 0;
+    Release                release_ = nullptr;
+    std::vector<std::byte> copy_;
+};
+
+// Fetches the chunks of file-backed segments: loading them on demand behind a buffer pool,
+// and checking them against their checksums before handing them out.
+class ChunkSource {
+public:
+    virtual ~ChunkSource() = default;
+
+    // Bytes of `chunk`, valid while `pin` holds them. `footprint` is how many chunks the
+    // calling query expects to load, so large scans can be admitted differently.
+    [[nodiscard]] virtual auto load(const ColumnChunk& chunk, size_t footprint, ChunkPin& pin) const
+        -> std::span<const std::byte> = 0;
+
+    // load() for callers that mustn't block: returns the bytes if they are available now,
+    // otherwise starts fetching them, arranges for ready() to be called once they're in,
+    // and returns None. The caller then tries again.
+    [[nodiscard]] virtual auto try_load(const ColumnChunk& chunk, size_t footprint, ChunkPin& pin,
+                                        std::move_only_function<void()> /*ready*/) const
+        -> Option<std::span<const std::byte>>
+    {
+        return Some(load(chunk, footprint, pin));
+    }
+
+    // Hint that load() will be called for `chunk` soon.
+    virtual auto prefetch(const ColumnChunk& /*chunk*/, size_t /*footprint*/) const -> void {}
+};
+
+// Sealed, immutable run of rows. Published through shared_ptr<const Segment>; compaction
+// and retention replace the pointers, never the contents, so readers never wait on them.
+struct Segment {
+    u64 id        = 0;
+    u64 row_begin = 0;
+    u32 rows      = 0;
+    i64 t_min     = std::numeric_limits<i64>::max();
+    i64 t_max     = std::numeric_limits<i64>::min();
+    Tier tier     = Tier::Hot;
+    std::vector<ColumnChunk> columns;
+    std::shared_ptr<const SpatialIndex> spatial;   // on tables with spatial axes, from when the segment was sealed
+
+    std::shared_ptr<const void> storage;        // owns every chunk's bytes
+    const ChunkSource*          source = nullptr;   // set when chunks go through a source (file-backed); lives in storage
+    size_t                      memory_bytes = 0;
+    size_t                      disk_bytes   = 0;
+
+    [[nodiscard]] auto stored_bytes() const -> size_t { return memory_bytes + disk_bytes; }
+
+    [[nodiscard]] auto overlaps(i64 t_begin, i64 t_end) const -> bool {
+        return t_min < t_end && t_max >= t_begin;
+    }
+
+    [[nodiscard]] static auto next_id() -> u64 {
+        static std::atomic<u64> id {1};
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// Rows [0, rows) of one block or segment with the requested columns available as plain arrays.
+struct RowBatch {
+    const Layout*                     layout    = nullptr;
+    u64                               row_begin = 0;
+    size_t                            rows      = 0;
+    std::span<const std::byte* const> columns;   // nullptr for fields that weren't requested
+
+    [[nodiscard]] auto timestamp(size_t i) const -> i64 {
+        i64 ts;
+        std::memcpy(&ts, columns[0] + i * sizeof(i64), sizeof(ts));
+        return ts;
+    }
+
+    [[nodiscard]] auto value(size_t i, size_t field) const -> f64 {
+        return load_f64(layout->kinds[field], columns[field] + i * layout->sizes[field]);
+    }
+
+    [[nodiscard]] auto integer(size_t i, size_t field) const -> i64 {
+        return load_i64(layout->kinds[field], columns[field] + i * layout->sizes[field]);
+    }
+
+    auto read_row(size_t i, std::byte* dst) const -> void {
+        for (size_t f = 0; f < layout->field_count(); ++f) {
+            std::memcpy(dst + layout->offsets[f], columns[f] + i * layout->sizes[f], layout->sizes[f]);
+        }
+    }
+};
+
+struct TableSnapshot {
+    std::vector<std::shared_ptr<const Segment>> segments;
+    std::vector<std::shared_ptr<const Block>>   frozen;   // full, waiting to be flushed; newer than segments
+    std::shared_ptr<const Block>                active;
+    size_t                                      active_rows = 0;
+    u64                                         version     = 0;   // the table's segment list version
+};
+
+// Boolean combination of equality tests on integral fields, e.g.
+// RowFilter::eq("status", 2) & (RowFilter::eq("alarm", 1) | RowFilter::eq("muted", 0)).
+// Kept in postfix order so filters combine by value. In segments with bitmap indexes on
+// every field it names, it's evaluated as AND/OR/ANDNOT over the bitmaps alone; elsewhere
+// row by row.
+class RowFilter {
+public:
+    [[nodiscard]] static auto eq(std::string_view field, i64 value) -> RowFilter {
+        RowFilter f;
+        f.terms_.push_back({ .op = Op::Eq, .name = std::string(field), .value = value });
+        return f;
+    }
+
+    friend auto operator&(RowFilter a, RowFilter b) -> RowFilter { return join(std::move(a), std::move(b), Op::And); }
+    friend auto operator|(RowFilter a, RowFilter b) -> RowFilter { return join(std::move(a), std::move(b), Op::Or); }
+
+    // Rows a matches and b doesn't.
+    friend auto operator-(RowFilter a, RowFilter b) -> RowFilter { return join(std::move(a), std::move(b), Op::AndNot); }
+
+    // Most operands pending at once; deeper filters are rejected by bind().
+    static constexpr size_t max_depth = 64;
+
+    // Resolves field names through index_of(name) -> Option<size_t>; false if any is None.
+    template <typename F>
+    [[nodiscard]] auto bind(F&& index_of) -> bool {
+        size_t depth = 0;
+        for (auto& t : terms_) {
+            if (t.op != Op::Eq) {
+                --depth;
+                continue;
+            }
+            if (++depth > max_depth) return false;
+
+            auto idx = index_of(std::string_view(t.name));
+            if (idx.is_none()) return false;
+            t.field = idx.unwrap();
+        }
+        return !terms_.empty();
+    }
+
+    // Fields the filter reads, once bound.
+    [[nodiscard]] auto fields() const -> FieldMask {
+        FieldMask m = 0;
+        for (const auto& t : terms_) {
+            if (t.op == Op::Eq) m |= field_bit(t.field);
+        }
+        return m;
+    }
+
+    [[nodiscard]] auto eval(const RowBatch& b, size_t i) const -> bool {
+        std::array<bool, max_depth> stack;
+        size_t top = 0;
+        for (const auto& t : terms_) {
+            if (t.op == Op::Eq) {
+                stack[top++] = b.integer(i, t.field) == t.value;
+                continue;
+            }
+            const bool rhs = stack[--top];
+            bool&      lhs = stack[top - 1];
+            lhs = t.op == Op::And ? lhs && rhs : t.op == Op::Or ? lhs || rhs : lhs && !rhs;
+        }
+        return stack[0];
+    }
+
+    // Calls fn(rows) with the segment's matching row offsets, computed from its bitmap
+    // indexes; false without calling it if a field the filter reads has none.
+    template <typename F>
+    auto with_bitmap(const Segment& seg, F&& fn) const -> bool {
+        // Leaves are borrowed from the index; only combined sets are materialized.
+        struct Operand {
+            const Roaring* ref = nullptr;
+            Roaring        owned;
+
+            [[nodiscard]] auto get() const -> const Roaring& { return ref != nullptr ? *ref : owned; }
+        };
+        static const Roaring none;
+
+        std::vector<Operand> stack;
+        for (const auto& t : terms_) {
+            if (t.op == Op::Eq) {
+                const BitmapIndex* index = seg.columns[t.field].bitmaps.get();
+                if (index == nullptr) return false;
+                const Roaring* rows = index->find(t.value);
+                stack.push_back({ .ref = rows != nullptr ? rows : &none });
+                continue;
+            }
+            Operand rhs = std::move(stack.back());
+            stack.pop_back();
+            const Roaring& lhs = stack.back().get();
+            Roaring out = t.op == Op::And ? lhs & rhs.get() : t.op == Op::Or ? lhs | rhs.get() : lhs - rhs.get();
+            stack.back() = { .owned = std::move(out) };
+        }
+        fn(stack.back().get());
+        return true;
+    }
+
+private:
+    enum class Op : u8 { Eq, And, Or, AndNot };
+
+    struct Term {
+        Op          op    = Op::Eq;
+        std::string name;          // Eq only
+        size_t      field = 0;     // set by bind()
+        i64         value = 0;
+    };
+
+    static auto join(RowFilter a, RowFilter b, Op op) -> RowFilter {
+        a.terms_.insert(a.terms_.end(), std::make_move_iterator(b.terms_.begin()), std::make_move_iterator(b.terms_.end()));
+        a.terms_.push_back({ .op = op });
+        return a;
+    }
+
+    std::vector<Term> terms_;   // postfix
+};
+
+// Zone map over one column's raw values.
+inline auto zone_of(Schema::TypeKind kind, size_t elem_size, std::span<const std::byte> raw, ColumnChunk& chunk) -> void {
+    if (!is_numeric(kind) || raw.empty()) return;
+
+    f64 lo = std::numeric_limits<f64>::infinity();
+    f64 hi = -std::numeric_limits<f64>::infinity();
+    for (size_t off = 0; off < raw.size(); off += elem_size) {
+        const f64 v = load_f64(kind, raw.data() + off);
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+    chunk.min = lo;
+    chunk.max = hi;
+}
+
+// Number of chunks in `fields` that would have to be loaded to scan `segs`.
+inline auto non_resident_chunks(std::span<const std::shared_ptr<const Segment>> segs, FieldMask fields) -> size_t {
+    size_t n = 0;
+    for (const auto& seg : segs) {
+        if (seg->source == nullptr) continue;
+        for (size_t f = 0; f < seg->columns.size(); ++f) {
+            n += (fields & field_bit(f)) ? 1 : 0;
+        }
+    }
+    return n;
+}
+
+// Decoded view of a chunk's `bytes`: the bytes themselves if raw (still held by `pin`),
+// else `scratch`.
+template <typename Scratch>
+inline auto decoded(const ColumnChunk& chunk, std::span<const std::byte> bytes, size_t rows, size_t elem_size,
+                    ChunkPin& pin, Scratch& scratch) -> const std::byte*
+{
+    if (chunk.encoding == Encoding::Raw) {
+        return bytes.data();
+    }
+
+    scratch.resize(rows * elem_size);
+    decode(chunk.encoding, elem_size, bytes, rows, scratch.data());
+    pin.reset();
+    return scratch.data();
+}
+
+// Decoded view of a segment's column. Chunks that aren't resident are loaded through the
+// segment's source and held by `pin`.
+inline auto column_data(const Segment& seg, size_t field, size_t elem_size, size_t footprint,
+                        ChunkPin& pin, std::vector<std::byte>& scratch) -> const std::byte*
+{
+    const ColumnChunk& chunk = seg.columns[field];
+    const auto bytes = seg.source != nullptr ? seg.source->load(chunk, footprint, pin) : chunk.data;
+    return decoded(chunk, bytes, seg.rows, elem_size, pin, scratch);
+}
+
+// co_await-able load of a chunk through its segment's source. Completes without suspending
+// when the bytes are available (setting `out` and yielding true); otherwise suspends until
+// they have been read and resumes on `ex` yielding false, and the caller tries again.
+struct ChunkLoad {
+    const Segment&              seg;
+    size_t                      field;
+    size_t                      footprint;
+    ChunkPin&                   pin;
+    Executor&                   ex;
+    std::span<const std::byte>& out;
+    bool                        loaded = false;
+
+    auto await_ready() const noexcept -> bool { return false; }
+
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+        auto bytes = seg.source->try_load(seg.columns[field], footprint, pin, [h, ex = &ex] { ex->post(h); });
+        if (bytes.is_none()) return true;
+
+        out    = bytes.unwrap();
+        loaded = true;
+        return false;
+    }
+
+    auto await_resume() const noexcept -> bool { return loaded; }
+};
+
+class Table {
+public:
+    constexpr static size_t default_block_rows = 8192;
+    constexpr static size_t readahead_segments = 4;   // cold segments read ahead of a scan
+
+    Table(Layout layout, size_t block_rows = default_block_rows)
+        : layout_(std::move(layout))
+        , pool_(std::make_shared<BlockPool>(layout_.sizes, block_rows))
+    {
+        assert(block_rows > 0);
+        assert(layout_.field_count() <= 64);
+    }
+
+    // Waits for room in the flusher's queue (see queue_bound()) before the batch rather
+    // than inside it, so a batch's rows stay contiguous. A batch spanning several blocks
+    // can overshoot max_frozen by those blocks.
+    auto insert_rows(const std::byte* src, size_t count, size_t stride) -> void {
+        std::unique_lock lock(mutex_);
+        space_.wait(lock, [this] { return frozen_.size() < queue_bound(); });
+        append_locked(src, count, stride);
+    }
+
+    // insert_rows() behind the ingest limits: inserts nothing and says when to retry while
+    // the table is over them, or while the flusher's queue is full rather than waiting for
+    // it. Returns the number of rows inserted.
+    auto try_insert_rows(const std::byte* src, size_t count, size_t stride) -> Result<size_t, IngestError> {
+        std::unique_lock lock(mutex_);
+
+        if (auto refused = admit_locked(); refused.is_some()) {
+            ++rejected_batches_;
+            return Err(std::move(refused).unwrap());
+        }
+
+        append_locked(src, count, stride);
+        return Ok(count);
+    }
+
+    auto set_ingest_limits(IngestLimits limits) -> void {
+        std::unique_lock lock(mutex_);
+        limits_ = limits;
+    }
+
+    [[nodiscard]] auto rejected_batches() const -> u64 {
+        std::shared_lock lock(mutex_);
+        return rejected_batches_;
+    }
+
+    // Seals the open block even if it isn't full, e.g. on a periodic flush, along with any
+    // frozen blocks the flusher hasn't got to yet. With a flusher the open block joins the
+    // back of its queue and this waits until the flusher has got past it; segments are only
+    // ever published in row order.
+    auto flush() -> void {
+        std::unique_lock lock(mutex_);
+        if (signal_) {
+            const u64 upto = next_row_;
+            if (active_ && active_->rows() > 0) queue_locked();
+            signal_->notify();
+
+            space_.wait(lock, [&] { return !signal_ || frozen_.empty() || frozen_.front()->row_begin >= upto; });
+            if (signal_) return;
+        }
+
+        while (!frozen_.empty()) {
+            lock.unlock();
+            flush_frozen();
+            lock.lock();
+        }
+        seal_locked();
+    }
+
+    // With a signal, full blocks are frozen and left to a background flusher (which must
+    // call flush_frozen() once signalled) instead of being sealed on the insert path.
+    // Without one, they're sealed inline again once any frozen blocks are flushed here;
+    // inserts wait for that (see queue_bound()).
+    auto set_flusher(std::shared_ptr<FlushSignal> signal, FlushOptions opts = {}) -> void {
+        {
+            std::unique_lock lock(mutex_);
+            signal_     = std::move(signal);
+            flush_opts_ = opts;
+            if (!signal_) standby_.reset();
+        }
+        space_.notify_all();
+
+        if (!signal_) {
+            while (flush_frozen()) {}
+        }
+    }
+
+    // Seals the oldest frozen block (encoding it if configured) and publishes it as a
+    // segment. Runs without the table lock apart from the final swap. False if none was frozen.
+    auto flush_frozen() -> bool {
+        std::shared_ptr<const Block> b;
+        bool warm;
+        {
+            std::shared_lock lock(mutex_);
+            if (frozen_.empty()) return false;
+            b    = frozen_.front();
+            warm = flush_opts_.encode;
+        }
+
+        const auto t0 = std::chrono::steady_clock::now();
+        std::shared_ptr<const Segment> seg = make_segment(b);
+        if (warm) seg = encode(seg);
+        const auto took = std::chrono::steady_clock::now() - t0;
+
+        {
+            std::unique_lock lock(mutex_);
+            if (frozen_.empty() || frozen_.front() != b) return true;   // flushed concurrently
+
+            frozen_.pop_front();
+            frozen_bytes_ -= b->capacity_bytes();
+            last_flush_    = std::chrono::duration_cast<std::chrono::nanoseconds>(took);
+            memory_bytes_ += seg->memory_bytes;
+            segments_.push_back(std::move(seg));
+            ++version_;
+            enforce_retention_locked();
+        }
+        space_.notify_all();
+        return true;
+    }
+
+    // Keeps a spare block ready so the next freeze swaps blocks without allocating.
+    auto refill_standby() -> void {
+        {
+            std::shared_lock lock(mutex_);
+            if (standby_ || !signal_) return;
+        }
+
+        auto b = pool_->acquire(0);
+
+        std::unique_lock lock(mutex_);
+        if (!standby_ && signal_) standby_ = std::move(b);
+    }
+
+    // Segments and frozen blocks overlapping [t_begin, t_end) plus the open block, as of now.
+    [[nodiscard]] auto snapshot(i64 t_begin = std::numeric_limits<i64>::min(),
+                                i64 t_end   = std::numeric_limits<i64>::max()) const -> TableSnapshot
+    {
+        TableSnapshot snap;
+
+        std::shared_lock lock(mutex_);
+        for (const auto& seg : segments_) {
+            if (seg->overlaps(t_begin, t_end)) snap.segments.push_back(seg);
+        }
+        for (const auto& b : frozen_) {
+            if (b->t_min < t_end && b->t_max >= t_begin) snap.frozen.push_back(b);
+        }
+        if (active_ && active_->t_min < t_end && active_->t_max >= t_begin) {
+            snap.active      = active_;
+            snap.active_rows = active_->rows();
+        }
+        snap.version = version_;
+        return snap;
+    }
+
+    // Calls fn(batch) for every segment, frozen block and the open block overlapping the range, oldest
+    // first, with the columns in `fields` decoded. Takes the table lock only to snapshot;
+    // chunks loaded from disk stay pinned until fn returns.
+    template <typename F>
+    auto for_each_batch(i64 t_begin, i64 t_end, FieldMask fields, F&& fn) const -> void {
+        const auto snap = snapshot(t_begin, t_end);
+        const size_t n = layout_.field_count();
+        const size_t footprint = non_resident_chunks(snap.segments, fields);
+
+        std::vector<const std::byte*>          cols(n, nullptr);
+        std::vector<std::vector<std::byte>>    scratch(n);
+        std::vector<ChunkPin>                  pins(n);
+
+        // Keeps reads for the next few segments in flight while this one is decoded.
+        auto prefetch = [&](size_t k) {
+            if (k >= snap.segments.size() || snap.segments[k]->source == nullptr) return;
+            const Segment& seg = *snap.segments[k];
+            for (size_t f = 0; f < n; ++f) {
+                if (fields & field_bit(f)) seg.source->prefetch(seg.columns[f], footprint);
+            }
+        };
+        if (footprint > 0) {
+            for (size_t k = 0; k < readahead_segments; ++k) prefetch(k);
+        }
+
+        for (size_t k = 0; k < snap.segments.size(); ++k) {
+            const auto& seg = snap.segments[k];
+            if (footprint > 0) prefetch(k + readahead_segments);
+
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (fields & field_bit(f))
+                    ? column_data(*seg, f, layout_.sizes[f], footprint, pins[f], scratch[f])
+                    : nullptr;
+            }
+            fn(RowBatch { &layout_, seg->row_begin, seg->rows, cols });
+            for (auto& pin : pins) pin.reset();
+        }
+
+        for (const auto& b : snap.frozen) {
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (fields & field_bit(f)) ? b->columns[f].at(0) : nullptr;
+            }
+            fn(RowBatch { &layout_, b->row_begin, b->rows(), cols });
+        }
+
+        if (snap.active) {
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (fields & field_bit(f)) ? snap.active->columns[f].at(0) : nullptr;
+            }
+            fn(RowBatch { &layout_, snap.active->row_begin, snap.active_rows, cols });
+        }
+    }
+
+    // Calls fn(batch, i) for every row with t_begin <= timestamp < t_end.
+    template <typename F>
+    auto for_each_in_range(i64 t_begin, i64 t_end, FieldMask fields, F&& fn) const -> void {
+        for_each_batch(t_begin, t_end, fields | field_bit(0), [&](const RowBatch& b) {
+            for (size_t i = 0; i < b.rows; ++i) {
+                if (const i64 ts = b.timestamp(i); ts >= t_begin && ts < t_end) {
+                    fn(b, i);
+                }
+            }
+        });
+    }
+
+    // Calls fn(batch, i) for every row of the snapshot's segments and blocks with
+    // t_begin <= timestamp < t_end, oldest first. Lets callers scan part of a snapshot, e.g.
+    // only the segments a cache doesn't cover.
+    template <typename F>
+    auto for_each_in_snapshot(const TableSnapshot& snap, i64 t_begin, i64 t_end, FieldMask fields, F&& fn) const -> void {
+        for_each_selected(snap, t_begin, t_end, fields, 0,
+            [](const Segment&, std::vector<u32>&) { return Narrowing::Whole; },
+            [](const RowBatch&, size_t) { return true; },
+            fn);
+    }
+
+    // Newest timestamp ever inserted (kept when retention drops its row); i64 min before the first insert.
+    [[nodiscard]] auto newest_timestamp() const -> i64 {
+        std::shared_lock lock(mutex_);
+        return newest_ts_;
+    }
+
+    // Rows from this timestamp on are all still retained (retention drops the oldest
+    // segments whole); i64 min until retention first drops a segment.
+    [[nodiscard]] auto retained_from() const -> i64 {
+        std::shared_lock lock(mutex_);
+        return retained_from_;
+    }
+
+    [[nodiscard]] auto version() const -> u64 {
+        std::shared_lock lock(mutex_);
+        return version_;
+    }
+
+    // Calls fn(batch, i) for every row with t_begin <= timestamp < t_end and lo <= value of
+    // `field` <= hi, oldest first. Segments whose zone map rules the value range out are
+    // skipped without being loaded; in segments with an index on the field only the matching
+    // rows are visited, unless so many match that a plain scan is cheaper. Bit-packed and
+    // dictionary columns are filtered on their packed values, without decoding them.
+    template <typename F>
+    auto for_each_match(i64 t_begin, i64 t_end, size_t field, f64 lo, f64 hi, FieldMask fields, F&& fn) const -> void {
+        auto snap = snapshot(t_begin, t_end);
+        std::erase_if(snap.segments, [&](const auto& seg) {
+            return seg->columns[field].max < lo || seg->columns[field].min > hi;
+        });
+
+        for_each_selected(snap, t_begin, t_end, fields, field_bit(field),
+            [&](const Segment& seg, std::vector<u32>& rows) {
+                const ValueIndex* index = seg.columns[field].index.get();
+                if (index != nullptr && index->count(lo, hi) * 4 < seg.rows) {
+                    index->matches(lo, hi, rows);
+                    return Narrowing::Candidates;
+                }
+                return encoded_matches(seg, field, lo, hi, rows) ? Narrowing::Exact : Narrowing::Whole;
+            },
+            [&](const RowBatch& b, size_t i) {
+                const f64 v = b.value(i, field);
+                return v >= lo && v <= hi;
+            },
+            fn);
+    }
+
+    // Calls fn(batch, i) for every row with t_begin <= timestamp < t_end whose position (the
+    // fields in `axes`) lies in `box`, oldest first. Segments whose bounding box (their zone
+    // maps on the axes) misses it are skipped without being loaded; in segments with a
+    // spatial index on these axes only rows in the grid cells it overlaps are tested.
+    template <typename F>
+    auto for_each_in_box(i64 t_begin, i64 t_end, const std::array<size_t, 3>& axes, const Box3& box,
+                         FieldMask fields, F&& fn) const -> void
+    {
+        auto snap = snapshot(t_begin, t_end);
+        std::erase_if(snap.segments, [&](const auto& seg) {
+            for (size_t a = 0; a < 3; ++a) {
+                const auto& chunk = seg->columns[axes[a]];
+                if (chunk.max < box.lo[a] || chunk.min > box.hi[a]) return true;
+            }
+            return false;
+        });
+
+        FieldMask position = 0;
+        for (size_t a : axes) position |= field_bit(a);
+        for_each_selected(snap, t_begin, t_end, fields, position,
+            [&](const Segment& seg, std::vector<u32>& rows) {
+                const SpatialIndex* grid = seg.spatial.get();
+                if (grid == nullptr || grid->axes != axes || grid->count(box) * 4 >= seg.rows) return Narrowing::Whole;
+                grid->candidates(box, rows);
+                return Narrowing::Candidates;
+            },
+            [&](const RowBatch& b, size_t i) {
+                for (size_t a = 0; a < 3; ++a) {
+                    const f64 v = b.value(i, axes[a]);
+                    if (!(v >= box.lo[a] && v <= box.hi[a])) return false;
+                }
+                return true;
+            },
+            fn);
+    }
+
+    // Calls fn(batch, i) for every row with t_begin <= timestamp < t_end that `filter` (bound
+    // to this table's fields) matches, oldest first. In segments with bitmap indexes on all
+    // the filter's fields the matching rows come from the bitmaps, and the filter's columns
+    // aren't loaded unless `fields` asks for them.
+    template <typename F>
+    auto for_each_where(i64 t_begin, i64 t_end, const RowFilter& filter, FieldMask fields, F&& fn) const -> void {
+        for_each_where(snapshot(t_begin, t_end), t_begin, t_end, filter, fields, fn);
+    }
+
+    // Number of rows with t_begin <= timestamp < t_end that `filter` matches. Segments the
+    // range covers whole and that have bitmaps for the filter are counted from the bitmaps
+    // without loading any column; ones it cuts through load only their timestamps.
+    [[nodiscard]] auto count_where(i64 t_begin, i64 t_end, const RowFilter& filter) const -> u64 {
+        auto snap = snapshot(t_begin, t_end);
+
+        u64 n = 0;
+        std::erase_if(snap.segments, [&](const auto& seg) {
+            if (!(seg->t_min >= t_begin && seg->t_max < t_end)) return false;
+            return filter.with_bitmap(*seg, [&](const Roaring& rows) { n += rows.cardinality(); });
+        });
+
+        for_each_where(snap, t_begin, t_end, filter, 0, [&](const RowBatch&, size_t) { ++n; });
+        return n;
+    }
+
+    // Aggregate of `field` over rows with t_begin <= timestamp < t_end. Segments with an
+    // AggIndex on the field cost O(1) when the range covers them, and when it cuts through
+    // one with ordered timestamps only the timestamps are loaded (plus the values, for min
+    // and max, at the two partial blocks). Covered segments whose values are bit-packed,
+    // dictionary- or run-length-encoded are aggregated without decoding them (see
+    // encoded_state()). Everything else is scanned.
+    [[nodiscard]] auto summarize(i64 t_begin, i64 t_end, size_t field, bool extrema) const -> AggState {
+        auto snap = snapshot(t_begin, t_end);
+        const Schema::TypeKind kind = layout_.kinds[field];
+        const size_t           sz   = layout_.sizes[field];
+
+        AggState out;
+        std::vector<std::byte> ts_scratch, value_scratch;
+        ChunkPin ts_pin, value_pin;
+
+        std::vector<std::shared_ptr<const Segment>> rest;   // no usable index: scanned below
+        for (const auto& seg : snap.segments) {
+            const bool      covered  = seg->t_min >= t_begin && seg->t_max < t_end;
+            const AggIndex* index    = seg->columns[field].agg.get();
+            const Encoding  encoding = seg->columns[field].encoding;
+            if (index == nullptr && covered && queryable_encoded(encoding)) {
+                out.merge(encoded_state(*seg, field, value_pin));
+                value_pin.reset();
+                continue;
+            }
+            if (index == nullptr || (!index->ordered && !covered)) {
+                rest.push_back(seg);
+                continue;
+            }
+
+            if (covered) {
+                out.merge(index->total);
+                continue;
+            }
+
+            const auto [first, last] = timestamp_bounds(*seg, t_begin, t_end, ts_pin, ts_scratch);
+            ts_pin.reset();
+
+            const std::byte* values = (extrema || !index->finite(first, last)) && last > first
+                ? column_data(*seg, field, sz, 1, value_pin, value_scratch)
+                : nullptr;
+            out.merge(index->range(first, last, kind, sz, values));
+            value_pin.reset();
+        }
+        snap.segments = std::move(rest);
+
+        for_each_in_snapshot(snap, t_begin, t_end, field_bit(field), [&](const RowBatch& b, size_t i) {
+            out.add(b.value(i, field));
+        });
+        return out;
+    }
+
+    // for_each_batch() as a coroutine: chunks that have to come from disk suspend the query
+    // rather than block the thread, and it resumes on `ex` once they're read. Scan buffers
+    // come from `arena`. fn must stay valid until the task completes.
+    template <typename F>
+    auto async_for_each_batch(Executor& ex, const QueryArena& arena, i64 t_begin, i64 t_end,
+                              FieldMask fields, F fn) const -> Task<>
+    {
+        const auto snap = snapshot(t_begin, t_end);
+        const size_t n = layout_.field_count();
+        const size_t footprint = non_resident_chunks(snap.segments, fields);
+
+        std::pmr::vector<const std::byte*>             cols(n, nullptr, arena.resource());
+        std::pmr::vector<std::pmr::vector<std::byte>>  scratch(n, arena.resource());
+        std::pmr::vector<ChunkPin>                     pins(n, arena.resource());
+
+        auto prefetch = [&](size_t k) {
+            if (k >= snap.segments.size() || snap.segments[k]->source == nullptr) return;
+            const Segment& seg = *snap.segments[k];
+            for (size_t f = 0; f < n; ++f) {
+                if (fields & field_bit(f)) seg.source->prefetch(seg.columns[f], footprint);
+            }
+        };
+        if (footprint > 0) {
+            for (size_t k = 0; k < readahead_segments; ++k) prefetch(k);
+        }
+
+        for (size_t k = 0; k < snap.segments.size(); ++k) {
+            const Segment& seg = *snap.segments[k];
+            if (footprint > 0) prefetch(k + readahead_segments);
+
+            for (size_t f = 0; f < n; ++f) {
+                if (!(fields & field_bit(f))) {
+                    cols[f] = nullptr;
+                    continue;
+                }
+                if (seg.source == nullptr) {
+                    cols[f] = decoded(seg.columns[f], seg.columns[f].data, seg.rows, layout_.sizes[f], pins[f], scratch[f]);
+                    continue;
+                }
+
+                // A read that keeps failing is retried once synchronously so its error surfaces.
+                std::span<const std::byte> bytes;
+                bool loaded = false;
+                for (int attempt = 0; attempt < 3 && !loaded; ++attempt) {
+                    loaded = co_await ChunkLoad { seg, f, footprint, pins[f], ex, bytes };
+                }
+                if (!loaded) bytes = seg.source->load(seg.columns[f], footprint, pins[f]);
+
+                cols[f] = decoded(seg.columns[f], bytes, seg.rows, layout_.sizes[f], pins[f], scratch[f]);
+            }
+
+            fn(RowBatch { &layout_, seg.row_begin, seg.rows, cols });
+            for (auto& pin : pins) pin.reset();
+        }
+
+        for (const auto& b : snap.frozen) {
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (fields & field_bit(f)) ? b->columns[f].at(0) : nullptr;
+            }
+            fn(RowBatch { &layout_, b->row_begin, b->rows(), cols });
+        }
+
+        if (snap.active) {
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (fields & field_bit(f)) ? snap.active->columns[f].at(0) : nullptr;
+            }
+            fn(RowBatch { &layout_, snap.active->row_begin, snap.active_rows, cols });
+        }
+    }
+
+    template <typename F>
+    auto async_for_each_in_range(Executor& ex, const QueryArena& arena, i64 t_begin, i64 t_end,
+                                 FieldMask fields, F fn) const -> Task<>
+    {
+        co_await async_for_each_batch(ex, arena, t_begin, t_end, fields | field_bit(0), [&](const RowBatch& b) {
+            for (size_t i = 0; i < b.rows; ++i) {
+                if (const i64 ts = b.timestamp(i); ts >= t_begin && ts < t_end) {
+                    fn(b, i);
+                }
+            }
+        });
+    }
+
+    // Reads by global row id; false once the row has been dropped by retention (or not written yet).
+    auto read_row(u64 row, std::byte* dst) const -> bool {
+        std::shared_ptr<const Segment> seg;
+        {
+            std::shared_lock lock(mutex_);
+            if (row < first_row_ || row >= next_row_) return false;
+
+            const Block* block = nullptr;
+            if (active_ && row >= active_->row_begin) {
+                block = active_.get();
+            } else if (!frozen_.empty() && row >= frozen_.front()->row_begin) {
+                auto it = std::ranges::upper_bound(frozen_, row, {}, [](const auto& b) { return b->row_begin; });
+                block = std::prev(it)->get();
+            }
+
+            if (block != nullptr) {
+                const size_t i = row - block->row_begin;
+                for (size_t f = 0; f < layout_.field_count(); ++f) {
+                    std::memcpy(dst + layout_.offsets[f], block->columns[f].at(i), layout_.sizes[f]);
+                }
+                return true;
+            }
+
+            auto it = std::ranges::upper_bound(segments_, row, {}, [](const auto& s) { return s->row_begin; });
+            seg = *std::prev(it);
+        }
+
+        // Most codecs can pick a single value out of the chunk; delta and xor columns are
+        // decoded whole. Either way each chunk is fetched once.
+        const size_t i = row - seg->row_begin;
+        std::vector<std::byte> scratch;
+        ChunkPin pin;
+        for (size_t f = 0; f < layout_.field_count(); ++f) {
+            const ColumnChunk& chunk = seg->columns[f];
+            const auto         bytes = chunk_bytes(*seg, f, pin);
+            std::byte*         out   = dst + layout_.offsets[f];
+            if (!decode_row(chunk.encoding, layout_.sizes[f], bytes, i, out)) {
+                const auto* col = decoded(chunk, bytes, seg->rows, layout_.sizes[f], pin, scratch);
+                std::memcpy(out, col + i * layout_.sizes[f], layout_.sizes[f]);
+            }
+            pin.reset();
+        }
+        return true;
+    }
+
+    // Fields to build a ValueIndex for in segments sealed (or re-encoded) from now on.
+    auto set_indexed(FieldMask fields) -> void {
+        indexed_.store(fields, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto indexed() const -> FieldMask {
+        return indexed_.load(std::memory_order_relaxed);
+    }
+
+    // Fields to build an AggIndex for in segments sealed (or re-encoded) from now on.
+    auto set_aggregated(FieldMask fields) -> void {
+        aggregated_.store(fields, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto aggregated() const -> FieldMask {
+        return aggregated_.load(std::memory_order_relaxed);
+    }
+
+    // Integral fields to build a BitmapIndex for in segments sealed (or re-encoded) from now on.
+    auto set_bitmapped(FieldMask fields) -> void {
+        bitmapped_.store(fields, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto bitmapped() const -> FieldMask {
+        return bitmapped_.load(std::memory_order_relaxed);
+    }
+
+    // How columns of segments encoded from now on pick their codec; see encode_best().
+    auto set_encoding_policy(EncodingPolicy policy) -> void {
+        encoding_policy_.store(policy, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto encoding_policy() const -> EncodingPolicy {
+        return encoding_policy_.load(std::memory_order_relaxed);
+    }
+
+    // Fields holding x, y and z, to build a SpatialIndex over in segments sealed (or
+    // re-encoded) from now on.
+    auto set_spatial(std::array<size_t, 3> axes) -> void {
+        std::lock_guard lock(spatial_mutex_);
+        spatial_ = axes;
+    }
+
+    [[nodiscard]] auto spatial() const -> Option<std::array<size_t, 3>> {
+        std::lock_guard lock(spatial_mutex_);
+        return spatial_;
+    }
+
+    auto set_retention(RetentionPolicy policy) -> void {
+        std::unique_lock lock(mutex_);
+        retention_ = policy;
+        enforce_retention_locked();
+    }
+
+    // Merges runs of adjacent small segments into re-encoded segments of up to
+    // opts.target_rows rows. The merge runs without the table lock; only the pointer swap
+    // takes it. Returns the number of segments replaced.
+    auto compact(const CompactionOptions& opts) -> size_t {
+        const auto snap = snapshot();
+        const auto& segs = snap.segments;
+
+        size_t replaced = 0;
+        for (size_t i = 0; i < segs.size();) {
+            size_t j = i, rows = 0;
+            while (j < segs.size() && segs[j]->tier != Tier::Cold
+                   && segs[j]->rows < opts.min_rows && rows + segs[j]->rows <= opts.target_rows)
+            {
+                rows += segs[j]->rows;
+                ++j;
+            }
+
+            if (j - i < 2) {
+                i = std::max(i + 1, j);
+                continue;
+            }
+
+            auto merged = merge(std::span(segs).subspan(i, j - i));
+            if (swap_in(std::span(segs).subspan(i, j - i), std::move(merged))) {
+                replaced += j - i;
+            }
+            i = j;
+        }
+        return replaced;
+    }
+
+    // Keeps the newest hot_bytes of raw segments as they are and encodes the older ones
+    // in memory. Returns the number of segments encoded.
+    auto cool(size_t hot_bytes) -> size_t {
+        const auto snap = snapshot();
+
+        size_t hot = 0, encoded = 0;
+        for (auto it = snap.segments.rbegin(); it != snap.segments.rend(); ++it) {
+            const auto& seg = *it;
+            if (seg->tier != Tier::Hot) continue;
+
+            hot += seg->memory_bytes;
+            if (hot <= hot_bytes) continue;
+
+            if (replace(seg, encode(seg))) ++encoded;
+        }
+        return encoded;
+    }
+
+    // Oldest segment still held in memory, if any.
+    [[nodiscard]] auto oldest_in_memory() const -> std::shared_ptr<const Segment> {
+        std::shared_lock lock(mutex_);
+        for (const auto& seg : segments_) {
+            if (seg->tier != Tier::Cold) return seg;
+        }
+        return nullptr;
+    }
+
+    // Encoded copy of a single segment (a no-op merge); zone maps are recomputed and its
+    // indexes are shared with the copy.
+    [[nodiscard]] auto encode(const std::shared_ptr<const Segment>& seg) const -> std::shared_ptr<Segment> {
+        return merge(std::span(&seg, 1));
+    }
+
+    // Swaps one segment for another holding the same rows, e.g. after moving it to another tier.
+    auto replace(const std::shared_ptr<const Segment>& old, std::shared_ptr<Segment> seg) -> bool {
+        return swap_in(std::span(&old, 1), std::move(seg));
+    }
+
+    // Bytes of row data held in memory: sealed segments, frozen blocks and the open block.
+    [[nodiscard]] auto memory_bytes() const -> size_t {
+        std::shared_lock lock(mutex_);
+        return memory_bytes_ + frozen_bytes_ + (active_ ? active_->capacity_bytes() : 0);
+    }
+
+    [[nodiscard]] auto frozen_blocks() const -> size_t {
+        std::shared_lock lock(mutex_);
+        return frozen_.size();
+    }
+
+    [[nodiscard]] auto row_range() const -> RowRange {
+        std::shared_lock lock(mutex_);
+        return { first_row_, next_row_ };
+    }
+
+    [[nodiscard]] auto layout()     const -> const Layout&    { return layout_; }
+    [[nodiscard]] auto pool()       const -> const BlockPool& { return *pool_; }
+
+private:
+    // How far a segment's probe narrowed it down.
+    enum class Narrowing : u8 {
+        Whole,        // scan every row
+        Candidates,   // only the rows returned, which keep() still has to check
+        Exact,        // exactly the rows returned (still cut to the time range); keep() is skipped
+    };
+
+    // Encoded bytes of a segment's column, held by `pin` if they had to be loaded.
+    [[nodiscard]] static auto chunk_bytes(const Segment& seg, size_t field, ChunkPin& pin) -> std::span<const std::byte> {
+        const ColumnChunk& chunk = seg.columns[field];
+        return seg.source != nullptr ? seg.source->load(chunk, 1, pin) : chunk.data;
+    }
+
+    // Rows of a segment with ordered timestamps before t_begin and before t_end. Delta and
+    // bit-packed timestamps are searched in their encoded form.
+    [[nodiscard]] static auto timestamp_bounds(const Segment& seg, i64 t_begin, i64 t_end, ChunkPin& pin,
+                                               std::vector<std::byte>& scratch) -> std::pair<size_t, size_t>
+    {
+        const ColumnChunk& chunk = seg.columns[0];
+        const auto bytes = chunk_bytes(seg, 0, pin);
+        if (chunk.encoding == Encoding::Delta)   return codec::delta_bounds(bytes.data(), seg.rows, t_begin, t_end);
+        if (chunk.encoding == Encoding::BitPack) return codec::for_bounds(bytes.data(), seg.rows, t_begin, t_end);
+
+        const std::byte* ts = decoded(chunk, bytes, seg.rows, sizeof(i64), pin, scratch);
+        auto before = [&](i64 t) {
+            return [ts, t](size_t i) {
+                i64 v;
+                std::memcpy(&v, ts + i * sizeof(v), sizeof(v));
+                return v < t;
+            };
+        };
+        const auto rows = std::views::iota(size_t{0}, size_t{seg.rows});
+        return {
+            static_cast<size_t>(std::ranges::partition_point(rows, before(t_begin)) - rows.begin()),
+            static_cast<size_t>(std::ranges::partition_point(rows, before(t_end)) - rows.begin()),
+        };
+    }
+
+    // Aggregate of a whole bit-packed, dictionary or run-length column. Bit-packed: count
+    // and the frame's min and max from the header, the sum as rows * min plus the sum of the
+    // packed offsets. Dictionary: min and max are the first and last values (every value
+    // occurs), the sum is taken over a count of each code. Run-length: each run's value
+    // times its length, O(runs).
+    [[nodiscard]] auto encoded_state(const Segment& seg, size_t field, ChunkPin& pin) const -> AggState {
+        const auto bytes = chunk_bytes(seg, field, pin);
+        if (seg.columns[field].encoding == Encoding::Rle) {
+            const Schema::TypeKind kind = layout_.kinds[field];
+            const size_t           sz   = layout_.sizes[field];
+            const auto             h    = codec::rle_header(bytes.data());
+
+            AggState out { .count = seg.rows, .sum = 0.0 };
+            u32 begin = 0;
+            for (size_t r = 0; r < h.runs; ++r) {
+                const f64 v = load_f64(kind, h.values + r * sz);
+                out.sum += v * static_cast<f64>(h.end(r) - begin);
+                begin = h.end(r);
+                if (std::isnan(v)) continue;
+                out.min = std::min(out.min, v);
+                out.max = std::max(out.max, v);
+            }
+            return out;
+        }
+        if (seg.columns[field].encoding == Encoding::Dict) {
+            const Schema::TypeKind kind = layout_.kinds[field];
+            const size_t           sz   = layout_.sizes[field];
+            const auto             h    = codec::dict_header(bytes.data(), sz);
+
+            std::vector<u64> counts;
+            codec::dict_counts(h, seg.rows, counts);
+
+            AggState out { .count = seg.rows, .sum = 0.0 };
+            for (size_t c = 0; c < counts.size(); ++c) {
+                const f64 v = load_f64(kind, h.values + c * sz);
+                out.sum += v * static_cast<f64>(counts[c]);
+                if (std::isnan(v)) continue;
+                out.min = std::min(out.min, v);
+                out.max = std::max(out.max, v);
+            }
+            return out;
+        }
+
+        const auto h     = codec::for_header(bytes.data());
+        const f64  min   = widened(field, h.min);
+        return AggState {
+            .count = seg.rows,
+            .sum   = min * static_cast<f64>(seg.rows) + codec::for_offset_sum(bytes.data(), seg.rows),
+            .min   = min,
+            .max   = widened(field, h.max),
+        };
+    }
+
+    // Rows of a bit-packed, dictionary or run-length column with lo <= value <= hi, found
+    // by comparing the packed values against the range turned into offsets from the frame's
+    // minimum, or into the codes of the dictionary values inside it, or by testing each
+    // run's value once. False (leaving the segment to a scan) for other encodings, and for
+    // bit-packed values past 2^53 that f64 can't compare exactly.
+    [[nodiscard]] auto encoded_matches(const Segment& seg, size_t field, f64 lo, f64 hi, std::vector<u32>& rows) const
+        -> bool
+    {
+        constexpr f64 exact = 9007199254740992.0;   // 2^53
+
+        const Encoding encoding = seg.columns[field].encoding;
+        if (!queryable_encoded(encoding)) return false;
+
+        ChunkPin pin;
+        const auto bytes = chunk_bytes(seg, field, pin);
+        if (encoding == Encoding::Rle) {
+            const auto h = codec::rle_header(bytes.data());
+            u32 begin = 0;
+            for (size_t r = 0; r < h.runs; ++r) {
+                const f64 v = load_f64(layout_.kinds[field], h.values + r * layout_.sizes[field]);
+                if (v >= lo && v <= hi) {
+                    for (u32 i = begin; i < h.end(r); ++i) rows.push_back(i);
+                }
+                begin = h.end(r);
+            }
+            return true;
+        }
+        if (encoding == Encoding::Dict) {
+            const auto h = codec::dict_header(bytes.data(), layout_.sizes[field]);
+            const auto [first, last] = codec::dict_codes(h, layout_.kinds[field], layout_.sizes[field], lo, hi);
+            if (first < last) codec::match_packed(h.packed, h.bits, seg.rows, first, last - 1, rows);
+            return true;
+        }
+
+        const auto h     = codec::for_header(bytes.data());
+        const f64  min   = widened(field, h.min);
+        const f64  max   = widened(field, h.max);
+        if (!(min >= -exact && max <= exact)) return false;
+
+        const f64 first = std::max(std::ceil(lo), min);
+        const f64 last  = std::min(std::floor(hi), max);
+        if (!(first <= last)) return true;
+
+        codec::for_matches(bytes.data(), seg.rows, static_cast<u64>(first - min), static_cast<u64>(last - min), rows);
+        return true;
+    }
+
+    // A raw value of an integral field, as widened by codec::load_int(), as f64.
+    [[nodiscard]] auto widened(size_t field, u64 v) const -> f64 {
+        return is_signed(layout_.kinds[field]) ? static_cast<f64>(static_cast<i64>(v)) : static_cast<f64>(v);
+    }
+
+    template <typename F>
+    auto for_each_where(const TableSnapshot& snap, i64 t_begin, i64 t_end, const RowFilter& filter,
+                        FieldMask fields, F&& fn) const -> void
+    {
+        for_each_selected(snap, t_begin, t_end, fields, filter.fields(),
+            [&](const Segment& seg, std::vector<u32>& rows) {
+                const bool exact = filter.with_bitmap(seg, [&](const Roaring& match) { match.to_vector(rows); });
+                return exact ? Narrowing::Exact : Narrowing::Whole;
+            },
+            [&](const RowBatch& b, size_t i) { return filter.eval(b, i); },
+            fn);
+    }
+
+    // Shared body of the filtered scans. For each segment, probe(seg, rows) narrows it to
+    // row offsets in row order (none skips the segment without loading it) or has it scanned
+    // whole; see Narrowing. fn(batch, i) is called for every row in the time range that
+    // passes keep(batch, i). Columns in `keep_fields` are only loaded where keep() runs.
+    template <typename Probe, typename Keep, typename F>
+    auto for_each_selected(const TableSnapshot& snap, i64 t_begin, i64 t_end, FieldMask fields, FieldMask keep_fields,
+                           Probe&& probe, Keep&& keep, F&& fn) const -> void
+    {
+        fields |= field_bit(0);
+        const size_t n = layout_.field_count();
+        const size_t footprint = non_resident_chunks(snap.segments, fields | keep_fields);
+
+        std::vector<const std::byte*>          cols(n, nullptr);
+        std::vector<std::vector<std::byte>>    scratch(n);
+        std::vector<ChunkPin>                  pins(n);
+        std::vector<u32>                       rows;
+
+        auto in_range = [&](const RowBatch& b, size_t i) {
+            const i64 ts = b.timestamp(i);
+            return ts >= t_begin && ts < t_end;
+        };
+        auto visit = [&](const RowBatch& b, size_t i) {
+            if (in_range(b, i) && keep(b, i)) fn(b, i);
+        };
+        auto scan = [&](const RowBatch& b) {
+            for (size_t i = 0; i < b.rows; ++i) visit(b, i);
+        };
+
+        const FieldMask scanned = fields | keep_fields;
+        for (const auto& seg : snap.segments) {
+            rows.clear();
+            const Narrowing narrowed = probe(*seg, rows);
+            if (narrowed != Narrowing::Whole && rows.empty()) continue;
+
+            const FieldMask load = narrowed == Narrowing::Exact ? fields : scanned;
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (load & field_bit(f))
+                    ? column_data(*seg, f, layout_.sizes[f], footprint, pins[f], scratch[f])
+                    : nullptr;
+            }
+
+            const RowBatch b { &layout_, seg->row_begin, seg->rows, cols };
+            if (narrowed == Narrowing::Exact) {
+                for (u32 i : rows) {
+                    if (in_range(b, i)) fn(b, i);
+                }
+            } else if (narrowed == Narrowing::Candidates) {
+                for (u32 i : rows) visit(b, i);
+            } else {
+                scan(b);
+            }
+            for (auto& pin : pins) pin.reset();
+        }
+
+        for (const auto& blk : snap.frozen) {
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (scanned & field_bit(f)) ? blk->columns[f].at(0) : nullptr;
+            }
+            scan(RowBatch { &layout_, blk->row_begin, blk->rows(), cols });
+        }
+
+        if (snap.active) {
+            for (size_t f = 0; f < n; ++f) {
+                cols[f] = (scanned & field_bit(f)) ? snap.active->columns[f].at(0) : nullptr;
+            }
+            scan(RowBatch { &layout_, snap.active->row_begin, snap.active_rows, cols });
+        }
+    }
+
+    auto append_locked(const std::byte* src, size_t count, size_t stride) -> void {
+        for (size_t r = 0; r < count; ++r, src += stride) {
+            if (!active_) {
+                active_ = pool_->acquire(next_row_);
+            }
+
+            Block& b = *active_;
+            for (size_t i = 0; i < b.columns.size(); ++i) {
+                b.columns[i].push(src + layout_.offsets[i]);
+            }
+
+            i64 ts;
+            std::memcpy(&ts, src, sizeof(ts));
+            b.t_min    = std::min(b.t_min, ts);
+            b.t_max    = std::max(b.t_max, ts);
+            newest_ts_ = std::max(newest_ts_, ts);
+            ++next_row_;
+
+            if (b.rows() == pool_->block_rows()) {
+                if (signal_) {
+                    freeze_locked();
+                } else {
+                    seal_locked();
+                }
+            }
+        }
+    }
+
+    // Frozen blocks allowed before inserts wait. Without a flusher, any still frozen are
+    // being drained by set_flusher() or flush(), and inserts wait for that to finish rather
+    // than queue up more behind them.
+    [[nodiscard]] auto queue_bound() const -> size_t {
+        return signal_ ? std::max<size_t>(flush_opts_.max_frozen, 1) : 1;
+    }
+
+    [[nodiscard]] auto admit_locked() const -> Option<IngestError> {
+        // The queue's own bound applies too, whatever the limit: past it the batch would wait.
+        const size_t max_frozen = limits_.max_frozen == 0 ? queue_bound() : std::min(limits_.max_frozen, queue_bound());
+
+        if (max_frozen > 0 && frozen_.size() >= max_frozen) {
+            // Roughly how long the flusher needs to get back under the limit.
+            const size_t behind = frozen_.size() - max_frozen + 1;
+            return Some(IngestError {
+                .reason      = IngestPressure::FlushBacklog,
+                .retry_after = std::max(limits_.retry_after, last_flush_ * static_cast<i64>(behind)),
+            });
+        }
+
+        const size_t in_memory = memory_bytes_ + frozen_bytes_ + (active_ ? active_->capacity_bytes() : 0);
+        if (limits_.memory_bytes > 0 && in_memory >= limits_.memory_bytes) {
+            return Some(IngestError { .reason = IngestPressure::Memory, .retry_after = limits_.retry_after });
+        }
+
+        return None;
+    }
+
+    // Publishes the open block as a raw segment. The block's buffers are shared, not copied.
+    // While older blocks are still frozen it's queued behind them instead, to be published
+    // in order by whoever drains the queue.
+    auto seal_locked() -> void {
+        if (!active_ || active_->rows() == 0) return;
+        if (!frozen_.empty()) {
+            queue_locked();
+            return;
+        }
+
+        auto seg = make_segment(std::move(active_));
+        memory_bytes_ += seg->memory_bytes;
+        segments_.push_back(std::move(seg));
+        ++version_;
+
+        enforce_retention_locked();
+    }
+
+    // Hands the full open block to the flusher and swaps in the standby block: O(1), no
+    // allocation unless the flusher hasn't replaced the standby yet. Room in the queue was
+    // waited for, or checked, before the batch (see insert_rows(), admit_locked()).
+    auto freeze_locked() -> void {
+        queue_locked();
+        signal_->notify();
+    }
+
+    // Moves the open block to the back of the frozen queue.
+    auto queue_locked() -> void {
+        frozen_bytes_ += active_->capacity_bytes();
+        frozen_.push_back(std::move(active_));
+
+        if (standby_) {
+            active_ = std::move(standby_);
+            active_->row_begin = next_row_;
+        }
+    }
+
+    // Raw segment sharing a full block's buffers, with its zone maps.
+    [[nodiscard]] auto make_segment(std::shared_ptr<const Block> b) const -> std::shared_ptr<Segment> {
+        auto seg = std::make_shared<Segment>();
+        seg->id        = Segment::next_id();
+        seg->row_begin = b->row_begin;
+        seg->rows      = static_cast<u32>(b->rows());
+        seg->t_min     = b->t_min;
+        seg->t_max     = b->t_max;
+        seg->columns.resize(layout_.field_count());
+
+        seg->memory_bytes = b->capacity_bytes();
+
+        const FieldMask indexed    = indexed_.load(std::memory_order_relaxed);
+        const FieldMask aggregated = aggregated_.load(std::memory_order_relaxed);
+        const FieldMask bitmapped  = bitmapped_.load(std::memory_order_relaxed);
+        for (size_t f = 0; f < layout_.field_count(); ++f) {
+            auto& chunk = seg->columns[f];
+            chunk.data  = b->columns[f].bytes();
+            zone_of(layout_.kinds[f], layout_.sizes[f], chunk.data, chunk);
+            if ((indexed & field_bit(f)) && is_numeric(layout_.kinds[f])) {
+                chunk.index = ValueIndex::build(layout_.kinds[f], layout_.sizes[f], chunk.data);
+                seg->memory_bytes += chunk.index->memory_bytes();
+            }
+            if ((aggregated & field_bit(f)) && is_numeric(layout_.kinds[f])) {
+                chunk.agg = AggIndex::build(layout_.kinds[f], layout_.sizes[f], chunk.data, b->columns[0].bytes());
+                seg->memory_bytes += chunk.agg->memory_bytes();
+            }
+            if (bitmapped & field_bit(f)) {
+                chunk.bitmaps = BitmapIndex::build(layout_.kinds[f], layout_.sizes[f], chunk.data);
+                if (chunk.bitmaps) seg->memory_bytes += chunk.bitmaps->memory_bytes();
+            }
+        }
+
+        if (const auto axes = spatial(); axes.is_some()) {
+            const auto& ax = axes.unwrap();
+            seg->spatial = SpatialIndex::build(layout_, ax, {
+                seg->columns[ax[0]].data, seg->columns[ax[1]].data, seg->columns[ax[2]].data });
+            seg->memory_bytes += seg->spatial->memory_bytes();
+        }
+
+        seg->storage = std::move(b);
+        return seg;
+    }
+
+    // Drops whole segments from the front, O(1) each. The open block is never dropped.
+    auto enforce_retention_locked() -> void {
+        // Saturates rather than overflowing near the start of the timeline.
+        constexpr i64 min = std::numeric_limits<i64>::min();
+        const i64 age    = retention_.max_age_ns;
+        const i64 cutoff = age <= 0 || newest_ts_ < min + age ? min : newest_ts_ - age;
+        while (!segments_.empty()) {
+            const Segment& front = *segments_.front();
+
+            const bool too_old = age > 0 && front.t_max < cutoff;
+            const bool too_big = retention_.max_bytes > 0
+                && memory_bytes_ + disk_bytes_ > retention_.max_bytes;
+
+            if (!too_old && !too_big) break;
+
+            first_row_  = front.row_begin + front.rows;
+            if (front.t_max >= retained_from_) {
+                retained_from_ = front.t_max == std::numeric_limits<i64>::max() ? front.t_max : front.t_max + 1;
+            }
+            memory_bytes_ -= front.memory_bytes;
+            disk_bytes_   -= front.disk_bytes;
+            segments_.pop_front();
+            ++version_;
+        }
+    }
+
+    [[nodiscard]] auto merge(std::span<const std::shared_ptr<const Segment>> run) const -> std::shared_ptr<Segment> {
+        auto seg = std::make_shared<Segment>();
+        seg->id        = Segment::next_id();
+        seg->row_begin = run.front()->row_begin;
+        seg->columns.resize(layout_.field_count());
+
+        for (const auto& s : run) {
+            seg->rows  += s->rows;
+            seg->t_min  = std::min(seg->t_min, s->t_min);
+            seg->t_max  = std::max(seg->t_max, s->t_max);
+        }
+
+        auto bytes = std::make_shared<std::vector<std::byte>>();
+        std::vector<size_t> offsets(layout_.field_count());
+        size_t index_bytes = 0;
+
+        const FieldMask indexed    = indexed_.load(std::memory_order_relaxed);
+        const FieldMask aggregated = aggregated_.load(std::memory_order_relaxed);
+        const FieldMask bitmapped  = bitmapped_.load(std::memory_order_relaxed);
+        const auto      policy     = encoding_policy_.load(std::memory_order_relaxed);
+        const auto      axes       = spatial();
+        std::array<std::vector<std::byte>, 3> positions;   // decoded axes, for the spatial index
+        std::vector<std::byte>                timestamps;  // decoded, for aggregate indexes
+
+        // A single segment keeps its rows, so the indexes it was sealed with still fit them
+        // and are shared rather than built again; flush_frozen() encodes every block it
+        // seals this way. Indexes it lacks (the field was set up since) are built.
+        const Segment* same = run.size() == 1 ? run.front().get() : nullptr;
+        const bool keep_spatial =
+            same != nullptr && same->spatial && axes.is_some() && same->spatial->axes == axes.unwrap();
+
+        std::vector<std::byte> raw, scratch;
+        ChunkPin pin;
+        for (size_t f = 0; f < layout_.field_count(); ++f) {
+            const size_t sz = layout_.sizes[f];
+
+            raw.clear();
+            raw.reserve(seg->rows * sz);
+            for (const auto& s : run) {
+                const auto* col = column_data(*s, f, sz, 1, pin, scratch);
+                raw.insert(raw.end(), col, col + s->rows * sz);
+                pin.reset();
+            }
+
+            offsets[f] = bytes->size();
+            seg->columns[f].encoding = encode_best(layout_.kinds[f], sz, raw, *bytes, policy);
+            // Checksummed straight after encoding, while the output is still in cache.
+            seg->columns[f].crc = crc32c(std::span<const std::byte>(*bytes).subspan(offsets[f]));
+            zone_of(layout_.kinds[f], sz, raw, seg->columns[f]);
+
+            const ColumnChunk* had = same != nullptr ? &same->columns[f] : nullptr;
+            if ((indexed & field_bit(f)) && is_numeric(layout_.kinds[f])) {
+                seg->columns[f].index = had && had->index ? had->index : ValueIndex::build(layout_.kinds[f], sz, raw);
+                index_bytes += seg->columns[f].index->memory_bytes();
+            }
+            if (f == 0 && aggregated != 0) timestamps = raw;
+            if ((aggregated & field_bit(f)) && is_numeric(layout_.kinds[f])) {
+                seg->columns[f].agg = had && had->agg ? had->agg : AggIndex::build(layout_.kinds[f], sz, raw, timestamps);
+                index_bytes += seg->columns[f].agg->memory_bytes();
+            }
+            if (bitmapped & field_bit(f)) {
+                seg->columns[f].bitmaps = had && had->bitmaps ? had->bitmaps : BitmapIndex::build(layout_.kinds[f], sz, raw);
+                if (seg->columns[f].bitmaps) index_bytes += seg->columns[f].bitmaps->memory_bytes();
+            }
+            for (size_t a = 0; a < 3 && axes.is_some() && !keep_spatial; ++a) {
+                if (axes.unwrap()[a] == f) positions[a] = raw;
+            }
+        }
+
+        if (axes.is_some()) {
+            seg->spatial = keep_spatial ? same->spatial
+                                        : SpatialIndex::build(layout_, axes.unwrap(), { positions[0], positions[1], positions[2] });
+            index_bytes += seg->spatial->memory_bytes();
+        }
+
+        // Spans are fixed up only once the buffer has stopped moving.
+        bytes->shrink_to_fit();
+        for (size_t f = 0; f < layout_.field_count(); ++f) {
+            const size_t end = f + 1 < offsets.size() ? offsets[f + 1] : bytes->size();
+            seg->columns[f].data = std::span<const std::byte>(*bytes).subspan(offsets[f], end - offsets[f]);
+        }
+
+        seg->tier         = Tier::Warm;
+        seg->memory_bytes = bytes->capacity() + index_bytes;
+        seg->storage      = std::move(bytes);
+        return seg;
+    }
+
+    // Replaces `run` with `merged` if the run is still in place (retention may have dropped part of it).
+    auto swap_in(std::span<const std::shared_ptr<const Segment>> run, std::shared_ptr<Segment> merged) -> bool {
+        std::unique_lock lock(mutex_);
+
+        auto it = std::ranges::find(segments_, run.front());
+        if (it == segments_.end() || static_cast<size_t>(segments_.end() - it) < run.size()) {
+            return false;
+        }
+        for (size_t k = 0; k < run.size(); ++k) {
+            if (it[static_cast<std::ptrdiff_t>(k)] != run[k]) return false;
+        }
+
+        for (const auto& s : run) {
+            memory_bytes_ -= s->memory_bytes;
+            disk_bytes_   -= s->disk_bytes;
+        }
+        memory_bytes_ += merged->memory_bytes;
+        disk_bytes_   += merged->disk_bytes;
+
+        *it = std::move(merged);
+        segments_.erase(it + 1, it + static_cast<std::ptrdiff_t>(run.size()));
+        ++version_;
+        return true;
+    }
+
+    Layout                     layout_;
+    std::shared_ptr<BlockPool> pool_;
+
+    u64    first_row_  = 0;
+    u64    next_row_   = 0;
+    u64    version_    = 0;   // bumped whenever segments_ changes
+    i64    newest_ts_  = std::numeric_limits<i64>::min();
+    i64    retained_from_ = std::numeric_limits<i64>::min();
+    size_t memory_bytes_ = 0;   // sealed segments only
+    size_t disk_bytes_   = 0;
+    size_t frozen_bytes_ = 0;
+
+    RetentionPolicy retention_;
+
+    std::atomic<FieldMask> indexed_    { 0 };
+    std::atomic<FieldMask> aggregated_ { 0 };
+    std::atomic<FieldMask> bitmapped_  { 0 };
+
+    std::atomic<EncodingPolicy> encoding_policy_ { EncodingPolicy::Ratio };
+
+    mutable std::mutex                 spatial_mutex_;   // leaf lock: seal paths read spatial_ under mutex_
+    Option<std::array<size_t, 3>>      spatial_;
+
+    std::shared_ptr<FlushSignal> signal_;       // null: blocks are sealed inline
+    FlushOptions                 flush_opts_;
+    std::chrono::nanoseconds     last_flush_ {};   // time to seal and encode the last frozen block
+
+    IngestLimits limits_;
+    u64          rejected_batches_ = 0;
+
+    std::shared_ptr<Block>                     active_;
+    std::shared_ptr<Block>                     standby_;
+    std::deque<std::shared_ptr<const Block>>   frozen_;
+    std::deque<std::shared_ptr<const Segment>> segments_;
+
+    mutable std::shared_mutex   mutex_;
+    std::condition_variable_any space_;   // frozen_ shrank, or the flusher went away
+};
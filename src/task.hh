@@ -0,0 +1,284 @@
+#pragma once
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bump allocator for one query: its coroutine frames and scan buffers come from here and
+// are released together when the query's Task goes away. Not thread-safe; a query only
+// ever runs on one thread at a time.
+class QueryArena {
+public:
+    QueryArena() = default;
+    QueryArena(const QueryArena&)            = delete;
+    QueryArena& operator=(const QueryArena&) = delete;
+
+    [[nodiscard]] auto resource() const -> std::pmr::memory_resource* { return &resource_; }
+
+private:
+    alignas(std::max_align_t) std::array<std::byte, 16 << 10> initial_;
+    mutable std::pmr::monotonic_buffer_resource resource_ { initial_.data(), initial_.size() };
+};
+
+namespace detail {
+
+// Coroutine frames record which resource they came from, so a coroutine taking a
+// QueryArena& anywhere in its parameters is allocated from it and any other from the heap.
+struct FrameAlloc {
+    constexpr static size_t header = alignof(std::max_align_t);
+
+    template <typename... Args>
+    static auto operator new(size_t size, const Args&... args) -> void* {
+        std::pmr::memory_resource* r = std::pmr::new_delete_resource();
+        ((r = pick(r, args)), ...);
+
+        auto* p = static_cast<std::byte*>(r->allocate(size + header, alignof(std::max_align_t)));
+        std::construct_at(reinterpret_cast<std::pmr::memory_resource**>(p), r);
+        return p + header;
+    }
+
+    static auto operator delete(void* ptr, size_t size) -> void {
+        auto* p = static_cast<std::byte*>(ptr) - header;
+        auto* r = *reinterpret_cast<std::pmr::memory_resource**>(p);
+        r->deallocate(p, size + header, alignof(std::max_align_t));
+    }
+
+private:
+    template <typename A>
+    static auto pick(std::pmr::memory_resource* r, const A&) -> std::pmr::memory_resource* { return r; }
+    static auto pick(std::pmr::memory_resource*, const QueryArena& a) -> std::pmr::memory_resource* { return a.resource(); }
+};
+
+struct TaskPromiseBase : FrameAlloc {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr      error;
+
+    // Hands control straight back to whoever awaited the task.
+    struct FinalAwaiter {
+        auto await_ready() const noexcept -> bool { return false; }
+
+        template <typename P>
+        auto await_suspend(std::coroutine_handle<P> h) const noexcept -> std::coroutine_handle<> {
+            return h.promise().continuation;
+        }
+
+        auto await_resume() const noexcept -> void {}
+    };
+
+    auto initial_suspend() const noexcept -> std::suspend_always { return {}; }
+    auto final_suspend()   const noexcept -> FinalAwaiter        { return {}; }
+    auto unhandled_exception() noexcept -> void { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    template <typename U>
+    auto return_value(U&& v) -> void { value.emplace(std::forward<U>(v)); }
+
+    auto result() -> T {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    auto return_void() noexcept -> void {}
+
+    auto result() -> void {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+// Lazily started coroutine producing a T. Awaiting it runs it on the awaiting thread until
+// it first suspends; the awaiter resumes wherever the task finishes.
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+    struct promise_type : detail::TaskPromise<T> {
+        auto get_return_object() -> Task {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    Task() = default;
+    Task(Task&& o) noexcept
+        : handle_(std::exchange(o.handle_, nullptr))
+        , arena_(std::move(o.arena_))
+    {}
+
+    Task& operator=(Task&& o) noexcept {
+        if (this != &o) {
+            destroy();
+            handle_ = std::exchange(o.handle_, nullptr);
+            arena_  = std::move(o.arena_);
+        }
+        return *this;
+    }
+
+    ~Task() { destroy(); }
+
+    // Ties the arena the coroutine was allocated from to the task, so it outlives the frame.
+    [[nodiscard]] static auto with_arena(Task task, std::unique_ptr<QueryArena> arena) -> Task {
+        task.arena_ = std::move(arena);
+        return task;
+    }
+
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> h;
+
+            auto await_ready() const noexcept -> bool { return !h || h.done(); }
+
+            auto await_suspend(std::coroutine_handle<> caller) const noexcept -> std::coroutine_handle<> {
+                h.promise().continuation = caller;
+                return h;
+            }
+
+            auto await_resume() const -> T { return h.promise().result(); }
+        };
+        return Awaiter { handle_ };
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+
+    auto destroy() -> void {
+        if (handle_) handle_.destroy();
+        handle_ = nullptr;
+        arena_.reset();
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+    std::unique_ptr<QueryArena>         arena_;
+};
+
+namespace detail {
+
+// Fire-and-forget coroutine: starts immediately and frees itself when done.
+struct Detached {
+    struct promise_type : FrameAlloc {
+        auto get_return_object() const noexcept -> Detached { return {}; }
+        auto initial_suspend()   const noexcept -> std::suspend_never { return {}; }
+        auto final_suspend()     const noexcept -> std::suspend_never { return {}; }
+        auto return_void()       const noexcept -> void {}
+        auto unhandled_exception() const noexcept -> void { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+// Fixed pool of threads resuming coroutines. Queries hop onto it with co_await
+// schedule(), and I/O completions resume them here, so a few threads serve any number of
+// concurrent queries.
+class Executor {
+public:
+    explicit Executor(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) {
+        workers_.reserve(threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_.emplace_back([this](std::stop_token stop) { work(stop); });
+        }
+    }
+
+    // Finishes everything already queued before the threads exit.
+    ~Executor() {
+        for (auto& w : workers_) w.request_stop();
+        cv_.notify_all();
+        workers_.clear();
+    }
+
+    Executor(const Executor&)            = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    auto post(std::coroutine_handle<> h) -> void {
+        {
+            std::lock_guard lock(mutex_);
+            queue_.push_back(h);
+        }
+        cv_.notify_one();
+    }
+
+    // co_await ex.schedule() continues on one of the executor's threads.
+    [[nodiscard]] auto schedule() noexcept {
+        struct Awaiter {
+            Executor* ex;
+
+            auto await_ready() const noexcept -> bool { return false; }
+            auto await_suspend(std::coroutine_handle<> h) const -> void { ex->post(h); }
+            auto await_resume() const noexcept -> void {}
+        };
+        return Awaiter { this };
+    }
+
+    // Runs the task to completion on the executor, dropping its result.
+    template <typename T>
+    auto spawn(Task<T> task) -> void {
+        [](Executor& ex, Task<T> t) -> detail::Detached {
+            co_await ex.schedule();
+            co_await std::move(t);
+        }(*this, std::move(task));
+    }
+
+    // Blocks the calling thread (which must not be one of the executor's) until the task is done.
+    template <typename T>
+    auto block_on(Task<T> task) -> T {
+        std::promise<T> result;
+        auto f = result.get_future();
+
+        [](Executor& ex, Task<T> t, std::promise<T>& out) -> detail::Detached {
+            co_await ex.schedule();
+            try {
+                if constexpr (std::is_void_v<T>) {
+                    co_await std::move(t);
+                    out.set_value();
+                } else {
+                    out.set_value(co_await std::move(t));
+                }
+            } catch (...) {
+                out.set_exception(std::current_exception());
+            }
+        }(*this, std::move(task), result);
+
+        return f.get();
+    }
+
+private:
+    auto work(std::stop_token stop) -> void {
+        std::unique_lock lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, stop, [this] { return !queue_.empty(); });
+            if (queue_.empty()) return;
+
+            auto h = queue_.front();
+            queue_.pop_front();
+            lock.unlock();
+
+            h.resume();
+
+            lock.lock();
+        }
+    }
+
+    std::mutex                          mutex_;
+    std::condition_variable_any         cv_;
+    std::deque<std::coroutine_handle<>> queue_;
+    std::vector<std::jthread>           workers_;
+};
@@ -2,237 +2,1167 @@
 
 #include "absl/container/flat_hash_map.h"
 
+#include "async_reader.hh"
+#include "buffer_pool.hh"
+#include "encoding.hh"
+#include "huge_page_allocator.hh"
+#include "option.hh"
+#include "replay.hh"
+#include "result_cache.hh"
+#include "rollup.hh"
+#include "schema.hh"
+#include "segment_file.hh"
+#include "subscription.hh"
+#include "table.hh"
+#include "task.hh"
 #include "utils.hh"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <concepts>
+#include <condition_variable>
 #include <cstring>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <ranges>
+#include <shared_mutex>
+#include <span>
+#include <stop_token>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <string>
 #include <initializer_list>
 
-template <std::unsigned_integral T>
-[[nodiscard]] constexpr auto align_up(T value, T alignment) noexcept -> T {
-    assert(alignment != 0);
-    assert(std::has_single_bit(alignment));
+struct Bucket {
+    i64 start_ns;
+    u64 count;
+    f64 value;   // NaN for empty buckets (except Agg::Count)
+};
 
-    return (value + alignment - 1) & ~(alignment - 1);
-}
+struct Group {
+    i64 key;     // the tag value
+    u64 count;
+    f64 value;   // NaN where the aggregate is undefined
+};
 
-class Schema;
-class TSDB;
+// How resample() fills a grid point from the samples either side of it.
+enum class Interp : u8 {
+    Previous,   // the latest sample at or before the point
+    Next,       // the earliest sample at or after the point
+    Linear,     // the line between those two
+};
 
-struct TypeHandle {
-    constexpr TypeHandle(u32 v) : v_(v) {}
+struct ColumnStats {
+    std::string      name;
+    Schema::TypeKind kind;
+    u64              rows           = 0;
+    u64              raw_bytes      = 0;   // rows * element size
+    u64              encoded_bytes  = 0;   // bytes as stored
+    u64              used_bytes     = 0;   // bytes in use across the column's buffers
+    u64              reserved_bytes = 0;   // capacity held, including vector growth slack
+    u64              blocks         = 0;
+    Encoding         encoding       = Encoding::Raw;   // the encoding holding most of the rows
+};
 
-    constexpr friend bool operator==(TypeHandle, TypeHandle) = default;
+struct TableStats {
+    std::string              name;
+    TypeHandle               handle;
+    u64                      rows           = 0;
+    u64                      blocks         = 0;
+    u64                      raw_bytes      = 0;
+    u64                      encoded_bytes  = 0;
+    u64                      used_bytes     = 0;
+    u64                      reserved_bytes = 0;
+    u64                      memory_bytes   = 0;   // segments, frozen blocks and open block held in memory
+    u64                      disk_bytes     = 0;   // cold segment files
+    u64                      hot_segments   = 0;
+    u64                      warm_segments  = 0;
+    u64                      cold_segments  = 0;
+    u64                      rejected_batches = 0;   // refused by the ingest limits
+    std::vector<ColumnStats> columns;
 
-    template <typename H>
-    friend H AbslHashValue(H h, const TypeHandle& t) {
-        return H::combine(std::move(h), t.v_);
+    [[nodiscard]] auto compression_ratio() const noexcept -> f64 {
+        return encoded_bytes > 0 ? static_cast<f64>(raw_bytes) / static_cast<f64>(encoded_bytes) : 1.0;
     }
+};
 
-private:
-    friend class Schema;
-    friend class TSDB;
+struct TSDBStats {
+    std::vector<TableStats>     tables;
+    std::vector<AllocatorStats> allocators;
+    Option<BufferPoolStats>     buffer_pool;
+    Option<AsyncReaderStats>    io;
+    Option<ResultCacheStats>    result_cache;
+
+    u64 rows           = 0;
+    u64 raw_bytes      = 0;
+    u64 encoded_bytes  = 0;
+    u64 used_bytes     = 0;
+    u64 reserved_bytes = 0;
+};
 
-    u32 v_;
+struct TierOptions {
+    std::filesystem::path     dir;                  // cold segment files; empty keeps everything in memory
+    u64                       hot_bytes    = 64 << 20;   // per table: newest raw segments left uncompressed
+    u64                       memory_bytes = 0;     // all tables: beyond this the oldest segments spill to dir
+    std::chrono::milliseconds interval { 1000 };
 };
 
-class Schema {
+// Runs fn every interval on its own thread until stopped or destroyed.
+class PeriodicTask {
 public:
-    enum class TypeKind : u8 {
-        U8, U16, U32, U64,
-        I8, I16, I32, I64,
-        F32, F64,
-        BOOL,
-        TIMESTAMP_NS,
-        STRUCT,
-    };
-
-    struct Field {
-        std::string name;
-        TypeHandle  type;
-        u32         offset = 0;
-    };
-
-    struct TypeMeta {
-        std::string        name;
-        TypeKind           kind;
-        u32                size      = 0;
-        u32                alignment = 1;
-        std::vector<Field> fields;
-    };
-
-    Schema(size_t est_num_types) { init_schema(est_num_types); }
+    PeriodicTask() = default;
+    ~PeriodicTask() { stop(); }
+
+    PeriodicTask(const PeriodicTask&) = delete;
+    PeriodicTask& operator=(const PeriodicTask&) = delete;
+
+    template <typename F>
+    auto start(std::chrono::milliseconds interval, F fn) -> void {
+        stop();
+
+        thread_ = std::jthread([this, interval, fn = std::move(fn)](std::stop_token stop) mutable {
+            std::mutex m;
+            std::unique_lock lock(m);
+            while (!stop.stop_requested()) {
+                fn();
+                cv_.wait_for(lock, stop, interval, [] { return false; });
+            }
+        });
+    }
+
+    auto stop() -> void {
+        if (thread_.joinable()) {
+            thread_.request_stop();
+            thread_.join();
+        }
+    }
+
+private:
+    std::condition_variable_any cv_;
+    std::jthread                thread_;
+};
+
+class TSDB {
+public:
+    TSDB(size_t est_num_types = 1) : schema_(est_num_types) {}
+
+    ~TSDB() {
+        close_subscriptions();
+        stop_flushing();
+        stop_compaction();
+        stop_tiering();
+    }
+
+    TSDB(const TSDB&) = delete;
+    TSDB(TSDB&&)      = delete;
 
     auto register_struct(std::string name,
                          std::initializer_list<std::pair<std::string, const TypeHandle>> fields) -> TypeHandle
     {
-        TypeMeta type {
-            .name = std::move(name),
-            .kind = TypeKind::STRUCT,
-        };
+        std::unique_lock lock(mutex_);
+        return schema_.register_struct(name, fields);
+    }
+
+    template<typename T>
+    auto insert(const T& src, TypeHandle type) -> void {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        Table& table = get_or_create_table(type);
+        const auto* bytes = reinterpret_cast<const std::byte*>(&src);
+
+        table.insert_rows(bytes, 1, sizeof(T));
+        feed_rollups(type, bytes, 1, sizeof(T));
+        publish(type, bytes, 1, sizeof(T));
+    }
+
+    // Inserts the whole batch, or none of it while the table is over its ingest limits; the
+    // error says why and when to try again. Without limits every batch is admitted.
+    template<typename T>
+    [[nodiscard]] auto insert_batch(std::span<const T> rows, TypeHandle type) -> Result<size_t, IngestError> {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        Table& table = get_or_create_table(type);
+        const auto* bytes = reinterpret_cast<const std::byte*>(rows.data());
 
-        type.alignment = 8;
-        type.size      = 8;
-        type.fields.push_back({ "timestamp_ns", { static_cast<u32>(TypeKind::TIMESTAMP_NS) }, 0 });
+        auto inserted = table.try_insert_rows(bytes, rows.size(), sizeof(T));
+        if (inserted.is_ok()) {
+            feed_rollups(type, bytes, rows.size(), sizeof(T));
+            publish(type, bytes, rows.size(), sizeof(T));
+        }
+        return inserted;
+    }
 
-        for (auto&& [field_name, handle] : fields) {
-            const auto& ft = meta_of(handle);
-            type.alignment  = std::max(type.alignment, ft.alignment);
-            type.size       = align_up(type.size, ft.alignment);
-            type.fields.push_back({ field_name, handle, type.size });
-            type.size += ft.size;
+    // Limits every table, current and future, applies to insert_batch(). Single-row insert()
+    // isn't checked.
+    auto set_ingest_limits(IngestLimits limits) -> void {
+        {
+            std::unique_lock lock(mutex_);
+            ingest_limits_ = limits;
+        }
+        for (auto [_, table] : all_tables()) {
+            table->set_ingest_limits(limits);
         }
+    }
+
+    template<typename T>
+    [[nodiscard]] auto query_first(TypeHandle type) const -> T {
+        static_assert(std::is_trivially_copyable_v<T>);
 
-        type.size = align_up(type.size, type.alignment);
+        T result {};
+
+        const Table* table = get_table_ptr(type);
+        if (table == nullptr) {
+            return result;
+        }
+
+        auto* dst = reinterpret_cast<std::byte*>(&result);
+        table->read_row(table->row_range().begin, dst);
 
-        const TypeHandle result { static_cast<u32>(types_.size()) };
-        types_.push_back(std::move(type));
         return result;
     }
 
-    [[nodiscard]] auto meta_of(TypeHandle h) const -> const TypeMeta&  { return types_[h.v_]; }
+    // Reads by global row id. Ids stay valid as retention drops older blocks; dropped rows read as None.
+    template<typename T>
+    [[nodiscard]] auto query_row(TypeHandle type, u64 row) const -> Option<T> {
+        static_assert(std::is_trivially_copyable_v<T>);
 
-private:
-    void init_schema(size_t est_num_types) {
-        constexpr std::pair<std::string_view, TypeKind> prims[] = {
-            {"u8",  TypeKind::U8},  {"u16", TypeKind::U16}, {"u32", TypeKind::U32}, {"u64", TypeKind::U64},
-            {"i8",  TypeKind::I8},  {"i16", TypeKind::I16}, {"i32", TypeKind::I32}, {"i64", TypeKind::I64},
-            {"f32", TypeKind::F32}, {"f64", TypeKind::F64},
-            {"bool", TypeKind::BOOL},
-            {"timestamp_ns", TypeKind::TIMESTAMP_NS},
-        };
+        const Table* table = get_table_ptr(type);
+        if (table == nullptr) {
+            return None;
+        }
 
-        constexpr u32 sizes[] = {
-            1, 2, 4, 8,
-            1, 2, 4, 8,
-            4, 8,
-            1,
-            8,
-        };
+        T result {};
+        if (!table->read_row(row, reinterpret_cast<std::byte*>(&result))) {
+            return None;
+        }
+        return Some(result);
+    }
 
-        for (u32 i = 0; i < std::size(prims); ++i) {
-            types_.push_back(TypeMeta {
-                .name      = std::string(prims[i].first),
-                .kind      = prims[i].second,
-                .size      = sizes[i],
-                .alignment = sizes[i],
-            });
+    // Ids of the rows currently retained, [begin, end).
+    [[nodiscard]] auto row_range(TypeHandle type) const -> RowRange {
+        const Table* table = get_table_ptr(type);
+        if (table == nullptr) {
+            return {};
         }
+        return table->row_range();
+    }
 
-        types_.reserve(types_.size() + est_num_types);
+    // Bounds a table by age and/or size. Expired blocks are dropped whole, oldest first,
+    // as new blocks are sealed; their buffers are kept for reuse.
+    auto set_retention(TypeHandle type, RetentionPolicy policy) -> void {
+        get_or_create_table(type).set_retention(policy);
     }
 
-    std::vector<TypeMeta> types_;
-};
+    // How the type's columns are encoded from now on, as blocks are flushed, tiered and
+    // compacted: each column of each segment gets the codec that a sample of its values
+    // suggests is smallest (EncodingPolicy::Ratio, the default) or best balances size
+    // against decode speed (EncodingPolicy::Speed). The codec is recorded with the chunk.
+    auto set_encoding_policy(TypeHandle type, EncodingPolicy policy) -> void {
+        get_or_create_table(type).set_encoding_policy(policy);
+    }
 
-struct Column {
-public:
-    Column() = default;
-    explicit Column(size_t elem_size) : elem_size_(elem_size) {}
+    // Builds a sorted value index on `field` in every segment sealed from now on (compaction
+    // adds it to older ones as it rewrites them), for query_where(). False if the field isn't
+    // a numeric field of the type.
+    auto index_field(TypeHandle type, std::string_view field) -> bool {
+        auto idx = field_index(type, field);
+        if (idx.is_none()) return false;
+
+        Table& table = get_or_create_table(type);
+        table.set_indexed(table.indexed() | field_bit(idx.unwrap()));
+        return true;
+    }
+
+    // Precomputes prefix sums and min/max sparse tables on `field` in every segment sealed
+    // from now on (compaction adds them to older ones as it rewrites them), so aggregate()
+    // and aggregate_buckets() over it cost about the same whatever the range's length.
+    // False if the field isn't a numeric field of the type.
+    auto precompute_aggregates(TypeHandle type, std::string_view field) -> bool {
+        auto idx = field_index(type, field);
+        if (idx.is_none()) return false;
 
-    auto push(const std::byte* data) -> void {
-        const size_t old_size = data_.size();
-        data_.resize(old_size + elem_size_);
-        std::memcpy(data_.data() + old_size, data, elem_size_);
+        Table& table = get_or_create_table(type);
+        table.set_aggregated(table.aggregated() | field_bit(idx.unwrap()));
+        return true;
     }
 
-    [[nodiscard]] auto at(size_t row) const -> const std::byte* {
-        return data_.data() + row * elem_size_;
+    // Keeps a roaring bitmap of row offsets per distinct value of the integral (BOOL or enum
+    // code) field `field` in every segment sealed from now on (compaction adds them to older
+    // ones as it rewrites them), for count_where() and query_where() with a RowFilter.
+    // Segments where the field has more than BitmapIndex::max_values values go without.
+    // False if the field isn't an integral field of the type.
+    auto index_bitmaps(TypeHandle type, std::string_view field) -> bool {
+        auto idx = integral_field_index(type, field);
+        if (idx.is_none()) return false;
+
+        Table& table = get_or_create_table(type);
+        table.set_bitmapped(table.bitmapped() | field_bit(idx.unwrap()));
+        return true;
     }
 
-    [[nodiscard]] auto row_count() const -> size_t {
-        return elem_size_ > 0 ? data_.size() / elem_size_ : 0;
+    // Delivers rows of `type` inserted from now on (by insert() and insert_batch(), or sealed
+    // into a rollup table) to the returned subscription, in batches as they're inserted; read
+    // them with Subscription::wait() and read(). With a filter only rows it returns true for
+    // are delivered. Rows that find the subscriber's ring full are dropped and counted, or,
+    // with OverflowPolicy::Block, the inserting thread waits for the consumer.
+    template<typename T>
+    [[nodiscard]] auto subscribe(TypeHandle type, SubscribeOptions opts = {}) -> std::shared_ptr<Subscription> {
+        return subscribe_rows(type, sizeof(T), {}, opts);
     }
 
-    [[nodiscard]] auto elem_size() const -> size_t { return elem_size_; }
+    template<typename T, std::predicate<const T&> F>
+    [[nodiscard]] auto subscribe(TypeHandle type, F filter, SubscribeOptions opts = {}) -> std::shared_ptr<Subscription> {
+        static_assert(std::is_trivially_copyable_v<T>);
 
-    auto reserve(size_t row_count) -> void {
-        data_.reserve(row_count * elem_size_);
+        return subscribe_rows(type, sizeof(T), [filter = std::move(filter)](const std::byte* row) {
+            T value;
+            std::memcpy(&value, row, sizeof(T));
+            return filter(value);
+        }, opts);
     }
 
-private:
-    size_t elem_size_ = 0;
-    std::vector<std::byte> data_;
-};
+    // Stops delivery to `sub` and wakes its consumer; rows still in its ring can be read.
+    auto unsubscribe(const std::shared_ptr<Subscription>& sub) -> void {
+        sub->close();
 
-struct Table {
-public:
-    Table(std::vector<size_t> field_sizes, std::vector<size_t> field_offsets)
-        : field_offsets_(std::move(field_offsets))
+        std::unique_lock lock(mutex_);
+        for (auto it = subscribers_.begin(); it != subscribers_.end(); ++it) {
+            if (std::ranges::find(*it->second, sub) == it->second->end()) continue;
+
+            auto rest = std::make_shared<SubscriberList>();
+            std::ranges::copy_if(*it->second, std::back_inserter(*rest), [&](const auto& s) { return s != sub; });
+            if (rest->empty()) subscribers_.erase(it);
+            else               it->second = std::move(rest);
+            break;
+        }
+    }
+
+    // Registers a continuous aggregate of `field`: count, sum, min and max per
+    // opts.bucket_ns bucket, kept up to date by insert() and insert_batch() as rows arrive.
+    // Sealed buckets are stored as RollupRow rows of a table of their own, whose handle this
+    // returns; query it like any other (aggregate() over "sum" or "max" works as is) or
+    // through query_rollup(), which also merges in the buckets still open. Only rows inserted
+    // from now on are counted. None if the field isn't a numeric field of the type.
+    auto create_rollup(TypeHandle type, std::string_view field, RollupOptions opts = {}) -> Option<TypeHandle> {
+        assert(opts.bucket_ns > 0 && opts.lateness_ns >= 0);
+
+        auto idx = field_index(type, field);
+        if (idx.is_none()) return None;
+
+        TypeHandle target = 0;
+        {
+            std::unique_lock lock(mutex_);
+            target = schema_.register_struct(std::format("{}.{}/{}ns", schema_.meta_of(type).name, field, opts.bucket_ns), {
+                { "count", U64 },
+                { "sum",   F64 },
+                { "min",   F64 },
+                { "max",   F64 },
+            });
+        }
+
+        const Table& source = get_or_create_table(type);
+        (void)get_or_create_table(target);   // listed in stats() before its first bucket seals
+
+        std::unique_lock lock(mutex_);
+        rollups_[type].push_back(std::make_shared<Rollup>(type, target, idx.unwrap(), source.layout(), opts));
+        has_rollups_.store(true, std::memory_order_release);
+        return Some(target);
+    }
+
+    // Keeps `field` downsampled to each of opts.tiers, as rollups (see create_rollup()) with
+    // their own retention, so raw rows can expire sooner than the coarse history. From then
+    // on aggregate() and aggregate_buckets() on the field are planned over the tiers: each
+    // part of the range is read from the coarsest tier whose buckets fit inside the query's
+    // buckets, finer tiers and finally raw rows filling in the ragged ends and the time
+    // before this call. Returns the tiers' handles in the order given; None if the field
+    // isn't a numeric field of the type or a tier's width isn't positive.
+    auto downsample(TypeHandle type, std::string_view field, DownsampleOptions opts) -> Option<std::vector<TypeHandle>> {
+        auto idx = field_index(type, field);
+        if (idx.is_none() || opts.tiers.empty()
+            || std::ranges::any_of(opts.tiers, [](const DownsampleTier& t) { return t.bucket_ns <= 0; }))
+        {
+            return None;
+        }
+
+        std::vector<TypeHandle> handles;
+        DownsampledField        ds { .field = idx.unwrap() };
+        for (const DownsampleTier& tier : opts.tiers) {
+            const TypeHandle h = create_rollup(type, field, { .bucket_ns = tier.bucket_ns, .lateness_ns = opts.lateness_ns }).unwrap();
+            if (tier.max_age_ns > 0) set_retention(h, { .max_age_ns = tier.max_age_ns });
+
+            handles.push_back(h);
+            ds.tiers.emplace_back(tier.bucket_ns, h);
+        }
+        std::ranges::sort(ds.tiers, std::greater {}, &std::pair<i64, TypeHandle>::first);
+
+        if (opts.raw_max_age_ns > 0) set_retention(type, { .max_age_ns = opts.raw_max_age_ns });
+
+        // Read after the rollups are in place: every row inserted before them is older.
+        const i64 newest = get_or_create_table(type).newest_timestamp();
+        ds.from = newest == std::numeric_limits<i64>::max() ? newest : newest + 1;
+
+        std::unique_lock lock(mutex_);
+        auto& fields = downsampled_[type];
+        std::erase_if(fields, [&](const DownsampledField& d) { return d.field == ds.field; });
+        fields.push_back(std::move(ds));
+        return Some(std::move(handles));
+    }
+
+    // Buckets of a rollup from create_rollup() starting in [t_begin, t_end), oldest first:
+    // the sealed ones stored in its table merged with the ones still open.
+    [[nodiscard]] auto query_rollup(TypeHandle rollup, i64 t_begin, i64 t_end) const -> std::vector<RollupRow> {
+        std::shared_ptr<const Rollup> found;
+        {
+            std::shared_lock lock(mutex_);
+            for (const auto& [_, list] : rollups_) {
+                for (const auto& r : list) {
+                    if (r->target() == rollup) found = r;
+                }
+            }
+        }
+        if (!found) return {};
+
+        auto rows = query_range<RollupRow>(rollup, t_begin, t_end);
+        std::ranges::move(found->open(t_begin, t_end), std::back_inserter(rows));
+        std::ranges::stable_sort(rows, {}, &RollupRow::timestamp_ns);
+
+        std::vector<RollupRow> out;
+        for (const RollupRow& r : rows) {
+            if (out.empty() || out.back().timestamp_ns != r.timestamp_ns) {
+                out.push_back(r);
+                continue;
+            }
+            AggState s = out.back().state();
+            s.merge(r.state());
+            out.back() = RollupRow::of(r.timestamp_ns, s);
+        }
+        return out;
+    }
+
+    // Builds a uniform grid over positions held in three numeric fields in every segment
+    // sealed from now on, for query_box() and query_radius(). False unless all three are
+    // floating-point fields of the type.
+    auto index_spatial(TypeHandle type, std::string_view x = "x", std::string_view y = "y",
+                       std::string_view z = "z") -> bool
     {
-        columns_.reserve(field_sizes.size());
-        for (size_t sz : field_sizes) {
-            columns_.emplace_back(sz);
+        std::array<size_t, 3> axes;
+        const std::array<std::string_view, 3> names { x, y, z };
+        for (size_t a = 0; a < 3; ++a) {
+            auto idx = field_index(type, names[a]);
+            if (idx.is_none()) return false;
+
+            std::shared_lock lock(mutex_);
+            const auto& field = schema_.meta_of(type).fields[idx.unwrap()];
+            if (!is_floating(schema_.meta_of(field.type).kind)) return false;
+            axes[a] = idx.unwrap();
         }
+
+        get_or_create_table(type).set_spatial(axes);
+        return true;
     }
 
-    auto insert_row(const std::byte* src) -> void {
-        for (size_t i = 0; i < columns_.size(); ++i) {
-            columns_[i].push(src + field_offsets_[i]);
+    // Seals the table's open block so it becomes an immutable segment, even if not full.
+    auto flush(TypeHandle type) -> void {
+        if (Table* table = get_table_mut(type)) {
+            table->flush();
         }
-        ++row_count_;
     }
 
-    auto read_row(size_t row, std::byte* dst) const -> void {
-        for (size_t i = 0; i < columns_.size(); ++i) {
-            std::memcpy(dst + field_offsets_[i], columns_[i].at(row), columns_[i].elem_size());
+    auto flush() -> void {
+        for (auto [_, table] : all_tables()) {
+            table->flush();
         }
     }
 
-    auto reserve(size_t row_count) -> void {
-        for (auto& col : columns_) {
-            col.reserve(row_count);
+    // One compaction pass over every table; returns the number of segments merged away.
+    auto compact(const CompactionOptions& opts = {}) -> size_t {
+        size_t replaced = 0;
+        for (auto [_, table] : all_tables()) {
+            replaced += table->compact(opts);
         }
+        return replaced;
     }
 
-    [[nodiscard]] auto row_count() const -> size_t { return row_count_; }
+    // Runs compact() every opts.interval on a background thread until stop_compaction().
+    auto start_compaction(CompactionOptions opts = {}) -> void {
+        compactor_.start(opts.interval, [this, opts] { compact(opts); });
+    }
 
-private:
-    size_t row_count_ = 0;
-    std::vector<size_t> field_offsets_;
-    std::vector<Column> columns_;
-};
+    auto stop_compaction() -> void { compactor_.stop(); }
 
-class TSDB {
-public:
-    TSDB(size_t est_num_types = 1) : schema_(est_num_types) {}
+    // Full blocks are frozen and swapped for a spare on the insert path, then sealed (and
+    // encoded, with opts.encode) by a background thread while inserts carry on into the new
+    // block. Inserts wait only once a table has opts.max_frozen blocks queued.
+    auto start_flushing(FlushOptions opts = {}) -> void {
+        stop_flushing();
 
-    ~TSDB()           = default;
-    TSDB(const TSDB&) = delete;
-    TSDB(TSDB&&)      = delete;
+        auto signal = std::make_shared<FlushSignal>();
+        {
+            std::unique_lock lock(mutex_);
+            flush_signal_ = signal;
+            flush_opts_   = opts;
+        }
+        for (auto [_, table] : all_tables()) {
+            table->set_flusher(signal, opts);
+            table->refill_standby();
+        }
 
-    auto register_struct(std::string name,
-                         std::initializer_list<std::pair<std::string, const TypeHandle>> fields) -> TypeHandle
+        flusher_ = std::jthread([this, signal](std::stop_token stop) {
+            while (signal->wait(stop)) {
+                for (auto [_, table] : all_tables()) {
+                    while (table->flush_frozen()) {}
+                    table->refill_standby();
+                }
+            }
+        });
+    }
+
+    // Stops the flusher and seals whatever it left frozen; full blocks are sealed inline again.
+    auto stop_flushing() -> void {
+        if (!flusher_.joinable()) return;
+
+        flusher_.request_stop();
+        flusher_.join();
+        {
+            std::unique_lock lock(mutex_);
+            flush_signal_.reset();
+        }
+        for (auto [_, table] : all_tables()) {
+            table->set_flusher(nullptr);
+        }
+    }
+
+    // One tiering pass: raw segments past each table's hot_bytes are encoded in memory, then,
+    // while all tables together hold more than memory_bytes, the oldest in-memory segment is
+    // written to opts.dir and replaced by a mapping of the file. Queries read every tier the
+    // same way. Returns the number of segments moved.
+    auto enforce_tiers(const TierOptions& opts) -> size_t {
+        const auto tables = all_tables();
+
+        size_t moved = 0;
+        for (auto [_, table] : tables) {
+            moved += table->cool(opts.hot_bytes);
+        }
+
+        if (opts.dir.empty() || opts.memory_bytes == 0) {
+            return moved;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(opts.dir, ec);
+        if (ec) return moved;
+
+        for (;;) {
+            size_t total = 0;
+            for (auto [_, table] : tables) total += table->memory_bytes();
+            if (total <= opts.memory_bytes) break;
+
+            TypeHandle                     victim_handle { 0 };
+            Table*                         victim_table = nullptr;
+            std::shared_ptr<const Segment> victim;
+            for (auto [handle, table] : tables) {
+                auto seg = table->oldest_in_memory();
+                if (seg && (!victim || seg->t_max < victim->t_max)) {
+                    victim_handle = handle;
+                    victim_table  = table;
+                    victim        = std::move(seg);
+                }
+            }
+
+            if (!victim || !spill(victim_handle, *victim_table, victim, opts.dir)) break;
+            ++moved;
+        }
+
+        return moved;
+    }
+
+    // Runs enforce_tiers() every opts.interval on a background thread until stop_tiering().
+    auto start_tiering(TierOptions opts) -> void {
+        tierer_.start(opts.interval, [this, opts] { enforce_tiers(opts); });
+    }
+
+    auto stop_tiering() -> void { tierer_.stop(); }
+
+    // Reads segments spilled from now on through a pool of NumPages huge pages, cut into
+    // opts.frame_bytes frames with CLOCK-Pro eviction, instead of mapping each file. Bounds
+    // the memory cold reads can take, and keeps one-off history scans from pushing out the
+    // chunks recent queries keep coming back to. Frames are filled by io_uring (or a thread
+    // pool where it isn't available) with up to opts.io_depth reads in flight, and range
+    // scans read ahead of the segment they're decoding. Segments already cold stay mapped.
+    template <std::size_t NumPages, std::size_t PageSize = Huge2MB>
+    auto enable_buffer_pool(BufferPoolOptions opts = {}) -> void {
+        auto pool   = BufferPool::create<NumPages, PageSize>(opts);
+        auto reader = AsyncReader::create(opts.io_depth);
+
+        std::unique_lock lock(mutex_);
+        if (!buffer_pool_) {
+            buffer_pool_ = std::move(pool);
+            reader_      = std::move(reader);
+        }
+    }
+
+    // Caches aggregate() and aggregate_buckets() results, up to max_bytes in all, per sealed
+    // segment: repeating a query rescans only the segments sealed, merged or rewritten since
+    // it last ran, plus the rows not yet sealed, which are never cached. Fields with
+    // precomputed aggregates bypass the cache; they're already cheap.
+    auto enable_result_cache(size_t max_bytes = 16 << 20) -> void {
+        auto cache = std::make_unique<ResultCache>(max_bytes);
+
+        std::unique_lock lock(mutex_);
+        if (!result_cache_) result_cache_ = std::move(cache);
+    }
+
+    // Rows with t_begin <= timestamp_ns < t_end, oldest block first.
+    template<typename T>
+    [[nodiscard]] auto query_range(TypeHandle type, i64 t_begin, i64 t_end) const -> std::vector<T> {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        std::vector<T> out;
+
+        const Table* table = get_table_ptr(type);
+        if (table == nullptr) {
+            return out;
+        }
+
+        table->for_each_in_range(t_begin, t_end, all_fields, [&](const RowBatch& b, size_t i) {
+            b.read_row(i, reinterpret_cast<std::byte*>(&out.emplace_back()));
+        });
+
+        return out;
+    }
+
+    // Rows with t_begin <= timestamp_ns < t_end and lo <= field <= hi, oldest first. Uses the
+    // field's value index where segments have one (see index_field()).
+    template<typename T>
+    [[nodiscard]] auto query_where(TypeHandle type, std::string_view field, f64 lo, f64 hi,
+                                   i64 t_begin, i64 t_end) const -> std::vector<T>
     {
-        return schema_.register_struct(name, fields);
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        std::vector<T> out;
+
+        const Table* table = get_table_ptr(type);
+        auto idx = field_index(type, field);
+        if (table == nullptr || idx.is_none()) {
+            return out;
+        }
+
+        table->for_each_match(t_begin, t_end, idx.unwrap(), lo, hi, all_fields, [&](const RowBatch& b, size_t i) {
+            b.read_row(i, reinterpret_cast<std::byte*>(&out.emplace_back()));
+        });
+
+        return out;
     }
 
+    // Rows with t_begin <= timestamp_ns < t_end that `filter` matches, oldest first. Segments
+    // with bitmaps on the filter's fields (see index_bitmaps()) find them by combining the
+    // bitmaps, and only the matching rows are read. Empty if a field the filter names isn't
+    // an integral field of the type.
     template<typename T>
-    auto insert(const T& src, TypeHandle type) -> void {
+    [[nodiscard]] auto query_where(TypeHandle type, const RowFilter& filter, i64 t_begin, i64 t_end) const
+        -> std::vector<T>
+    {
         static_assert(std::is_trivially_copyable_v<T>);
 
-        Table& table = get_or_create_table(type);
-        const auto* bytes = reinterpret_cast<const std::byte*>(&src);
+        std::vector<T> out;
+
+        const Table* table = get_table_ptr(type);
+        auto bound = bind_filter(type, filter);
+        if (table == nullptr || bound.is_none()) {
+            return out;
+        }
+
+        table->for_each_where(t_begin, t_end, bound.unwrap(), all_fields, [&](const RowBatch& b, size_t i) {
+            b.read_row(i, reinterpret_cast<std::byte*>(&out.emplace_back()));
+        });
+
+        return out;
+    }
+
+    // Number of rows with t_begin <= timestamp_ns < t_end that `filter` matches. Segments
+    // the range covers and that have bitmaps on the filter's fields are counted from the
+    // bitmaps alone. None if a field the filter names isn't an integral field of the type.
+    [[nodiscard]] auto count_where(TypeHandle type, const RowFilter& filter, i64 t_begin, i64 t_end) const
+        -> Option<u64>
+    {
+        auto bound = bind_filter(type, filter);
+        if (bound.is_none()) return None;
 
-        table.insert_row(bytes);
+        const Table* table = get_table_ptr(type);
+        return Some(table != nullptr ? table->count_where(t_begin, t_end, bound.unwrap()) : u64{0});
     }
 
+    // Rows with t_begin <= timestamp_ns < t_end positioned inside `box`, oldest first. Needs
+    // index_spatial() to say which fields hold the position; empty otherwise.
     template<typename T>
-    [[nodiscard]] auto query_first(TypeHandle type) const -> T {
+    [[nodiscard]] auto query_box(TypeHandle type, const Box3& box, i64 t_begin, i64 t_end) const -> std::vector<T> {
+        return query_spatial<T>(type, box, t_begin, t_end, [](const RowBatch&, size_t) { return true; });
+    }
+
+    // Rows with t_begin <= timestamp_ns < t_end within `radius` of `center`, oldest first.
+    template<typename T>
+    [[nodiscard]] auto query_radius(TypeHandle type, const std::array<f64, 3>& center, f64 radius,
+                                    i64 t_begin, i64 t_end) const -> std::vector<T>
+    {
+        const Box3 box {
+            .lo = { center[0] - radius, center[1] - radius, center[2] - radius },
+            .hi = { center[0] + radius, center[1] + radius, center[2] + radius },
+        };
+        const Table* table = get_table_ptr(type);
+        const auto axes = table != nullptr ? table->spatial() : None;
+
+        return query_spatial<T>(type, box, t_begin, t_end, [&](const RowBatch& b, size_t i) {
+            f64 d2 = 0;
+            for (size_t a = 0; a < 3; ++a) {
+                const f64 d = b.value(i, axes.unwrap()[a]) - center[a];
+                d2 += d * d;
+            }
+            return d2 <= radius * radius;
+        });
+    }
+
+    [[nodiscard]] auto aggregate(TypeHandle type, std::string_view field,
+                                 i64 t_begin, i64 t_end, Agg agg) const -> Option<f64>
+    {
+        const Table* table = get_table_ptr(type);
+        auto idx = field_index(type, field);
+        if (table == nullptr || idx.is_none()) {
+            return None;
+        }
+
+        const size_t f = idx.unwrap();
+        if (table->aggregated() & field_bit(f)) {
+            return table->summarize(t_begin, t_end, f, agg == Agg::Min || agg == Agg::Max).finish(agg);
+        }
+
+        if (auto ds = downsampled(type, f); ds.is_some() && t_begin < t_end) {
+            return tiered_states(ds.unwrap(), *table, t_begin, t_end, 0, 1).front().finish(agg);
+        }
+
+        if (ResultCache* cache = result_cache(); cache != nullptr && t_begin < t_end) {
+            return cached_states(*cache, type, *table, f, t_begin, t_end, 0, 1).front().finish(agg);
+        }
+
+        // Covered bit-packed segments are summed without decoding them; see Table::summarize().
+        return table->summarize(t_begin, t_end, f, agg == Agg::Min || agg == Agg::Max).finish(agg);
+    }
+
+    // query_range() as a task for event-driven callers: it runs on `ex`, and instead of
+    // blocking on cold segment reads it suspends until they complete, so a few executor
+    // threads can keep many queries in flight. The query's frames and scan buffers come from
+    // an arena owned by the task. The database must outlive the task.
+    template<typename T>
+    [[nodiscard]] auto async_query_range(Executor& ex, TypeHandle type, i64 t_begin, i64 t_end) const
+        -> Task<std::vector<T>>
+    {
         static_assert(std::is_trivially_copyable_v<T>);
 
+        auto arena = std::make_unique<QueryArena>();
+        auto task  = query_range_task<T>(*arena, ex, get_table_ptr(type), t_begin, t_end);
+        return Task<std::vector<T>>::with_arena(std::move(task), std::move(arena));
+    }
+
+    // aggregate() as a task; see async_query_range().
+    [[nodiscard]] auto async_aggregate(Executor& ex, TypeHandle type, std::string_view field,
+                                       i64 t_begin, i64 t_end, Agg agg) const -> Task<Option<f64>>
+    {
+        auto arena = std::make_unique<QueryArena>();
+        auto task  = aggregate_task(*arena, ex, get_table_ptr(type), field_index(type, field), t_begin, t_end, agg);
+        return Task<Option<f64>>::with_arena(std::move(task), std::move(arena));
+    }
+
+    // Dense buckets of bucket_ns width covering [t_begin, t_end).
+    [[nodiscard]] auto aggregate_buckets(TypeHandle type, std::string_view field,
+                                         i64 t_begin, i64 t_end, i64 bucket_ns, Agg agg) const -> std::vector<Bucket>
+    {
+        assert(bucket_ns > 0);
+
+        std::vector<Bucket> out;
+
         const Table* table = get_table_ptr(type);
-        if (table == nullptr || table->row_count() == 0) {
-            return T{};
+        auto idx = field_index(type, field);
+        if (table == nullptr || idx.is_none() || t_end <= t_begin) {
+            return out;
         }
 
-        T result {};
-        auto* dst = reinterpret_cast<std::byte*>(&result);
-        table->read_row(0, dst);
+        // Unsigned, like bucket_index(), so ranges spanning most of i64 don't overflow.
+        const size_t f    = idx.unwrap();
+        const u64    span = static_cast<u64>(t_end) - static_cast<u64>(t_begin);
+        const auto   n    = static_cast<size_t>((span - 1) / static_cast<u64>(bucket_ns) + 1);
+        const auto start_of = [&](size_t i) {
+            return static_cast<i64>(static_cast<u64>(t_begin) + i * static_cast<u64>(bucket_ns));
+        };
+        std::vector<AggState> states(n);
 
-        return result;
+        // With precomputed aggregates a bucket costs about as much as its two edges, which
+        // beats a scan once buckets span several segments each.
+        if ((table->aggregated() & field_bit(f)) && 2 * n < table->snapshot(t_begin, t_end).segments.size()) {
+            for (size_t i = 0; i < n; ++i) {
+                const i64 lo = start_of(i);
+                const i64 hi = i + 1 < n ? start_of(i + 1) : t_end;
+                states[i] = table->summarize(lo, hi, f, agg == Agg::Min || agg == Agg::Max);
+            }
+        } else if (auto ds = downsampled(type, f); ds.is_some()) {
+            states = tiered_states(ds.unwrap(), *table, t_begin, t_end, bucket_ns, n);
+        } else if (ResultCache* cache = result_cache(); cache != nullptr) {
+            states = cached_states(*cache, type, *table, f, t_begin, t_end, bucket_ns, n);
+        } else {
+            table->for_each_in_range(t_begin, t_end, field_bit(f), [&](const RowBatch& b, size_t i) {
+                states[bucket_index(b.timestamp(i), t_begin, bucket_ns)].add(b.value(i, f));
+            });
+        }
+
+        out.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            out.push_back(Bucket {
+                .start_ns = start_of(i),
+                .count    = states[i].count,
+                .value    = states[i].finish(agg).unwrap_or(std::numeric_limits<f64>::quiet_NaN()),
+            });
+        }
+
+        return out;
+    }
+
+    // Rows of all the listed tables with t_begin <= timestamp_ns < t_end, merged into one
+    // stream in timestamp order (ties in list order), each as a variant whose index is its
+    // table's position in the list. Each table's segments are decoded as the replay reaches
+    // them, the next one ahead on a background thread, so memory stays around a segment per
+    // table however long the range. Rows inserted after the call aren't replayed. The
+    // database must outlive the replay.
+    template<typename... Ts>
+    [[nodiscard]] auto replay(std::array<TypeHandle, sizeof...(Ts)> types,
+                              i64 t_begin = std::numeric_limits<i64>::min(),
+                              i64 t_end   = std::numeric_limits<i64>::max()) const -> TypedReplay<Ts...>
+    {
+        static_assert((std::is_trivially_copyable_v<Ts> && ...));
+
+        [[maybe_unused]] constexpr std::array<size_t, sizeof...(Ts)> sizes { sizeof(Ts)... };
+        for (size_t i = 0; i < types.size(); ++i) {
+            assert(sizes[i] == type_size(types[i]));
+        }
+        return TypedReplay<Ts...>(replay_rows(types, t_begin, t_end));
+    }
+
+    // replay() without the types: rows come out as bytes tagged with their table's position.
+    [[nodiscard]] auto replay_rows(std::span<const TypeHandle> types,
+                                   i64 t_begin = std::numeric_limits<i64>::min(),
+                                   i64 t_end   = std::numeric_limits<i64>::max()) const -> Replay
+    {
+        std::vector<ReplayCursor> cursors;
+        cursors.reserve(types.size());
+        for (TypeHandle type : types) {
+            cursors.emplace_back(get_table_ptr(type), type_size(type), t_begin, t_end);
+        }
+        return Replay(std::move(cursors));
+    }
+
+    // Aggregates `field` per distinct value of the integral field `tag` (a host or sensor id,
+    // say) over rows with t_begin <= timestamp_ns < t_end, ordered by tag. Empty if either
+    // field is missing or the tag isn't integral.
+    [[nodiscard]] auto group_by(TypeHandle type, std::string_view tag, std::string_view field,
+                                i64 t_begin, i64 t_end, Agg agg) const -> std::vector<Group>
+    {
+        std::vector<Group> out;
+        for (const auto& part : group_states(type, tag, field, t_begin, t_end)) {
+            for (const auto& [key, state] : part) {
+                out.push_back({ key, state.count, state.finish(agg).unwrap_or(std::numeric_limits<f64>::quiet_NaN()) });
+            }
+        }
+        std::ranges::sort(out, {}, &Group::key);
+        return out;
+    }
+
+    // The k groups of group_by() with the largest aggregate, largest first (ties by tag),
+    // picked through a k-entry heap. Groups whose aggregate is undefined are left out.
+    [[nodiscard]] auto top_k_groups(TypeHandle type, std::string_view tag, std::string_view field,
+                                    Agg agg, size_t k, i64 t_begin, i64 t_end) const -> std::vector<Group>
+    {
+        // Orders better groups first; the heap keeps the worst of the k on top.
+        const auto better = [](const Group& a, const Group& b) {
+            return a.value != b.value ? a.value > b.value : a.key < b.key;
+        };
+
+        std::vector<Group> heap;
+        if (k == 0) return heap;
+        heap.reserve(k);
+
+        for (const auto& part : group_states(type, tag, field, t_begin, t_end)) {
+            for (const auto& [key, state] : part) {
+                const auto value = state.finish(agg);
+                if (value.is_none() || std::isnan(value.unwrap())) continue;
+
+                const Group g { key, state.count, value.unwrap() };
+                if (heap.size() < k) {
+                    heap.push_back(g);
+                    std::ranges::push_heap(heap, better);
+                } else if (better(g, heap.front())) {
+                    std::ranges::pop_heap(heap, better);
+                    heap.back() = g;
+                    std::ranges::push_heap(heap, better);
+                }
+            }
+        }
+
+        std::ranges::sort_heap(heap, better);
+        return heap;
+    }
+
+    // The k rows with the largest `field` in [t_begin, t_end), largest first; among equal
+    // values the earlier inserted row wins. Only `field` is scanned; the winners' rows are
+    // read by row id afterwards, skipping any that retention dropped in between.
+    template<typename T>
+    [[nodiscard]] auto top_k(TypeHandle type, std::string_view field, size_t k, i64 t_begin, i64 t_end) const
+        -> std::vector<T>
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        struct Entry {
+            f64 value;
+            u64 row;   // global row id
+        };
+        const auto better = [](const Entry& a, const Entry& b) {
+            return a.value != b.value ? a.value > b.value : a.row < b.row;
+        };
+
+        std::vector<T> out;
+        const Table* table = get_table_ptr(type);
+        auto idx = field_index(type, field);
+        if (table == nullptr || idx.is_none() || k == 0) {
+            return out;
+        }
+
+        const size_t f = idx.unwrap();
+        std::vector<Entry> heap;
+        heap.reserve(k);
+
+        table->for_each_in_range(t_begin, t_end, field_bit(f), [&](const RowBatch& b, size_t i) {
+            const f64 v = b.value(i, f);
+            if (std::isnan(v)) return;
+
+            const Entry e { .value = v, .row = b.row_begin + i };
+            if (heap.size() == k) {
+                if (!better(e, heap.front())) return;
+                std::ranges::pop_heap(heap, better);
+                heap.pop_back();
+            }
+            heap.push_back(e);
+            std::ranges::push_heap(heap, better);
+        });
+
+        std::ranges::sort_heap(heap, better);
+        out.reserve(heap.size());
+        for (const Entry& e : heap) {
+            T row;
+            if (table->read_row(e.row, reinterpret_cast<std::byte*>(&row))) out.push_back(row);
+        }
+        return out;
+    }
+
+    // `field` on the regular grid t_begin + k * step_ns within [t_begin, t_end), filled from
+    // the samples around each point by `method`. A point is NaN when the samples it would
+    // use are missing or further than max_gap_ns from it (for Linear: from each other);
+    // 0 allows a gap of one step. Only samples within max_gap_ns of the range are read, and
+    // the grid is filled in one merge pass over them.
+    [[nodiscard]] auto resample(TypeHandle type, std::string_view field, i64 t_begin, i64 t_end, i64 step_ns,
+                                Interp method, i64 max_gap_ns = 0) const -> std::vector<f64>
+    {
+        assert(step_ns > 0 && max_gap_ns >= 0);
+
+        const Table* table = get_table_ptr(type);
+        auto idx = field_index(type, field);
+        if (table == nullptr || idx.is_none() || t_end <= t_begin) {
+            return {};
+        }
+
+        const size_t f   = idx.unwrap();
+        const i64    gap = max_gap_ns > 0 ? max_gap_ns : step_ns;
+        const auto   n   = static_cast<size_t>((static_cast<u64>(t_end) - static_cast<u64>(t_begin) - 1) / static_cast<u64>(step_ns) + 1);
+
+        constexpr i64 lo = std::numeric_limits<i64>::min(), hi = std::numeric_limits<i64>::max();
+        const i64 from  = t_begin < lo + gap ? lo : t_begin - gap;
+        const i64 until = t_end > hi - gap ? hi : t_end + gap;
+
+        std::vector<i64> ts;
+        std::vector<f64> vs;
+        table->for_each_in_range(from, until, field_bit(f), [&](const RowBatch& b, size_t i) {
+            ts.push_back(b.timestamp(i));
+            vs.push_back(b.value(i, f));
+        });
+
+        // Late rows leave the samples slightly out of order; equal timestamps keep insert order.
+        if (!std::ranges::is_sorted(ts)) {
+            std::vector<u32> order(ts.size());
+            std::iota(order.begin(), order.end(), 0u);
+            std::ranges::stable_sort(order, {}, [&](u32 i) { return ts[i]; });
+
+            std::vector<i64> sorted_ts(ts.size());
+            std::vector<f64> sorted_vs(vs.size());
+            for (size_t k = 0; k < order.size(); ++k) {
+                sorted_ts[k] = ts[order[k]];
+                sorted_vs[k] = vs[order[k]];
+            }
+            ts = std::move(sorted_ts);
+            vs = std::move(sorted_vs);
+        }
+
+        return fill_grid(ts, vs, t_begin, step_ns, n, method, gap);
+    }
+
+    // Memory and encoding figures per table and column, from a snapshot of each table.
+    [[nodiscard]] auto stats() const -> TSDBStats {
+        TSDBStats out;
+
+        std::shared_lock lock(mutex_);
+        out.tables.reserve(tables_.size());
+
+        for (const auto& [handle, table] : tables_) {
+            const auto& meta   = schema_.meta_of(handle);
+            const auto& layout = table->layout();
+            const auto  snap   = table->snapshot();
+            const auto  range  = table->row_range();
+
+            const size_t block_rows = table->pool().block_rows();
+            const size_t spare      = table->pool().spare_blocks();
+
+            TableStats ts {
+                .name         = meta.name,
+                .handle       = handle,
+                .rows         = range.end - range.begin,
+                .blocks       = snap.segments.size() + snap.frozen.size() + (snap.active ? 1 : 0),
+                .memory_bytes = table->memory_bytes(),
+                .rejected_batches = table->rejected_batches(),
+            };
+
+            for (const auto& seg : snap.segments) {
+                ts.disk_bytes    += seg->disk_bytes;
+                ts.hot_segments  += seg->tier == Tier::Hot;
+                ts.warm_segments += seg->tier == Tier::Warm;
+                ts.cold_segments += seg->tier == Tier::Cold;
+            }
+
+            for (size_t f = 0; f < layout.field_count(); ++f) {
+                const size_t sz = layout.sizes[f];
+
+                ColumnStats cs {
+                    .name   = meta.fields[f].name,
+                    .kind   = layout.kinds[f],
+                    .rows   = ts.rows,
+                    .blocks = ts.blocks,
+                };
+
+                std::array<u64, 256> rows_by_encoding {};
+                for (const auto& seg : snap.segments) {
+                    const auto& chunk = seg->columns[f];
+
+                    cs.raw_bytes     += u64{seg->rows} * sz;
+                    cs.encoded_bytes += chunk.stored_size();
+                    if (seg->tier != Tier::Cold) {
+                        cs.used_bytes     += chunk.stored_size();
+                        cs.reserved_bytes += seg->tier == Tier::Hot ? block_rows * sz : chunk.stored_size();
+                    }
+                    rows_by_encoding[std::to_underlying(chunk.encoding)] += seg->rows;
+                }
+
+                for (const auto& b : snap.frozen) {
+                    const Column& col = b->columns[f];
+                    cs.raw_bytes      += col.size_bytes();
+                    cs.encoded_bytes  += col.size_bytes();
+                    cs.used_bytes     += col.size_bytes();
+                    cs.reserved_bytes += col.capacity_bytes();
+                    rows_by_encoding[std::to_underlying(Encoding::Raw)] += col.row_count();
+                }
+
+                if (snap.active) {
+                    const Column& col = snap.active->columns[f];
+                    cs.raw_bytes      += col.size_bytes();
+                    cs.encoded_bytes  += col.size_bytes();
+                    cs.used_bytes     += col.size_bytes();
+                    cs.reserved_bytes += col.capacity_bytes();
+                    rows_by_encoding[std::to_underlying(Encoding::Raw)] += col.row_count();
+                }
+
+                cs.reserved_bytes += spare * block_rows * sz;
+                cs.encoding = static_cast<Encoding>(std::ranges::max_element(rows_by_encoding) - rows_by_encoding.begin());
+
+                ts.raw_bytes      += cs.raw_bytes;
+                ts.encoded_bytes  += cs.encoded_bytes;
+                ts.used_bytes     += cs.used_bytes;
+                ts.reserved_bytes += cs.reserved_bytes;
+                ts.columns.push_back(std::move(cs));
+            }
+
+            out.rows           += ts.rows;
+            out.raw_bytes      += ts.raw_bytes;
+            out.encoded_bytes  += ts.encoded_bytes;
+            out.used_bytes     += ts.used_bytes;
+            out.reserved_bytes += ts.reserved_bytes;
+            out.tables.push_back(std::move(ts));
+        }
+
+        if (buffer_pool_) {
+            out.allocators.push_back(buffer_pool_->allocator_stats());
+            out.buffer_pool = Some(buffer_pool_->stats());
+            out.io          = Some(reader_->stats());
+        }
+        if (result_cache_) {
+            out.result_cache = Some(result_cache_->stats());
+        }
+
+        std::ranges::sort(out.tables, {}, [](const TableStats& t) { return t.name; });
+        return out;
+    }
+
+    // Same as stats(), plus an arena the caller owns (e.g. one rows are staged in before insert).
+    template <std::size_t NumPages, std::size_t PageSize>
+    [[nodiscard]] auto stats(std::string name, const HugePageAlloc<NumPages, PageSize>& alloc) const -> TSDBStats {
+        auto out = stats();
+        out.allocators.push_back(alloc.stats(std::move(name)));
+        return out;
+    }
+
+    // Index of a numeric field within the struct (0 is always timestamp_ns).
+    [[nodiscard]] auto field_index(TypeHandle type, std::string_view field) const -> Option<size_t> {
+        std::shared_lock lock(mutex_);
+
+        const auto& fields = schema_.meta_of(type).fields;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (fields[i].name == field && is_numeric(schema_.meta_of(fields[i].type).kind)) {
+                return Some(i);
+            }
+        }
+        return None;
+    }
+
+    // Index of an integral field (BOOL, an integer or timestamp) within the struct.
+    [[nodiscard]] auto integral_field_index(TypeHandle type, std::string_view field) const -> Option<size_t> {
+        std::shared_lock lock(mutex_);
+
+        const auto& fields = schema_.meta_of(type).fields;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (fields[i].name == field && is_integral(schema_.meta_of(fields[i].type).kind)) {
+                return Some(i);
+            }
+        }
+        return None;
+    }
+
+    // `filter` with its field names resolved against the type; None if any isn't integral.
+    [[nodiscard]] auto bind_filter(TypeHandle type, const RowFilter& filter) const -> Option<RowFilter> {
+        RowFilter bound = filter;
+        if (!bound.bind([&](std::string_view name) { return integral_field_index(type, name); })) return None;
+        return Some(std::move(bound));
     }
 
     // Default Types
@@ -251,30 +1181,524 @@ public:
     constexpr static TypeHandle TIME_NS { std::to_underlying(Schema::TypeKind::TIMESTAMP_NS) };
 
 private:
+    template<typename T, typename Keep>
+    [[nodiscard]] auto query_spatial(TypeHandle type, const Box3& box, i64 t_begin, i64 t_end, Keep&& keep) const
+        -> std::vector<T>
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        std::vector<T> out;
+
+        const Table* table = get_table_ptr(type);
+        const auto axes = table != nullptr ? table->spatial() : None;
+        if (axes.is_none()) {
+            return out;
+        }
+
+        table->for_each_in_box(t_begin, t_end, axes.unwrap(), box, all_fields, [&](const RowBatch& b, size_t i) {
+            if (keep(b, i)) b.read_row(i, reinterpret_cast<std::byte*>(&out.emplace_back()));
+        });
+
+        return out;
+    }
+
+    auto subscribe_rows(TypeHandle type, size_t row_size, Subscription::Filter keep, SubscribeOptions opts)
+        -> std::shared_ptr<Subscription>
+    {
+        auto sub = std::make_shared<Subscription>(row_size, std::move(keep), opts);
+
+        std::unique_lock lock(mutex_);
+        assert(row_size == schema_.meta_of(type).size);
+
+        // Copied on write, so publish() holds the list without holding the lock.
+        auto& list = subscribers_[type];
+        auto next  = list ? std::make_shared<SubscriberList>(*list) : std::make_shared<SubscriberList>();
+        next->push_back(sub);
+        list = std::move(next);
+
+        has_subscribers_.store(true, std::memory_order_release);
+        return sub;
+    }
+
+    // Hands freshly inserted rows to the type's subscribers.
+    auto publish(TypeHandle type, const std::byte* rows, size_t count, size_t stride) -> void {
+        if (!has_subscribers_.load(std::memory_order_acquire)) return;
+
+        std::shared_ptr<const SubscriberList> list;
+        {
+            std::shared_lock lock(mutex_);
+            auto it = subscribers_.find(type);
+            if (it == subscribers_.end()) return;
+            list = it->second;
+        }
+
+        for (const auto& sub : *list) {
+            sub->push(rows, count, stride);
+        }
+    }
+
+    auto close_subscriptions() -> void {
+        std::unique_lock lock(mutex_);
+        for (auto& [_, list] : subscribers_) {
+            for (const auto& sub : *list) sub->close();
+        }
+        subscribers_.clear();
+    }
+
+    // Folds freshly inserted rows into the type's rollups and appends the buckets that closed
+    // to the rollup tables, which can have rollups of their own.
+    auto feed_rollups(TypeHandle type, const std::byte* rows, size_t count, size_t stride) -> void {
+        if (!has_rollups_.load(std::memory_order_acquire)) return;
+
+        std::vector<std::shared_ptr<Rollup>> list;
+        {
+            std::shared_lock lock(mutex_);
+            auto it = rollups_.find(type);
+            if (it == rollups_.end()) return;
+            list = it->second;
+        }
+
+        for (const auto& rollup : list) {
+            const auto sealed = rollup->add(rows, count, stride);
+            if (sealed.empty()) continue;
+
+            const auto* bytes = reinterpret_cast<const std::byte*>(sealed.data());
+            get_or_create_table(rollup->target()).insert_rows(bytes, sealed.size(), sizeof(RollupRow));
+            feed_rollups(rollup->target(), bytes, sealed.size(), sizeof(RollupRow));
+            publish(rollup->target(), bytes, sealed.size(), sizeof(RollupRow));
+        }
+    }
+
+    // Per-tag states of group_by(), split into partitions by tag. Scans of more than a few
+    // blocks' worth of rows are spread over threads by segment: each pre-aggregates into its
+    // own maps, one per partition, then each partition is merged across threads by one
+    // thread, so no map is shared and the merge runs in parallel too.
+    [[nodiscard]] auto group_states(TypeHandle type, std::string_view tag, std::string_view field,
+                                    i64 t_begin, i64 t_end) const -> std::vector<absl::flat_hash_map<i64, AggState>>
+    {
+        using Map = absl::flat_hash_map<i64, AggState>;
+        constexpr size_t rows_per_thread = 1 << 20;
+
+        const Table* table = get_table_ptr(type);
+        auto t = field_index(type, tag);
+        auto f = field_index(type, field);
+        if (table == nullptr || t.is_none() || f.is_none() || !is_integral(table->layout().kinds[t.unwrap()])) {
+            return {};
+        }
+
+        const size_t    ti   = t.unwrap();
+        const size_t    fi   = f.unwrap();
+        const FieldMask mask = field_bit(ti) | field_bit(fi);
+
+        const TableSnapshot snap = table->snapshot(t_begin, t_end);
+        size_t rows = snap.active_rows;
+        for (const auto& seg : snap.segments) rows += seg->rows;
+        for (const auto& b : snap.frozen)     rows += b->rows();
+
+        const size_t cores   = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = std::clamp<size_t>(rows / rows_per_thread, 1, std::max<size_t>(1, std::min(cores, snap.segments.size())));
+
+        const auto partition_of = [&](i64 key) -> size_t {
+            return static_cast<size_t>((static_cast<u64>(key) * 0x9E3779B97F4A7C15ull) >> 32) % threads;
+        };
+
+        std::vector<std::vector<Map>> local(threads, std::vector<Map>(threads));
+
+        // Thread w takes segments w, w + threads, ...; the first also the frozen and open blocks.
+        parallel_for(threads, [&](size_t w) {
+            TableSnapshot part;
+            for (size_t i = w; i < snap.segments.size(); i += threads) part.segments.push_back(snap.segments[i]);
+            if (w == 0) {
+                part.frozen      = snap.frozen;
+                part.active      = snap.active;
+                part.active_rows = snap.active_rows;
+            }
+
+            auto& maps = local[w];
+            table->for_each_in_snapshot(part, t_begin, t_end, mask, [&](const RowBatch& b, size_t i) {
+                const i64 key = b.integer(i, ti);
+                maps[partition_of(key)][key].add(b.value(i, fi));
+            });
+        });
+
+        parallel_for(threads, [&](size_t p) {
+            for (size_t w = 1; w < threads; ++w) {
+                for (const auto& [key, state] : local[w][p]) local[0][p][key].merge(state);
+            }
+        });
+
+        return std::move(local[0]);
+    }
+
+    // Runs fn(0) .. fn(n - 1) on n threads, the caller's being one of them.
+    template<typename F>
+    static auto parallel_for(size_t n, F&& fn) -> void {
+        std::vector<std::jthread> workers;
+        workers.reserve(n - 1);
+        for (size_t i = 1; i < n; ++i) workers.emplace_back([&fn, i] { fn(i); });
+        fn(0);
+    }
+
+    // The merge pass behind resample(): `next` walks the sorted samples alongside the grid,
+    // ending up at the first sample after the point, so the one before it is the latest at
+    // or before the point. Among equal timestamps the last is used.
+    [[nodiscard]] static auto fill_grid(std::span<const i64> ts, std::span<const f64> vs, i64 t_begin, i64 step_ns,
+                                        size_t n, Interp method, i64 gap) -> std::vector<f64>
+    {
+        constexpr f64 nan = std::numeric_limits<f64>::quiet_NaN();
+
+        std::vector<f64> out(n, nan);
+        size_t next = 0;
+        for (size_t k = 0; k < n; ++k) {
+            const i64 g = t_begin + static_cast<i64>(k) * step_ns;
+            while (next < ts.size() && ts[next] <= g) ++next;
+
+            const bool has_prev = next > 0;
+            const i64  prev_ts  = has_prev ? ts[next - 1] : 0;
+            if (has_prev && prev_ts == g) {
+                out[k] = vs[next - 1];
+                continue;
+            }
+
+            const bool has_next = next < ts.size();
+            switch (method) {
+                case Interp::Previous:
+                    if (has_prev && g - prev_ts <= gap) out[k] = vs[next - 1];
+                    break;
+                case Interp::Next:
+                    if (has_next && ts[next] - g <= gap) out[k] = vs[next];
+                    break;
+                case Interp::Linear:
+                    if (has_prev && has_next && ts[next] - prev_ts <= gap) {
+                        const f64 w = static_cast<f64>(g - prev_ts) / static_cast<f64>(ts[next] - prev_ts);
+                        out[k] = vs[next - 1] + (vs[next] - vs[next - 1]) * w;
+                    }
+                    break;
+            }
+        }
+        return out;
+    }
+
+    [[nodiscard]] auto type_size(TypeHandle type) const -> size_t {
+        std::shared_lock lock(mutex_);
+        return schema_.meta_of(type).size;
+    }
+
+    [[nodiscard]] auto downsampled(TypeHandle type, size_t field) const -> Option<DownsampledField> {
+        std::shared_lock lock(mutex_);
+
+        auto it = downsampled_.find(type);
+        if (it == downsampled_.end()) return None;
+        for (const auto& ds : it->second) {
+            if (ds.field == field) return Some(ds);
+        }
+        return None;
+    }
+
+    // Bucket of ts among buckets of bucket_ns from t_begin (0: one bucket spanning the query).
+    // Unsigned so ranges spanning most of i64 don't overflow.
+    [[nodiscard]] static auto bucket_index(i64 ts, i64 t_begin, i64 bucket_ns) -> size_t {
+        if (bucket_ns == 0) return 0;
+        return static_cast<size_t>((static_cast<u64>(ts) - static_cast<u64>(t_begin)) / static_cast<u64>(bucket_ns));
+    }
+
+    // Per-bucket states of a downsampled field over [t_begin, t_end) in n buckets of
+    // bucket_ns (0: one bucket spanning the range). The range is split across the tiers
+    // coarsest first: a tier serves the whole tier buckets inside what's left of the range
+    // (if its buckets fit inside the query's) from when it started and its retention still
+    // covers, and the ends either side go to the next tier down, and finally to a scan of
+    // the raw rows.
+    [[nodiscard]] auto tiered_states(const DownsampledField& ds, const Table& table,
+                                     i64 t_begin, i64 t_end, i64 bucket_ns, size_t n) const -> std::vector<AggState>
+    {
+        std::vector<AggState> states(n);
+        const size_t f = ds.field;
+
+        struct Part { i64 lo, hi; size_t tier; };
+        std::vector<Part> todo { { t_begin, t_end, 0 } };
+
+        while (!todo.empty()) {
+            const auto [lo, hi, tier] = todo.back();
+            todo.pop_back();
+            if (lo >= hi) continue;
+
+            if (tier == ds.tiers.size()) {
+                table.for_each_in_range(lo, hi, field_bit(f), [&](const RowBatch& b, size_t i) {
+                    states[bucket_index(b.timestamp(i), t_begin, bucket_ns)].add(b.value(i, f));
+                });
+                continue;
+            }
+
+            // Whole tier buckets in [a, b), none before ds.from.
+            const auto [width, handle] = ds.tiers[tier];
+            const Table* rollup = get_table_ptr(handle);
+            const i64 start = std::max({ lo, ds.from, rollup ? rollup->retained_from() : ds.from });
+            i64 a = bucket_floor(start, width);
+            if (a < start) a = a > std::numeric_limits<i64>::max() - width ? std::numeric_limits<i64>::max() : a + width;
+            const i64 b = bucket_floor(hi, width);
+
+            const bool fits = bucket_ns == 0 || (bucket_ns % width == 0 && bucket_floor(t_begin, width) == t_begin);
+            if (!fits || a >= b) {
+                todo.push_back({ lo, hi, tier + 1 });
+                continue;
+            }
+
+            for (const RollupRow& row : query_rollup(handle, a, b)) {
+                states[bucket_index(row.timestamp_ns, t_begin, bucket_ns)].merge(row.state());
+            }
+            todo.push_back({ lo, a, tier + 1 });
+            todo.push_back({ b, hi, tier + 1 });
+        }
+
+        return states;
+    }
+
+    [[nodiscard]] auto result_cache() const -> ResultCache* {
+        std::shared_lock lock(mutex_);
+        return result_cache_.get();
+    }
+
+    // Per-bucket states of field f over [t_begin, t_end) in n buckets of bucket_ns (0: one
+    // bucket spanning the range). Sealed segments the cached result already covers are taken
+    // from it; the rest are scanned, and the refreshed result replaces the cached one.
+    [[nodiscard]] auto cached_states(ResultCache& cache, TypeHandle type, const Table& table, size_t f,
+                                     i64 t_begin, i64 t_end, i64 bucket_ns, size_t n) const -> std::vector<AggState>
+    {
+        const ResultCacheKey key { .table = type.v_, .field = static_cast<u32>(f),
+                                   .t_begin = t_begin, .t_end = t_end, .bucket_ns = bucket_ns };
+
+        const auto bucket_of = [&](i64 ts) { return bucket_index(ts, t_begin, bucket_ns); };
+
+        TableSnapshot snap = table.snapshot(t_begin, t_end);
+        std::shared_ptr<const CachedAggregate> result = cache.find(key);
+
+        if (result && result->version == snap.version) {
+            cache.record(true, false);
+        } else {
+            absl::flat_hash_map<u64, const CachedAggregate::Part*> known;
+            if (result) {
+                for (const auto& part : result->parts) known.emplace(part.segment, &part);
+            }
+
+            auto next = std::make_shared<CachedAggregate>();
+            next->version = snap.version;
+            next->sealed.resize(n);
+            next->parts.reserve(snap.segments.size());
+
+            size_t reused = 0;
+            for (const auto& seg : snap.segments) {
+                CachedAggregate::Part part;
+                if (auto it = known.find(seg->id); it != known.end()) {
+                    part = *it->second;
+                    ++reused;
+                } else {
+                    part.segment = seg->id;
+                    part.first   = bucket_of(std::max(seg->t_min, t_begin));
+                    part.buckets.resize(bucket_of(std::min(seg->t_max, t_end - 1)) - part.first + 1);
+
+                    TableSnapshot one;
+                    one.segments.push_back(seg);
+                    table.for_each_in_snapshot(one, t_begin, t_end, field_bit(f), [&](const RowBatch& b, size_t i) {
+                        part.buckets[bucket_of(b.timestamp(i)) - part.first].add(b.value(i, f));
+                    });
+                }
+
+                for (size_t i = 0; i < part.buckets.size(); ++i) {
+                    next->sealed[part.first + i].merge(part.buckets[i]);
+                }
+                next->parts.push_back(std::move(part));
+            }
+
+            cache.record(false, reused > 0);
+            cache.store(key, next);
+            result = std::move(next);
+        }
+
+        std::vector<AggState> states = result->sealed;
+
+        TableSnapshot tail;
+        tail.frozen      = std::move(snap.frozen);
+        tail.active      = std::move(snap.active);
+        tail.active_rows = snap.active_rows;
+        table.for_each_in_snapshot(tail, t_begin, t_end, field_bit(f), [&](const RowBatch& b, size_t i) {
+            states[bucket_of(b.timestamp(i))].add(b.value(i, f));
+        });
+
+        return states;
+    }
+
     [[nodiscard]] auto get_table_ptr(TypeHandle type) const -> const Table* {
+        std::shared_lock lock(mutex_);
+
         auto it = tables_.find(type);
-        if (it != tables_.end()) return &it->second;
+        if (it != tables_.end()) return it->second.get();
         return nullptr;
     }
 
+    [[nodiscard]] auto get_table_mut(TypeHandle type) -> Table* {
+        std::shared_lock lock(mutex_);
+
+        auto it = tables_.find(type);
+        if (it != tables_.end()) return it->second.get();
+        return nullptr;
+    }
+
+    // Coroutine bodies of the async queries. Taking the arena makes their frames come from it.
+    template<typename T>
+    static auto query_range_task(const QueryArena& arena, Executor& ex, const Table* table,
+                                 i64 t_begin, i64 t_end) -> Task<std::vector<T>>
+    {
+        co_await ex.schedule();
+
+        std::vector<T> out;
+        if (table == nullptr) co_return out;
+
+        co_await table->async_for_each_in_range(ex, arena, t_begin, t_end, all_fields, [&](const RowBatch& b, size_t i) {
+            b.read_row(i, reinterpret_cast<std::byte*>(&out.emplace_back()));
+        });
+        co_return out;
+    }
+
+    static auto aggregate_task(const QueryArena& arena, Executor& ex, const Table* table, Option<size_t> idx,
+                               i64 t_begin, i64 t_end, Agg agg) -> Task<Option<f64>>
+    {
+        co_await ex.schedule();
+
+        if (table == nullptr || idx.is_none()) co_return None;
+
+        const size_t f = idx.unwrap();
+        AggState state;
+        co_await table->async_for_each_in_range(ex, arena, t_begin, t_end, field_bit(f), [&](const RowBatch& b, size_t i) {
+            state.add(b.value(i, f));
+        });
+        co_return state.finish(agg);
+    }
+
+    // Tables are never removed, so the pointers outlive the lock.
+    [[nodiscard]] auto all_tables() -> std::vector<std::pair<TypeHandle, Table*>> {
+        std::shared_lock lock(mutex_);
+
+        std::vector<std::pair<TypeHandle, Table*>> out;
+        out.reserve(tables_.size());
+        for (auto& [handle, table] : tables_) out.emplace_back(handle, table.get());
+        return out;
+    }
+
+    // Moves one in-memory segment to a file under dir. The file is deleted once the cold
+    // segment is dropped, so the directory is spill space, not a durable copy.
+    auto spill(TypeHandle handle, Table& table, const std::shared_ptr<const Segment>& seg,
+               const std::filesystem::path& dir) -> bool
+    {
+        std::shared_ptr<const Segment> src = seg->tier == Tier::Hot ? table.encode(seg) : seg;
+
+        const auto path = dir / std::format("t{}-{}.seg", handle.v_, src->id);
+        if (write_segment_file(path, *src).is_err()) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            return false;
+        }
+
+        BufferPool*  pool;
+        AsyncReader* reader;
+        {
+            std::shared_lock lock(mutex_);
+            pool   = buffer_pool_.get();
+            reader = reader_.get();
+        }
+
+        auto cold = open_segment_file(path, table.layout(), true, pool, reader);
+        if (cold.is_err()) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            return false;
+        }
+
+        // Indexes stay in memory; they're small next to the columns and save loading them.
+        auto cold_seg = std::move(cold).unwrap();
+        for (size_t f = 0; f < cold_seg->columns.size(); ++f) {
+            if (const auto& index = src->columns[f].index) {
+                cold_seg->columns[f].index  = index;
+                cold_seg->memory_bytes     += index->memory_bytes();
+            }
+            if (const auto& agg = src->columns[f].agg) {
+                cold_seg->columns[f].agg  = agg;
+                cold_seg->memory_bytes   += agg->memory_bytes();
+            }
+            if (const auto& bitmaps = src->columns[f].bitmaps) {
+                cold_seg->columns[f].bitmaps  = bitmaps;
+                cold_seg->memory_bytes       += bitmaps->memory_bytes();
+            }
+        }
+        if (src->spatial) {
+            cold_seg->spatial       = src->spatial;
+            cold_seg->memory_bytes += src->spatial->memory_bytes();
+        }
+
+        return table.replace(seg, std::move(cold_seg));
+    }
+
     [[nodiscard]] auto get_or_create_table(TypeHandle type) -> Table& {
+        {
+            std::shared_lock lock(mutex_);
+            if (auto it = tables_.find(type); it != tables_.end()) {
+                return *it->second;
+            }
+        }
+
+        std::unique_lock lock(mutex_);
         if (auto it = tables_.find(type); it != tables_.end()) {
-            return it->second;
+            return *it->second;
         }
 
         auto&& fields = schema_.meta_of(type).fields;
 
         auto offsets = fields
-            | std::views::transform([](auto& f) { return f.offset; })
-            | std::ranges::to<std::vector<u32>>();
+            | std::views::transform([](auto& f) { return size_t{f.offset}; })
+            | std::ranges::to<std::vector<size_t>>();
 
         auto sizes = fields
-            | std::views::transform([&](auto& f) { return schema_.meta_of(f.type).size; })
+            | std::views::transform([&](auto& f) { return size_t{schema_.meta_of(f.type).size}; })
             | std::ranges::to<std::vector<size_t>>();
 
-        return tables_.emplace(type, Table {std::move(sizes), {offsets.begin(), offsets.end()}}).first->second;
+        auto kinds = fields
+            | std::views::transform([&](auto& f) { return schema_.meta_of(f.type).kind; })
+            | std::ranges::to<std::vector<Schema::TypeKind>>();
+
+        auto table = std::make_unique<Table>(Layout {
+            .sizes   = std::move(sizes),
+            .offsets = std::move(offsets),
+            .kinds   = std::move(kinds),
+        });
+        if (flush_signal_) table->set_flusher(flush_signal_, flush_opts_);
+        table->set_ingest_limits(ingest_limits_);
+        return *tables_.emplace(type, std::move(table)).first->second;
     }
 
     Schema schema_;
-    absl::flat_hash_map<TypeHandle, Table> tables_;
+
+    // Guards schema_, the table map, buffer_pool_, reader_ and result_cache_; each Table carries its own lock for row data.
+    mutable std::shared_mutex mutex_;
+
+    // Declared before the tables so they outlive the cold segments reading through them. The
+    // reader goes first: draining it completes (and releases) any prefetches still in flight.
+    std::unique_ptr<BufferPool>  buffer_pool_;
+    std::unique_ptr<AsyncReader> reader_;
+    std::unique_ptr<ResultCache> result_cache_;
+    absl::flat_hash_map<TypeHandle, std::unique_ptr<Table>> tables_;
+
+    absl::flat_hash_map<TypeHandle, std::vector<std::shared_ptr<Rollup>>> rollups_;   // by source; guarded by mutex_
+    absl::flat_hash_map<TypeHandle, std::vector<DownsampledField>>        downsampled_;   // guarded by mutex_
+
+    using SubscriberList = std::vector<std::shared_ptr<Subscription>>;
+    absl::flat_hash_map<TypeHandle, std::shared_ptr<const SubscriberList>> subscribers_;   // guarded by mutex_
+    std::atomic<bool> has_subscribers_ = false;
+    std::atomic<bool> has_rollups_ = false;
+
+    std::shared_ptr<FlushSignal> flush_signal_;   // guarded by mutex_
+    FlushOptions                 flush_opts_;
+    IngestLimits                 ingest_limits_;               // guarded by mutex_
+
+    PeriodicTask compactor_;
+    PeriodicTask tierer_;
+    std::jthread flusher_;
 };